@@ -0,0 +1,43 @@
+#ifndef COUNTALLOC_H
+#define COUNTALLOC_H
+
+/* Replaces global operator new/delete to count all heap allocations.
+ * For benchmarks.  Include in exactly one source file of an executable.
+ */
+
+#include <stdlib.h>
+#include <new>
+
+#include <epicsAtomic.h>
+
+#if __cplusplus>=201103L
+#  define THROW_BAD_ALLOC
+#  define THROW_NOTHING noexcept
+#else
+#  define THROW_BAD_ALLOC throw(std::bad_alloc)
+#  define THROW_NOTHING throw()
+#endif
+
+static size_t nallocs;
+
+//! number of calls to operator new so far
+static size_t countAllocs() { return epicsAtomicGetSizeT(&nallocs); }
+
+void* operator new(std::size_t size) THROW_BAD_ALLOC
+{
+    epicsAtomicIncrSizeT(&nallocs);
+    void *ret = malloc(size ? size : 1u);
+    if(!ret)
+        throw std::bad_alloc();
+    return ret;
+}
+
+void operator delete(void *ptr) THROW_NOTHING
+{
+    free(ptr);
+}
+
+#undef THROW_BAD_ALLOC
+#undef THROW_NOTHING
+
+#endif // COUNTALLOC_H
@@ -87,8 +87,12 @@ private:
     typedef std::deque<epics::pvAccess::MonitorElementPtr> buffer_t;
     bool inoverflow;
     bool running;
+    bool sharing; // a snapshot has been queued.  released elements may hold a shared PVStructure
     size_t nbuffers;
-    buffer_t inuse, empty;
+    buffer_t inuse, empty; // 'empty' may hold elements w/o PVStructure when sharing
+
+    // only set during post() of a snapshot
+    epics::pvData::PVStructurePtr snap;
 
 public:
     BaseMonitor(epicsMutex& lock,
@@ -98,6 +102,7 @@ public:
         ,requester(requester)
         ,inoverflow(false)
         ,running(false)
+        ,sharing(false)
         ,nbuffers(2)
     {}
 
@@ -200,6 +205,7 @@ public:
 
         } else {
 
+            overflow |= overflowed;
             changed |= updated;
             if(p_postone())
                 req = requester.lock();
@@ -213,6 +219,51 @@ public:
         return !oflow;
     }
 
+    /** post update with changed, queuing a reference to 'snapshot' instead of copying .complete
+     *
+     * 'snapshot' must be a copy of .complete, and must not be modified once post()'d.
+     * The same snapshot may be post()'d to many monitors.  See makeSnapshot()
+     */
+    bool post(guard_t& guard,
+              const epics::pvData::BitSet& updated,
+              const epics::pvData::PVStructurePtr& snapshot)
+    {
+        guard.assertIdenticalMutex(lock);
+        sharing = true;
+        snap = snapshot;
+        bool ret = post(guard, updated);
+        snap.reset();
+        return ret;
+    }
+
+    //! post update with changed and overflowed masks, queuing a reference to 'snapshot'
+    bool post(guard_t& guard,
+              const epics::pvData::BitSet& updated,
+              const epics::pvData::BitSet& overflowed,
+              const epics::pvData::PVStructurePtr& snapshot)
+    {
+        guard.assertIdenticalMutex(lock);
+        sharing = true;
+        snap = snapshot;
+        bool ret = post(guard, updated, overflowed);
+        snap.reset();
+        return ret;
+    }
+
+    /** Copy 'value' into 'snapshot' for post().
+     *
+     * Re-uses 'snapshot' if it is no longer referenced by any monitor queue,
+     * otherwise allocates a new PVStructure.  Call with the lock held which is
+     * passed to post(), as this prevents new references from being taken.
+     */
+    static void makeSnapshot(epics::pvData::PVStructurePtr& snapshot,
+                             const epics::pvData::PVStructure& value)
+    {
+        if(!snapshot || !snapshot.unique())
+            snapshot = epics::pvData::getPVDataCreate()->createPVStructure(value.getStructure());
+        snapshot->copyUnchecked(value);
+    }
+
     //! post update with changed
     bool post(guard_t& guard, const epics::pvData::BitSet& updated) {
         bool oflow;
@@ -248,8 +299,18 @@ private:
         assert(!empty.empty());
 
         epics::pvAccess::MonitorElementPtr& elem = empty.front();
+        // elements are re-used, only the PVStructure is replaced
+        epics::pvData::PVStructurePtr& value = const_cast<epics::pvData::PVStructurePtr&>(elem->pvStructurePtr);
 
-        elem->pvStructurePtr->copyUnchecked(*complete);
+        if(snap) {
+            // O(1) in the size of the value
+            value = snap;
+            snap.reset(); // not while unlocked for monitorEvent()
+        } else {
+            if(!value) // snapshot dropped by release()
+                value = epics::pvData::getPVDataCreate()->createPVStructure(complete->getStructure());
+            value->copyUnchecked(*complete);
+        }
         *elem->changedBitSet = changed;
         *elem->overrunBitSet = overflow;
 
@@ -330,6 +391,10 @@ private:
         BaseMonitor::shared_pointer self;
         {
             guard_t G(lock);
+            if(sharing && elem->pvStructurePtr && !elem->pvStructurePtr.unique()) {
+                // drop reference to a snapshot, which may then be re-used by makeSnapshot()
+                const_cast<epics::pvData::PVStructurePtr&>(elem->pvStructurePtr).reset();
+            }
             empty.push_back(elem);
             if(inoverflow)
                 self = weakself.lock(); //TODO: concurrent release?
@@ -151,6 +151,62 @@ void TestChannelPutRequester::getDone(
 }
 
 
+static size_t countTestChannelArrayRequester;
+
+TestChannelArrayRequester::TestChannelArrayRequester()
+    :connected(false)
+    ,doneGet(false)
+    ,doneLength(false)
+    ,length(0u)
+{
+    epicsAtomicIncrSizeT(&countTestChannelArrayRequester);
+}
+
+TestChannelArrayRequester::~TestChannelArrayRequester()
+{
+    epicsAtomicDecrSizeT(&countTestChannelArrayRequester);
+}
+
+void TestChannelArrayRequester::channelArrayConnect(
+        const pvd::Status& status,
+        pva::ChannelArray::shared_pointer const & channelArray,
+        pvd::Array::const_shared_pointer const & array)
+{
+    statusConnect = status;
+    this->array = channelArray;
+    connected = true;
+}
+
+void TestChannelArrayRequester::putArrayDone(
+        const pvd::Status& status,
+        pva::ChannelArray::shared_pointer const & channelArray)
+{}
+
+void TestChannelArrayRequester::getArrayDone(
+        const pvd::Status& status,
+        pva::ChannelArray::shared_pointer const & channelArray,
+        pvd::PVArray::shared_pointer const & pvArray)
+{
+    statusGet = status;
+    value = pvArray;
+    doneGet = true;
+}
+
+void TestChannelArrayRequester::getLengthDone(
+        const pvd::Status& status,
+        pva::ChannelArray::shared_pointer const & channelArray,
+        size_t length)
+{
+    statusLength = status;
+    this->length = length;
+    doneLength = true;
+}
+
+void TestChannelArrayRequester::setLengthDone(
+        const pvd::Status& status,
+        pva::ChannelArray::shared_pointer const & channelArray)
+{}
+
 static size_t countTestChannelMonitorRequester;
 
 TestChannelMonitorRequester::TestChannelMonitorRequester()
@@ -262,6 +318,238 @@ TestPVChannel::createMonitor(
     return ret;
 }
 
+pva::ChannelGet::shared_pointer
+TestPVChannel::createChannelGet(
+        pva::ChannelGetRequester::shared_pointer const & requester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    shared_pointer self(weakself);
+    TestPVGet::shared_pointer ret(new TestPVGet(self, requester));
+    ret->weakself = ret;
+    testDiag("TestPVChannel::createChannelGet %s %p", pv->name.c_str(), ret.get());
+    requester->channelGetConnect(pvd::Status(), ret, pv->dtype);
+    return ret;
+}
+
+static size_t countTestPVGet;
+
+TestPVGet::TestPVGet(const TestPVChannel::shared_pointer& ch,
+                     const pva::ChannelGetRequester::shared_pointer& req)
+    :channel(ch)
+    ,requester(req)
+{
+    epicsAtomicIncrSizeT(&countTestPVGet);
+}
+
+TestPVGet::~TestPVGet()
+{
+    epicsAtomicDecrSizeT(&countTestPVGet);
+}
+
+void TestPVGet::get()
+{
+    TestPV *pv = channel->pv.get();
+    {
+        Guard G(pv->lock);
+        pv->ngets++;
+        testDiag("TestPVGet::get %s %p defer=%d", pv->name.c_str(), this, (int)pv->defer);
+        if(pv->defer) {
+            pv->pendingget.push_back(weakself);
+            return;
+        }
+    }
+    done();
+}
+
+void TestPVGet::done()
+{
+    pva::ChannelGetRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+
+    TestPV *pv = channel->pv.get();
+    pvd::PVStructurePtr value(pv->factory->createPVStructure(pv->dtype));
+    pvd::BitSet::shared_pointer changed(new pvd::BitSet);
+    changed->set(0);
+    {
+        Guard G(pv->lock);
+        value->copyUnchecked(*pv->value);
+    }
+    req->getDone(pvd::Status(), shared_pointer(weakself), value, changed);
+}
+
+pva::ChannelPut::shared_pointer
+TestPVChannel::createChannelPut(
+        pva::ChannelPutRequester::shared_pointer const & requester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    shared_pointer self(weakself);
+    TestPVPut::shared_pointer ret(new TestPVPut(self, requester));
+    ret->weakself = ret;
+    testDiag("TestPVChannel::createChannelPut %s %p", pv->name.c_str(), ret.get());
+    requester->channelPutConnect(pvd::Status(), ret, pv->dtype);
+    return ret;
+}
+
+static size_t countTestPVPut;
+
+TestPVPut::TestPVPut(const TestPVChannel::shared_pointer& ch,
+                     const pva::ChannelPutRequester::shared_pointer& req)
+    :channel(ch)
+    ,requester(req)
+    ,getting(false)
+{
+    epicsAtomicIncrSizeT(&countTestPVPut);
+}
+
+TestPVPut::~TestPVPut()
+{
+    epicsAtomicDecrSizeT(&countTestPVPut);
+}
+
+void TestPVPut::put(pvd::PVStructure::shared_pointer const & pvPutStructure,
+                    pvd::BitSet::shared_pointer const & putBitSet)
+{
+    TestPV *pv = channel->pv.get();
+    {
+        Guard G(pv->lock);
+        pv->nputs++;
+        testDiag("TestPVPut::put %s %p changed '%s' defer=%d", pv->name.c_str(), this,
+                 toString(*putBitSet).c_str(), (int)pv->defer);
+        pv->value->copyUnchecked(*pvPutStructure, *putBitSet);
+        getting = false;
+        if(pv->defer) {
+            pv->pendingput.push_back(weakself);
+            return;
+        }
+    }
+    done();
+}
+
+void TestPVPut::get()
+{
+    TestPV *pv = channel->pv.get();
+    {
+        Guard G(pv->lock);
+        pv->ngets++;
+        testDiag("TestPVPut::get %s %p defer=%d", pv->name.c_str(), this, (int)pv->defer);
+        getting = true;
+        if(pv->defer) {
+            pv->pendingput.push_back(weakself);
+            return;
+        }
+    }
+    done();
+}
+
+void TestPVPut::done()
+{
+    pva::ChannelPutRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+
+    TestPV *pv = channel->pv.get();
+    pvd::PVStructurePtr value;
+    pvd::BitSet::shared_pointer changed;
+    {
+        Guard G(pv->lock);
+        if(getting) {
+            value = pv->factory->createPVStructure(pv->dtype);
+            value->copyUnchecked(*pv->value);
+            changed.reset(new pvd::BitSet);
+            changed->set(0);
+        }
+    }
+    if(value)
+        req->getDone(pvd::Status(), shared_pointer(weakself), value, changed);
+    else
+        req->putDone(pvd::Status(), shared_pointer(weakself));
+}
+
+pva::ChannelArray::shared_pointer
+TestPVChannel::createChannelArray(
+        pva::ChannelArrayRequester::shared_pointer const & requester,
+        pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    shared_pointer self(weakself);
+    TestPVArray::shared_pointer ret(new TestPVArray(self, requester));
+    ret->weakself = ret;
+    testDiag("TestPVChannel::createChannelArray %s %p", pv->name.c_str(), ret.get());
+    pvd::FieldConstPtr fld(pv->dtype->getField("value"));
+    if(fld && fld->getType()==pvd::scalarArray)
+        requester->channelArrayConnect(pvd::Status(), ret, std::tr1::static_pointer_cast<const pvd::Array>(fld));
+    else
+        requester->channelArrayConnect(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "No value array"),
+                                       ret, pvd::Array::const_shared_pointer());
+    return ret;
+}
+
+static size_t countTestPVArray;
+
+TestPVArray::TestPVArray(const TestPVChannel::shared_pointer& ch,
+                         const pva::ChannelArrayRequester::shared_pointer& req)
+    :channel(ch)
+    ,requester(req)
+{
+    epicsAtomicIncrSizeT(&countTestPVArray);
+}
+
+TestPVArray::~TestPVArray()
+{
+    epicsAtomicDecrSizeT(&countTestPVArray);
+}
+
+void TestPVArray::putArray(pvd::PVArray::shared_pointer const & putArray,
+                           size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->putArrayDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not implemented"), shared_pointer(weakself));
+}
+
+void TestPVArray::getArray(size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+
+    TestPV *pv = channel->pv.get();
+    pvd::PVScalarArray::shared_pointer ret;
+    {
+        Guard G(pv->lock);
+        pv->ngetarrays++;
+        pvd::PVScalarArray::shared_pointer value(pv->value->getSubFieldT<pvd::PVScalarArray>("value"));
+        ret = pv->factory->createPVScalarArray(value->getScalarArray()->getElementType());
+        // offset, count, and stride are ignored
+        ret->assign(*value);
+    }
+    testDiag("TestPVArray::getArray %s %p", pv->name.c_str(), this);
+    req->getArrayDone(pvd::Status(), shared_pointer(weakself), ret);
+}
+
+void TestPVArray::getLength()
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+
+    TestPV *pv = channel->pv.get();
+    size_t len;
+    {
+        Guard G(pv->lock);
+        pv->ngetlengths++;
+        len = pv->value->getSubFieldT<pvd::PVScalarArray>("value")->getLength();
+    }
+    req->getLengthDone(pvd::Status(), shared_pointer(weakself), len);
+}
+
+void TestPVArray::setLength(size_t length)
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->setLengthDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not implemented"), shared_pointer(weakself));
+}
+
 static size_t countTestPVMonitor;
 
 TestPVMonitor::TestPVMonitor(const TestPVChannel::shared_pointer& ch,
@@ -399,6 +687,11 @@ TestPV::TestPV(const std::string& name,
     ,factory(pvd::PVDataCreate::getPVDataCreate())
     ,dtype(dtype)
     ,value(factory->createPVStructure(dtype))
+    ,defer(false)
+    ,ngets(0u)
+    ,nputs(0u)
+    ,ngetarrays(0u)
+    ,ngetlengths(0u)
 {
     epicsAtomicIncrSizeT(&countTestPV);
 }
@@ -495,6 +788,29 @@ void TestPV::disconnect()
     }
 }
 
+void TestPV::complete()
+{
+    std::deque<std::tr1::weak_ptr<TestPVGet> > gets;
+    std::deque<std::tr1::weak_ptr<TestPVPut> > puts;
+    {
+        Guard G(lock);
+        gets.swap(pendingget);
+        puts.swap(pendingput);
+    }
+    testDiag("complete %s %u get %u put", name.c_str(), (unsigned)gets.size(), (unsigned)puts.size());
+
+    for(size_t i=0; i<gets.size(); i++) {
+        TestPVGet::shared_pointer get(gets[i].lock());
+        if(get)
+            get->done();
+    }
+    for(size_t i=0; i<puts.size(); i++) {
+        TestPVPut::shared_pointer put(puts[i].lock());
+        if(put)
+            put->done();
+    }
+}
+
 static size_t countTestProvider;
 
 TestProvider::TestProvider()
@@ -628,6 +944,10 @@ void TestProvider::testCounts()
     TESTC(TestPV);
     TESTC(TestPVChannel);
     TESTC(TestPVMonitor);
+    TESTC(TestPVGet);
+    TESTC(TestPVPut);
+    TESTC(TestPVArray);
+    TESTC(TestChannelArrayRequester);
 #undef TESTC
     testOk(ok, "All instances free'd");
 }
@@ -19,6 +19,9 @@
 struct TestPV;
 struct TestPVChannel;
 struct TestPVMonitor;
+struct TestPVGet;
+struct TestPVPut;
+struct TestPVArray;
 struct TestProvider;
 
 // minimally useful boilerplate which must appear *everywhere*
@@ -152,6 +155,40 @@ struct TestChannelPutRequester : public epics::pvAccess::ChannelPutRequester
             epics::pvData::BitSet::shared_pointer const & bitSet);
 };
 
+struct TestChannelArrayRequester : public epics::pvAccess::ChannelArrayRequester
+{
+    POINTER_DEFINITIONS(TestChannelArrayRequester);
+    DUMBREQUESTER(TestChannelArrayRequester)
+
+    bool connected, doneGet, doneLength;
+    epics::pvData::Status statusConnect, statusGet, statusLength;
+    epics::pvAccess::ChannelArray::shared_pointer array;
+    epics::pvData::PVArray::shared_pointer value;
+    size_t length;
+
+    TestChannelArrayRequester();
+    virtual ~TestChannelArrayRequester();
+
+    virtual void channelArrayConnect(
+            const epics::pvData::Status& status,
+            epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+            epics::pvData::Array::const_shared_pointer const & array);
+    virtual void putArrayDone(
+            const epics::pvData::Status& status,
+            epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+    virtual void getArrayDone(
+            const epics::pvData::Status& status,
+            epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+            epics::pvData::PVArray::shared_pointer const & pvArray);
+    virtual void getLengthDone(
+            const epics::pvData::Status& status,
+            epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+            size_t length);
+    virtual void setLengthDone(
+            const epics::pvData::Status& status,
+            epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+};
+
 struct TestChannelMonitorRequester : public epics::pvData::MonitorRequester
 {
     POINTER_DEFINITIONS(TestChannelMonitorRequester);
@@ -203,6 +240,95 @@ struct TestPVChannel : public BaseChannel
     virtual epics::pvData::Monitor::shared_pointer createMonitor(
             epics::pvData::MonitorRequester::shared_pointer const & monitorRequester,
             epics::pvData::PVStructure::shared_pointer const & pvRequest);
+
+    virtual epics::pvAccess::ChannelGet::shared_pointer createChannelGet(
+            epics::pvAccess::ChannelGetRequester::shared_pointer const & channelGetRequester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest);
+
+    virtual epics::pvAccess::ChannelPut::shared_pointer createChannelPut(
+            epics::pvAccess::ChannelPutRequester::shared_pointer const & channelPutRequester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest);
+
+    virtual epics::pvAccess::ChannelArray::shared_pointer createChannelArray(
+            epics::pvAccess::ChannelArrayRequester::shared_pointer const & channelArrayRequester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest);
+};
+
+struct TestPVGet : public epics::pvAccess::ChannelGet
+{
+    POINTER_DEFINITIONS(TestPVGet);
+    std::tr1::weak_ptr<TestPVGet> weakself;
+
+    const TestPVChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelGetRequester::weak_pointer requester;
+
+    TestPVGet(const TestPVChannel::shared_pointer& ch,
+              const epics::pvAccess::ChannelGetRequester::shared_pointer& req);
+    virtual ~TestPVGet();
+
+    virtual void destroy() {}
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+
+    virtual void get();
+
+    // send a copy of the current value
+    void done();
+};
+
+struct TestPVPut : public epics::pvAccess::ChannelPut
+{
+    POINTER_DEFINITIONS(TestPVPut);
+    std::tr1::weak_ptr<TestPVPut> weakself;
+
+    const TestPVChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelPutRequester::weak_pointer requester;
+
+    // guarded by TestPV::lock.  last operation was get()
+    bool getting;
+
+    TestPVPut(const TestPVChannel::shared_pointer& ch,
+              const epics::pvAccess::ChannelPutRequester::shared_pointer& req);
+    virtual ~TestPVPut();
+
+    virtual void destroy() {}
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+
+    // value is applied immediately, completion may be deferred
+    virtual void put(epics::pvData::PVStructure::shared_pointer const & pvPutStructure,
+                     epics::pvData::BitSet::shared_pointer const & putBitSet);
+    virtual void get();
+
+    // complete the last put() or get()
+    void done();
+};
+
+// ChannelArray of the 'value' field, which must be a scalar array.  Only reads are implemented.
+struct TestPVArray : public epics::pvAccess::ChannelArray
+{
+    POINTER_DEFINITIONS(TestPVArray);
+    std::tr1::weak_ptr<TestPVArray> weakself;
+
+    const TestPVChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelArrayRequester::weak_pointer requester;
+
+    TestPVArray(const TestPVChannel::shared_pointer& ch,
+                const epics::pvAccess::ChannelArrayRequester::shared_pointer& req);
+    virtual ~TestPVArray();
+
+    virtual void destroy() {}
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel() {}
+    virtual void lastRequest() {}
+
+    virtual void putArray(epics::pvData::PVArray::shared_pointer const & putArray,
+                          size_t offset, size_t count, size_t stride);
+    virtual void getArray(size_t offset, size_t count, size_t stride);
+    virtual void getLength();
+    virtual void setLength(size_t length);
 };
 
 struct TestPVMonitor : public epics::pvData::Monitor
@@ -257,8 +383,21 @@ struct TestPV
 
     void disconnect();
 
+    // complete all deferred operations
+    void complete();
+
     mutable epicsMutex lock;
 
+    // guarded by lock.
+    // when true, get() and put() are queued until complete()
+    bool defer;
+    // # of get() (either ChannelGet or ChannelPut) and put() requested
+    size_t ngets, nputs;
+    // # of ChannelArray getArray() and getLength() requested
+    size_t ngetarrays, ngetlengths;
+    std::deque<std::tr1::weak_ptr<TestPVGet> > pendingget;
+    std::deque<std::tr1::weak_ptr<TestPVPut> > pendingput;
+
     typedef weak_set<TestPVChannel> channels_t;
     channels_t channels;
     friend struct TestProvider;
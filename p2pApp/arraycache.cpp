@@ -0,0 +1,671 @@
+
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsTime.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "chancache.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+// max. age in seconds of a complete array held by an ArrayCacheEntry
+double p2pArrayCacheAge = 1.0;
+
+size_t GWArray::num_instances;
+size_t ArrayCacheEntry::num_instances;
+size_t ArrayCacheEntry::URequester::num_instances;
+
+namespace {
+
+template<typename T>
+void sliceT(pvd::PVScalarArray& dest, const pvd::PVScalarArray& src,
+            size_t offset, size_t count, size_t stride)
+{
+    pvd::shared_vector<const T> in;
+    src.getAs<T>(in); // no copy
+
+    const size_t len = in.size();
+    if(offset>len)
+        offset = len;
+    const size_t avail = (len-offset+stride-1)/stride;
+    if(count==0 || count>avail)
+        count = avail;
+
+    if(stride==1) {
+        in.slice(offset, count); // still no copy
+        dest.putFrom<T>(in);
+
+    } else {
+        pvd::shared_vector<T> out(count);
+        for(size_t i=0; i<count; i++)
+            out[i] = in[offset + i*stride];
+        dest.putFrom<T>(pvd::freeze(out));
+    }
+}
+
+// complete a downstream getArray() with a slice of 'full'
+void arrayDone(const GWArray::shared_pointer& array, const pvd::Status& status,
+               const pvd::PVScalarArray::shared_pointer& full,
+               size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArrayRequester::shared_pointer req(array->requester.lock());
+    if(!req)
+        return;
+
+    pvd::ScalarArrayConstPtr type;
+    {
+        Guard G(array->mutex);
+        type = array->type;
+    }
+
+    if(!status.isSuccess() || !full) {
+        req->getArrayDone(status, array, pvd::PVArrayPtr());
+
+    } else if(!type || type->getElementType()!=full->getScalarArray()->getElementType()) {
+        req->getArrayDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream type changed"),
+                          array, pvd::PVArrayPtr());
+
+    } else {
+        req->getArrayDone(status, array, GWArray::slice(*full, offset, count, stride));
+    }
+}
+
+} // namespace
+
+GWArray::GWArray(const GWChannel::shared_pointer& chan,
+                 const pva::ChannelArrayRequester::shared_pointer& req,
+                 const pvd::PVStructure::shared_pointer& pvRequest)
+    :channel(chan)
+    ,requester(req)
+    ,pvRequest(pvRequest)
+    ,field(arrayField(pvRequest))
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GWArray::~GWArray()
+{
+    destroy();
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+std::string
+GWArray::arrayField(const pvd::PVStructure::shared_pointer& pvRequest)
+{
+    pvd::PVStructurePtr fld(pvRequest ? pvRequest->getSubField<pvd::PVStructure>("field") : pvd::PVStructurePtr());
+    if(!fld || fld->getPVFields().empty())
+        return "value"; // server's default
+
+    std::string ret;
+    while(fld && !fld->getPVFields().empty()) {
+        const pvd::PVFieldPtrArray& fields = fld->getPVFields();
+        if(fields.size()!=1)
+            return std::string(); // more than one field selected
+
+        if(!ret.empty())
+            ret += '.';
+        ret += fields[0]->getFieldName();
+        fld = std::tr1::dynamic_pointer_cast<pvd::PVStructure>(fields[0]);
+    }
+    return ret;
+}
+
+pvd::PVScalarArray::shared_pointer
+GWArray::slice(const pvd::PVScalarArray& src, size_t offset, size_t count, size_t stride)
+{
+    const pvd::ScalarType stype = src.getScalarArray()->getElementType();
+    pvd::PVScalarArray::shared_pointer ret(pvd::getPVDataCreate()->createPVScalarArray(stype));
+
+    if(stride==0)
+        stride = 1;
+
+    switch(stype) {
+    case pvd::pvBoolean: sliceT<pvd::boolean>(*ret, src, offset, count, stride); break;
+    case pvd::pvByte:    sliceT<pvd::int8>(*ret, src, offset, count, stride); break;
+    case pvd::pvShort:   sliceT<pvd::int16>(*ret, src, offset, count, stride); break;
+    case pvd::pvInt:     sliceT<pvd::int32>(*ret, src, offset, count, stride); break;
+    case pvd::pvLong:    sliceT<pvd::int64>(*ret, src, offset, count, stride); break;
+    case pvd::pvUByte:   sliceT<pvd::uint8>(*ret, src, offset, count, stride); break;
+    case pvd::pvUShort:  sliceT<pvd::uint16>(*ret, src, offset, count, stride); break;
+    case pvd::pvUInt:    sliceT<pvd::uint32>(*ret, src, offset, count, stride); break;
+    case pvd::pvULong:   sliceT<pvd::uint64>(*ret, src, offset, count, stride); break;
+    case pvd::pvFloat:   sliceT<float>(*ret, src, offset, count, stride); break;
+    case pvd::pvDouble:  sliceT<double>(*ret, src, offset, count, stride); break;
+    case pvd::pvString:  sliceT<std::string>(*ret, src, offset, count, stride); break;
+    }
+    return ret;
+}
+
+void
+GWArray::destroy()
+{
+    pva::ChannelArray::shared_pointer U;
+    ArrayCacheEntry::shared_pointer E;
+    {
+        Guard G(mutex);
+        U.swap(upstream);
+        E.swap(aent);
+    }
+    if(U)
+        U->destroy();
+}
+
+std::tr1::shared_ptr<pva::Channel>
+GWArray::getChannel()
+{
+    return channel;
+}
+
+void
+GWArray::cancel()
+{
+    pva::ChannelArray::shared_pointer U;
+    {
+        Guard G(mutex);
+        U = upstream;
+    }
+    if(U)
+        U->cancel();
+}
+
+void
+GWArray::lastRequest()
+{
+    pva::ChannelArray::shared_pointer U;
+    {
+        Guard G(mutex);
+        U = upstream;
+    }
+    if(U)
+        U->lastRequest();
+}
+
+void
+GWArray::putArray(pvd::PVArray::shared_pointer const & putArray,
+                  size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArray::shared_pointer U;
+    {
+        Guard G(mutex);
+        U = upstream;
+    }
+    if(U) {
+        U->putArray(putArray, offset, count, stride);
+    } else {
+        pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+        if(req)
+            req->putArrayDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"), shared_pointer(weakref));
+    }
+}
+
+void
+GWArray::getArray(size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakref);
+
+    ChannelCacheEntry *entry = channel->entry.get();
+    epicsAtomicIncrSizeT(&entry->ngetarray);
+
+    pva::ChannelArray::shared_pointer U;
+    pvd::ScalarArrayConstPtr T;
+    ArrayCacheEntry::shared_pointer E;
+    {
+        Guard G(mutex);
+        U = upstream;
+        T = type;
+        E = aent;
+    }
+
+    if(!U) {
+        req->getArrayDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"), self, pvd::PVArrayPtr());
+        return;
+
+    } else if(!T || field.empty()) {
+        // not a scalar array, or can't tell which field was selected
+        U->getArray(offset, count, stride);
+        return;
+    }
+
+    // look for a subscription which includes our field, and has its current value.
+    // ignore subscriptions with _options, which may have been filtered upstream (eg. array slice).
+    pvd::PVScalarArray::shared_pointer result;
+    {
+        ChannelCacheEntry::mon_entries_t::lock_vector_type mons(entry->mon_entries.lock_vector());
+
+        FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it, end, mons)
+        {
+            MonitorCacheEntry::shared_pointer M(it->second);
+            if(M->fieldopts)
+                continue;
+            Guard G(M->mutex());
+            if(!M->fresh())
+                continue;
+            pvd::PVScalarArray::shared_pointer A(M->lastelem->pvStructurePtr->getSubField<pvd::PVScalarArray>(field));
+            if(!A || A->getScalarArray()->getElementType()!=T->getElementType())
+                continue;
+            // lastelem may be updated after we unlock, but array values are never modified in place
+            result = slice(*A, offset, count, stride);
+            break;
+        }
+    }
+
+    if(result) {
+        epicsAtomicIncrSizeT(&entry->ngetarraycached);
+        req->getArrayDone(pvd::Status::Ok, self, result);
+        return;
+    }
+
+    // Fetch the complete array, shared with other clients
+    if(!E) {
+        E = ArrayCacheEntry::lookup(entry, field, pvRequest);
+        Guard G(mutex);
+        if(!aent)
+            aent = E;
+    }
+
+    E->getArray(self, offset, count, stride);
+}
+
+void
+GWArray::getLength()
+{
+    pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+
+    pva::ChannelArray::shared_pointer U;
+    pvd::ScalarArrayConstPtr T;
+    {
+        Guard G(mutex);
+        U = upstream;
+        T = type;
+    }
+
+    if(T && !field.empty()) {
+        ChannelCacheEntry::mon_entries_t::lock_vector_type mons(channel->entry->mon_entries.lock_vector());
+
+        FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it, end, mons)
+        {
+            MonitorCacheEntry::shared_pointer M(it->second);
+            if(M->fieldopts)
+                continue;
+            size_t len;
+            {
+                Guard G(M->mutex());
+                if(!M->fresh())
+                    continue;
+                pvd::PVScalarArray::shared_pointer A(M->lastelem->pvStructurePtr->getSubField<pvd::PVScalarArray>(field));
+                if(!A)
+                    continue;
+                len = A->getLength();
+            }
+            req->getLengthDone(pvd::Status::Ok, shared_pointer(weakref), len);
+            return;
+        }
+    }
+
+    if(U)
+        U->getLength();
+    else
+        req->getLengthDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"), shared_pointer(weakref), 0);
+}
+
+void
+GWArray::setLength(size_t length)
+{
+    pva::ChannelArray::shared_pointer U;
+    {
+        Guard G(mutex);
+        U = upstream;
+    }
+    if(U) {
+        U->setLength(length);
+    } else {
+        pva::ChannelArrayRequester::shared_pointer req(requester.lock());
+        if(req)
+            req->setLengthDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"), shared_pointer(weakref));
+    }
+}
+
+GWArray::URequester::URequester(const GWArray::shared_pointer& p)
+    :owner(p)
+{}
+
+GWArray::URequester::~URequester() {}
+
+std::string
+GWArray::URequester::getRequesterName()
+{
+    GWArray::shared_pointer self(owner.lock());
+    pva::ChannelArrayRequester::shared_pointer req;
+    if(self)
+        req = self->requester.lock();
+    return req ? req->getRequesterName() : std::string("GWArray");
+}
+
+void
+GWArray::URequester::channelDisconnect(bool destroy)
+{
+    GWArray::shared_pointer self(owner.lock());
+    pva::ChannelArrayRequester::shared_pointer req;
+    if(self)
+        req = self->requester.lock();
+    if(req)
+        req->channelDisconnect(destroy);
+}
+
+void
+GWArray::URequester::channelArrayConnect(const pvd::Status& status,
+                                         pva::ChannelArray::shared_pointer const & channelArray,
+                                         pvd::Array::const_shared_pointer const & array)
+{
+    GWArray::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+    {
+        Guard G(self->mutex);
+        self->upstream = channelArray;
+        self->type = std::tr1::dynamic_pointer_cast<const pvd::ScalarArray>(array);
+    }
+    pva::ChannelArrayRequester::shared_pointer req(self->requester.lock());
+    if(req)
+        req->channelArrayConnect(status, self, array);
+}
+
+void
+GWArray::URequester::putArrayDone(const pvd::Status& status,
+                                  pva::ChannelArray::shared_pointer const & channelArray)
+{
+    GWArray::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+    ArrayCacheEntry::shared_pointer E;
+    {
+        Guard G(self->mutex);
+        E = self->aent;
+    }
+    if(E)
+        E->invalidate(); // so that we read back our own put
+    pva::ChannelArrayRequester::shared_pointer req(self->requester.lock());
+    if(req)
+        req->putArrayDone(status, self);
+}
+
+void
+GWArray::URequester::getArrayDone(const pvd::Status& status,
+                                  pva::ChannelArray::shared_pointer const & channelArray,
+                                  pvd::PVArray::shared_pointer const & pvArray)
+{
+    GWArray::shared_pointer self(owner.lock());
+    pva::ChannelArrayRequester::shared_pointer req;
+    if(self)
+        req = self->requester.lock();
+    if(req)
+        req->getArrayDone(status, self, pvArray);
+}
+
+void
+GWArray::URequester::getLengthDone(const pvd::Status& status,
+                                   pva::ChannelArray::shared_pointer const & channelArray,
+                                   size_t length)
+{
+    GWArray::shared_pointer self(owner.lock());
+    pva::ChannelArrayRequester::shared_pointer req;
+    if(self)
+        req = self->requester.lock();
+    if(req)
+        req->getLengthDone(status, self, length);
+}
+
+void
+GWArray::URequester::setLengthDone(const pvd::Status& status,
+                                   pva::ChannelArray::shared_pointer const & channelArray)
+{
+    GWArray::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+    ArrayCacheEntry::shared_pointer E;
+    {
+        Guard G(self->mutex);
+        E = self->aent;
+    }
+    if(E)
+        E->invalidate();
+    pva::ChannelArrayRequester::shared_pointer req(self->requester.lock());
+    if(req)
+        req->setLengthDone(status, self);
+}
+
+ArrayCacheEntry::ArrayCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+    :chan(ent)
+    ,pvRequest(pvr)
+    ,connected(false)
+    ,inflight(false)
+{
+    fetched.secPastEpoch = fetched.nsec = 0;
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+ArrayCacheEntry::~ArrayCacheEntry()
+{
+    pva::ChannelArray::shared_pointer U;
+    U.swap(upstream);
+    if(U) {
+        U->destroy();
+    }
+    epicsAtomicDecrSizeT(&num_instances);
+    const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
+}
+
+ArrayCacheEntry::shared_pointer
+ArrayCacheEntry::lookup(ChannelCacheEntry *ent, const std::string& field, const pvd::PVStructure::shared_pointer& pvr)
+{
+    ArrayCacheEntry::shared_pointer ret;
+
+    Guard G(ent->mutex());
+
+    ret = ent->array_entries.find(field);
+    if(!ret) {
+        ret.reset(new ArrayCacheEntry(ent, pvr));
+        ent->array_entries[field] = ret; // ref. wrapped
+        ret->weakref = ret;
+
+        // We've added an incomplete entry (no ChannelArray)
+        // which will queue getArray() until channelArrayConnect()
+        pva::ChannelArrayRequester::shared_pointer req(new URequester(ret));
+        pva::ChannelArray::shared_pointer C;
+        {
+            UnGuard U(G);
+
+            C = ent->channel->createChannelArray(req, pvr); // may call channelArrayConnect() recursively
+        }
+        Guard G2(ret->mutex);
+        if(!ret->upstream)
+            ret->upstream = C;
+    }
+
+    return ret;
+}
+
+void
+ArrayCacheEntry::getArray(const GWArray::shared_pointer& array, size_t offset, size_t count, size_t stride)
+{
+    pva::ChannelArray::shared_pointer U;
+    pvd::PVScalarArray::shared_pointer V;
+    pvd::Status fail;
+    bool failed = false;
+    {
+        Guard G(mutex);
+
+        epicsTimeStamp now;
+        epicsTimeGetCurrent(&now);
+
+        if(connected && !connectresult.isSuccess()) {
+            failed = true;
+            fail = connectresult;
+
+        } else if(value && epicsTimeDiffInSeconds(&now, &fetched)<p2pArrayCacheAge) {
+            V = value;
+
+        } else {
+            // if an upstream getArray() is in flight, we will be completed with its result
+            waiter_t W;
+            W.array = array;
+            W.offset = offset;
+            W.count = count;
+            W.stride = stride;
+            waiting.push_back(W);
+
+            if(!inflight && connected && upstream) {
+                inflight = true;
+                U = upstream;
+            }
+        }
+    }
+
+    if(V) {
+        epicsAtomicIncrSizeT(&chan->ngetarraycached);
+        arrayDone(array, pvd::Status::Ok, V, offset, count, stride);
+
+    } else if(U) {
+        epicsAtomicIncrSizeT(&chan->ngetarrayupstream);
+        U->getArray(0, 0, 1); // complete array
+
+    } else if(failed) {
+        arrayDone(array, fail, pvd::PVScalarArray::shared_pointer(), offset, count, stride);
+    }
+}
+
+void
+ArrayCacheEntry::invalidate()
+{
+    Guard G(mutex);
+    value.reset();
+}
+
+ArrayCacheEntry::URequester::URequester(const ArrayCacheEntry::shared_pointer& p)
+    :owner(p)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+ArrayCacheEntry::URequester::~URequester()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+std::string
+ArrayCacheEntry::URequester::getRequesterName()
+{
+    return "ArrayCacheEntry";
+}
+
+void
+ArrayCacheEntry::URequester::channelArrayConnect(const pvd::Status& status,
+                                                 pva::ChannelArray::shared_pointer const & channelArray,
+                                                 pvd::Array::const_shared_pointer const & array)
+{
+    ArrayCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    pvd::Status sts(status);
+    if(sts.isSuccess() && !std::tr1::dynamic_pointer_cast<const pvd::ScalarArray>(array))
+        sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream field is not a scalar array");
+
+    waiters_t tofail;
+    bool start = false;
+    {
+        Guard G(self->mutex);
+
+        self->upstream = channelArray;
+        self->connected = true;
+        self->connectresult = sts;
+
+        if(!sts.isSuccess()) {
+            tofail.swap(self->waiting);
+            self->inflight = false;
+
+        } else if(!self->waiting.empty()) {
+            // getArray()s queued before (re)connect
+            start = true;
+            self->inflight = true;
+        }
+    }
+
+    if(start) {
+        epicsAtomicIncrSizeT(&self->chan->ngetarrayupstream);
+        channelArray->getArray(0, 0, 1);
+    }
+
+    FOREACH(waiters_t::const_iterator, it, end, tofail) {
+        GWArray::shared_pointer array(it->array.lock());
+        if(array)
+            arrayDone(array, sts, pvd::PVScalarArray::shared_pointer(), 0, 0, 1);
+    }
+}
+
+void
+ArrayCacheEntry::URequester::putArrayDone(const pvd::Status& status,
+                                          pva::ChannelArray::shared_pointer const & channelArray)
+{} // we don't putArray()
+
+void
+ArrayCacheEntry::URequester::getArrayDone(const pvd::Status& status,
+                                          pva::ChannelArray::shared_pointer const & channelArray,
+                                          pvd::PVArray::shared_pointer const & pvArray)
+{
+    ArrayCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    pvd::Status sts(status);
+
+    // Upstream may re-use pvArray for the next getArray(), so keep our own reference to the array data
+    pvd::PVScalarArray::shared_pointer snap;
+    if(sts.isSuccess()) {
+        pvd::PVScalarArray::shared_pointer A(std::tr1::dynamic_pointer_cast<pvd::PVScalarArray>(pvArray));
+        if(A)
+            snap = GWArray::slice(*A, 0, 0, 1);
+        else
+            sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream provides no array");
+    }
+
+    waiters_t todo;
+    {
+        Guard G(self->mutex);
+        self->inflight = false;
+        todo.swap(self->waiting);
+        if(snap) {
+            self->value = snap;
+            epicsTimeGetCurrent(&self->fetched);
+        }
+    }
+
+    FOREACH(waiters_t::const_iterator, it, end, todo) {
+        GWArray::shared_pointer array(it->array.lock());
+        if(array)
+            arrayDone(array, sts, snap, it->offset, it->count, it->stride);
+    }
+}
+
+void
+ArrayCacheEntry::URequester::getLengthDone(const pvd::Status& status,
+                                           pva::ChannelArray::shared_pointer const & channelArray,
+                                           size_t length)
+{} // we don't getLength()
+
+void
+ArrayCacheEntry::URequester::setLengthDone(const pvd::Status& status,
+                                           pva::ChannelArray::shared_pointer const & channelArray)
+{} // we don't setLength()
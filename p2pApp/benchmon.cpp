@@ -0,0 +1,238 @@
+/* Throughput and latency of monitor updates through the gateway.
+ *
+ * Runs TestProvider -> GWServerChannelProvider -> downstream subscriptions
+ * in one process, sweeping the number of channels, subscribers per channel,
+ * size of the structure, and the rate of upstream updates.
+ * Each case is also run without the gateway ("direct") for reference.
+ *
+ * Usage: benchmon [seconds per case]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+
+#include <dbDefs.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsStdlib.h>
+
+#include <pv/epicsException.h>
+#include <pv/monitor.h>
+
+#include "server.h"
+
+#include "utilities.h"
+#include "countalloc.h"
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+namespace {
+
+pvd::PVStructurePtr makeRequest(size_t bsize)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("queueSize", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+
+    return ret;
+}
+
+// structure with a timestamp (epicsMonotonicGet() of post()) and 'nfields' doubles
+pvd::StructureConstPtr makeType(size_t nfields)
+{
+    pvd::FieldBuilderPtr builder(pvd::getFieldCreate()->createFieldBuilder());
+    builder->add("t", pvd::pvULong);
+    for(size_t i=0; i<nfields; i++) {
+        char name[16];
+        sprintf(name, "f%u", (unsigned)i);
+        builder->add(name, pvd::pvDouble);
+    }
+    return builder->createStructure();
+}
+
+// Polls and releases all updates when woken.  Shared by all subscriptions of a case.
+struct Consumer : public pvd::MonitorRequester
+{
+    POINTER_DEFINITIONS(Consumer);
+    DUMBREQUESTER(Consumer)
+
+    size_t nupdates;
+    std::vector<epicsUInt64> latency; // capacity is fixed before each run
+
+    Consumer() :nupdates(0) { latency.reserve(1u<<20); }
+    virtual ~Consumer() {}
+
+    void reset()
+    {
+        nupdates = 0;
+        latency.clear();
+    }
+
+    virtual void monitorConnect(pvd::Status const & status,
+                                pvd::MonitorPtr const & monitor,
+                                pvd::StructureConstPtr const & structure) {}
+
+    virtual void monitorEvent(pvd::MonitorPtr const & monitor)
+    {
+        pva::MonitorElementPtr elem;
+        while((elem=monitor->poll())) {
+            // "t" is the first field
+            epicsUInt64 sent = elem->pvStructurePtr->getSubFieldT<pvd::PVULong>(1)->get();
+            if(latency.size()<latency.capacity())
+                latency.push_back(epicsMonotonicGet()-sent);
+            nupdates++;
+            monitor->release(elem);
+        }
+    }
+
+    virtual void unlisten(pvd::MonitorPtr const & monitor) {}
+};
+
+struct Case {
+    size_t nchan, nsub, nfields;
+    double rate; // updates per second of each channel.  0 as fast as possible
+    bool direct; // bypass the gateway
+};
+
+void run(const Case& C, double seconds)
+{
+    TestProvider::shared_pointer upstream(new TestProvider());
+    pvd::StructureConstPtr type(makeType(C.nfields));
+
+    std::vector<TestPV::shared_pointer> pvs(C.nchan);
+    for(size_t i=0; i<C.nchan; i++) {
+        char name[16];
+        sprintf(name, "bench%u", (unsigned)i);
+        pvs[i] = upstream->addPV(name, type);
+    }
+
+    GWServerChannelProvider::shared_pointer gateway;
+    pva::ChannelProvider::shared_pointer prov(upstream);
+    if(!C.direct) {
+        gateway.reset(new GWServerChannelProvider(upstream));
+        prov = gateway;
+    }
+
+    Consumer::shared_pointer consumer(new Consumer);
+    std::vector<pva::Channel::shared_pointer> chans;
+    std::vector<pvd::Monitor::shared_pointer> mons;
+
+    for(size_t i=0; i<C.nchan; i++) {
+        TestChannelRequester::shared_pointer req(new TestChannelRequester);
+        pva::Channel::shared_pointer chan(prov->createChannel(pvs[i]->name, req));
+        if(!chan)
+            throw std::runtime_error("Channel not connected");
+        chans.push_back(chan);
+
+        for(size_t j=0; j<C.nsub; j++) {
+            pvd::Monitor::shared_pointer mon(chan->createMonitor(consumer, makeRequest(4)));
+            if(!mon || !mon->start().isSuccess())
+                throw std::runtime_error("Failed to start monitor");
+            mons.push_back(mon);
+        }
+    }
+    upstream->dispatch(); // initial updates
+
+    std::vector<pvd::PVULongPtr> stamps(C.nchan);
+    for(size_t i=0; i<C.nchan; i++)
+        stamps[i] = pvs[i]->value->getSubFieldT<pvd::PVULong>("t");
+
+    consumer->reset();
+    size_t nposted = 0;
+    const size_t allocs0 = countAllocs();
+    const epicsUInt64 start = epicsMonotonicGet(),
+                      end = start + epicsUInt64(seconds*1e9);
+    epicsUInt64 now = start;
+
+    for(size_t round=0; now<end; round++) {
+        if(C.rate>0.0) {
+            epicsUInt64 due = start + epicsUInt64(round*1e9/C.rate);
+            if(due>now)
+                epicsThreadSleep((due-now)*1e-9);
+        }
+
+        for(size_t i=0; i<C.nchan; i++) {
+            // all fields change
+            for(size_t f=2, N=pvs[i]->value->getNumberFields(); f<N; f++)
+                pvs[i]->value->getSubFieldT<pvd::PVDouble>(f)->put(double(round));
+            stamps[i]->put(epicsMonotonicGet());
+            pvs[i]->post();
+            nposted++;
+        }
+
+        now = epicsMonotonicGet();
+    }
+
+    const double elapsed = (now-start)*1e-9;
+    const size_t nallocated = countAllocs()-allocs0;
+
+    std::vector<epicsUInt64>& L = consumer->latency;
+    std::sort(L.begin(), L.end());
+    double p50 = L.empty() ? 0.0 : L[L.size()/2]*1e-3,
+           p99 = L.empty() ? 0.0 : L[(L.size()*99u)/100u]*1e-3;
+
+    printf("%-7s %6u %5u %7u %8.0f %12.0f %12.0f %9.1f %9.1f %9.2f\n",
+           C.direct ? "direct" : "gateway",
+           (unsigned)C.nchan, (unsigned)C.nsub, (unsigned)C.nfields, C.rate,
+           nposted/elapsed, consumer->nupdates/elapsed,
+           p50, p99,
+           consumer->nupdates ? double(nallocated)/consumer->nupdates : 0.0);
+    fflush(stdout);
+
+    for(size_t i=0; i<mons.size(); i++)
+        mons[i]->destroy();
+    for(size_t i=0; i<chans.size(); i++)
+        chans[i]->destroy();
+    if(gateway)
+        gateway->destroy();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    testPlan(0);
+    try {
+        double seconds = 1.0;
+        if(argc>1 && (epicsParseDouble(argv[1], &seconds, 0) || seconds<=0.0)) {
+            fprintf(stderr, "Usage: %s [seconds per case]\n", argv[0]);
+            return 1;
+        }
+
+        static const size_t nchans[] = {1, 100};
+        static const size_t nsubs[] = {1, 10};
+        static const size_t nfields[] = {1, 100};
+        static const double rates[] = {0.0, 100.0};
+
+        printf("# allocations include those of TestProvider.  Compare with 'direct'\n");
+        printf("%-7s %6s %5s %7s %8s %12s %12s %9s %9s %9s\n",
+               "mode", "chans", "subs", "fields", "rate",
+               "posted/s", "updates/s", "p50(us)", "p99(us)", "allocs/up");
+
+        for(size_t a=0; a<NELEMENTS(nchans); a++)
+        for(size_t b=0; b<NELEMENTS(nsubs); b++)
+        for(size_t c=0; c<NELEMENTS(nfields); c++)
+        for(size_t d=0; d<NELEMENTS(rates); d++)
+        for(int direct=1; direct>=0; direct--)
+        {
+            Case C = {nchans[a], nsubs[b], nfields[c], rates[d], !!direct};
+            run(C, seconds);
+        }
+
+        return 0;
+    }catch(std::exception&e){
+        PRINT_EXCEPTION(e);
+        std::cerr<<"Error: "<<e.what()<<"\n";
+        return 1;
+    }
+}
@@ -2,6 +2,7 @@
 
 #include <epicsAtomic.h>
 #include <errlog.h>
+#include <epicsString.h>
 
 #include <epicsMutex.h>
 #include <epicsTimer.h>
@@ -15,14 +16,28 @@
 #include "helper.h"
 #include "chancache.h"
 #include "channel.h"
+#include "trace.h"
 
 namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
 size_t ChannelCacheEntry::num_instances;
 
+static size_t nextChanId;
+
 ChannelCacheEntry::ChannelCacheEntry(ChannelCache* c, const std::string& n)
-    :channelName(n), cache(c), dropPoke(true)
+    :channelName(n), cache(c), chanid(epicsAtomicIncrSizeT(&nextChanId)), dropPoke(true)
+    ,nget(0)
+    ,ngetcached(0)
+    ,ngetupstream(0)
+    ,nput(0)
+    ,nputupstream(0)
+    ,ngetarray(0)
+    ,ngetarraycached(0)
+    ,ngetarrayupstream(0)
+    ,fieldsgen(0)
+    ,ngetfield(0)
+    ,ngetfieldcached(0)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
@@ -35,6 +50,101 @@ ChannelCacheEntry::~ChannelCacheEntry()
     epicsAtomicDecrSizeT(&num_instances);
 }
 
+void
+ChannelCacheEntry::getField(const pva::GetFieldRequester::shared_pointer& requester,
+                            const std::string& subField)
+{
+    pvd::FieldConstPtr field;
+    bool ask = false;
+    unsigned gen;
+
+    epicsAtomicIncrSizeT(&ngetfield);
+    {
+        Guard G(mutex());
+
+        fields_t::const_iterator it(fields.find(subField));
+        if(it!=fields.end()) {
+            field = it->second;
+        } else {
+            // only the first requester asks upstream
+            fieldwaiters_t& waiters = fieldwaiters[subField];
+            ask = waiters.empty();
+            waiters.push_back(requester);
+        }
+        gen = fieldsgen;
+    }
+
+    if(field) {
+        epicsAtomicIncrSizeT(&ngetfieldcached);
+        requester->getDone(pvd::Status::Ok, field);
+
+    } else if(ask) {
+        pva::GetFieldRequester::shared_pointer req(new FRequester(shared_pointer(weakref), subField, gen));
+        channel->getField(req, subField);
+    }
+}
+
+void
+ChannelCacheEntry::invalidateFields()
+{
+    Guard G(mutex());
+    fields.clear();
+    fieldsgen++;
+}
+
+void
+ChannelCacheEntry::checkFields(const pvd::FieldConstPtr& top)
+{
+    Guard G(mutex());
+    fields_t::const_iterator it(fields.find(std::string()));
+    if(it!=fields.end() && top && it->second!=top && !(*it->second==*top)) {
+        fields.clear();
+        fieldsgen++;
+    }
+}
+
+ChannelCacheEntry::FRequester::FRequester(const ChannelCacheEntry::shared_pointer& p,
+                                          const std::string& sub,
+                                          unsigned gen)
+    :chan(p), subField(sub), gen(gen)
+{}
+
+ChannelCacheEntry::FRequester::~FRequester() {}
+
+std::string
+ChannelCacheEntry::FRequester::getRequesterName()
+{
+    return "GWClient";
+}
+
+void
+ChannelCacheEntry::FRequester::getDone(const pvd::Status& status,
+                                       pvd::FieldConstPtr const & field)
+{
+    ChannelCacheEntry::shared_pointer chan(this->chan.lock());
+    if(!chan)
+        return;
+
+    fieldwaiters_t waiters;
+    {
+        Guard G(chan->mutex());
+
+        // don't cache a result which may pre-date a disconnect
+        if(status.isSuccess() && field && gen==chan->fieldsgen)
+            chan->fields[subField] = field;
+
+        std::map<std::string, fieldwaiters_t>::iterator it(chan->fieldwaiters.find(subField));
+        if(it!=chan->fieldwaiters.end()) {
+            waiters.swap(it->second);
+            chan->fieldwaiters.erase(it);
+        }
+    }
+
+    FOREACH(fieldwaiters_t::const_iterator, it, end, waiters) {
+        (*it)->getDone(status, field);
+    }
+}
+
 std::string
 ChannelCacheEntry::CRequester::getRequesterName()
 {
@@ -86,6 +196,9 @@ ChannelCacheEntry::CRequester::channelStateChange(pva::Channel::shared_pointer c
         }
     }
 
+    if(connectionState!=pva::Channel::CONNECTED)
+        chan->invalidateFields(); // type may change on reconnect
+
     // fanout notification
     ChannelCacheEntry::interested_t::vector_type interested(chan->interested.lock_vector()); // Copy
 
@@ -128,6 +241,23 @@ struct ChannelCache::cacheClean : public epicsTimerNotify
 
                 cur = next;
             }
+
+            // forget clients with no remaining subscriptions
+            ChannelCache::peers_t::iterator pcur=cache->peers.begin(), pnext, pend=cache->peers.end();
+            while(pcur!=pend) {
+                pnext = pcur;
+                ++pnext;
+
+                if(pcur->second.unique())
+                    cache->peers.erase(pcur);
+
+                pcur = pnext;
+            }
+
+            // forget idle rate limit buckets
+            FOREACH(ChannelCache::limits_t::const_iterator, it, end, cache->limits) {
+                (*it)->expire();
+            }
         }
         return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, 30.0);
     }
@@ -139,6 +269,11 @@ ChannelCache::ChannelCache(const pva::ChannelProvider::shared_pointer& prov)
     ,cleaner(new cacheClean(this))
     ,cleanerRuns(0)
     ,cleanerDust(0)
+    ,nget(0)
+    ,ngetcached(0)
+    ,ngetupstream(0)
+    ,nput(0)
+    ,nputupstream(0)
 {
     if(!provider)
         throw std::logic_error("Missing 'pva' provider");
@@ -176,9 +311,11 @@ ChannelCache::lookup(const std::string& newName)
         //TODO: async lookup
 
         ChannelCacheEntry::shared_pointer ent(new ChannelCacheEntry(this, newName));
+        ent->weakref = ent;
         ent->requester.reset(new ChannelCacheEntry::CRequester(ent));
 
         entries[newName] = ent;
+        trace(TraceLookupMiss, ent->chanid);
 
         pva::Channel::shared_pointer M;
         {
@@ -199,11 +336,43 @@ ChannelCache::lookup(const std::string& newName)
 
         ret = it->second;
         it->second->dropPoke = true;
+        trace(TraceLookupHit, ret->chanid);
 
     } else {
         // not connected yet, but a client is still interested
         it->second->dropPoke = true;
+        trace(TraceLookupWait, it->second->chanid);
     }
 
     return ret;
 }
+
+PeerStats::shared_pointer
+ChannelCache::peer(const std::string& address)
+{
+    Guard G(cacheLock);
+    PeerStats::shared_pointer& ret = peers[address];
+    if(!ret)
+        ret.reset(new PeerStats);
+    return ret;
+}
+
+bool
+ChannelCache::coalescePuts(const std::string& name) const
+{
+    FOREACH(std::vector<std::string>::const_iterator, it, end, coalescePut) {
+        if(epicsStrGlobMatch(name.c_str(), it->c_str()))
+            return true;
+    }
+    return false;
+}
+
+TokenBucket::shared_pointer
+ChannelCache::limiter(const std::string& name, const std::string& peer) const
+{
+    FOREACH(limits_t::const_iterator, it, end, limits) {
+        if(epicsStrGlobMatch(name.c_str(), (*it)->pattern.c_str()))
+            return (*it)->bucket(peer);
+    }
+    return TokenBucket::shared_pointer();
+}
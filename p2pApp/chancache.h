@@ -5,19 +5,56 @@
 #include <map>
 #include <set>
 #include <deque>
+#include <ostream>
 
 #include <epicsMutex.h>
 #include <epicsTimer.h>
+#include <epicsTime.h>
 
 #include <pv/pvAccess.h>
 
 #include "weakmap.h"
 #include "weakset.h"
+#include "limiter.h"
+#include "record.h"
+#include "partition.h"
 
 struct ChannelCache;
 struct ChannelCacheEntry;
 struct MonitorUser;
 struct GWChannel;
+struct GWGet;
+struct GWPut;
+struct GWArray;
+
+/** Histogram of latencies with power of 2 microsecond buckets.
+ *  Bucket i counts [2**i, 2**(i+1)) us, except that bucket 0 includes
+ *  [0, 1) us and the last bucket includes everything longer.
+ *  Updated without locking.
+ */
+struct LatencyHist
+{
+    enum {NBuckets = 24}; // last bucket starts at ~8 seconds
+    size_t buckets[NBuckets];
+
+    LatencyHist();
+    //! count one latency in nanoseconds
+    void add(epicsUInt64 ns);
+    //! print non-empty buckets and percentile bounds.  nothing if empty
+    void show(std::ostream& strm, const char *indent) const;
+};
+
+//! estimate of the serialized size in bytes of the 'changed' fields of 'value'
+size_t estimateUpdateSize(const epics::pvData::PVStructure& value, const epics::pvData::BitSet& changed);
+
+//! Counts of monitor updates delivered to one downstream client address
+struct PeerStats
+{
+    POINTER_DEFINITIONS(PeerStats);
+    size_t nupdates; // # of updates poll()'d
+    size_t nbytes;   // estimated bytes of those updates
+    PeerStats() :nupdates(0), nbytes(0) {}
+};
 
 struct MonitorCacheEntry : public epics::pvData::MonitorRequester
 {
@@ -34,14 +71,31 @@ struct MonitorCacheEntry : public epics::pvData::MonitorRequester
 
     typedef std::vector<epicsUInt8> pvrequest_t;
 
+    // serialized type and value of the 'field' selection of our pvRequest.
+    // empty if all fields requested.
+    const pvrequest_t fieldkey;
+    // some field of the selection has _options (eg. array slice, deadband),
+    // so lastelem may not be the upstream value.
+    const bool fieldopts;
+
     bool havedata; // set when initial update is received
     bool done;     // set when unlisten() is received
+    size_t seq;    // # of upstream updates applied to lastelem
     size_t nwakeups; // # of upstream monitorEvent() calls
     size_t nevents;  // # of upstream events poll()'d
+    size_t nbytes;   // estimated bytes of upstream events
+
+    // time from upstream poll() in monitorEvent() to downstream MonitorUser::poll()
+    LatencyHist latency;
+    // same, for all MonitorCacheEntry
+    static LatencyHist latencyAll;
 
     epics::pvData::StructureConstPtr typedesc;
     /** value of upstream monitor (accumulation of all deltas)
      *  changed/overflow bit masks of last delta
+     *
+     *  Only modified by monitorEvent() while holding both fanoutLock and mutex(),
+     *  so it may be read while holding either.
      */
     epics::pvData::MonitorElement::shared_pointer lastelem;
     epics::pvData::MonitorPtr mon;
@@ -50,9 +104,24 @@ struct MonitorCacheEntry : public epics::pvData::MonitorRequester
     typedef weak_set<MonitorUser> interested_t;
     interested_t interested;
 
+    // serializes monitorEvent().  Never taken by downstream.
+    // lock order: fanoutLock, then mutex(), then MonitorUser::mutex()
+    epicsMutex fanoutLock;
+    // guarded by fanoutLock.  users being copied to, kept to avoid re-allocation
+    interested_t::vector_type fanout;
+
     MonitorCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
     virtual ~MonitorCacheEntry();
 
+    //! compute 'fieldkey' for a pvRequest
+    static pvrequest_t fieldKey(const epics::pvData::PVStructure::shared_pointer& pvr);
+    //! compute 'fieldopts' for a pvRequest
+    static bool fieldOptions(const epics::pvData::PVStructure::shared_pointer& pvr);
+
+    //! true when lastelem holds the current value of a connected upstream monitor.
+    //! caller must hold mutex()
+    bool fresh() const;
+
     virtual void monitorConnect(epics::pvData::Status const & status,
                                 epics::pvData::MonitorPtr const & monitor,
                                 epics::pvData::StructureConstPtr const & structure);
@@ -68,12 +137,15 @@ struct MonitorUser : public epics::pvData::Monitor
     static size_t num_instances;
     weak_pointer weakref;
 
-    inline epicsMutex& mutex() const { return entry->mutex(); }
+    // each user has its own lock so that poll() and release() never wait
+    // for the copy of an update to another user.
+    inline epicsMutex& mutex() const { return queueLock; }
 
     MonitorCacheEntry::shared_pointer entry;
     epics::pvData::MonitorRequester::weak_pointer req;
     std::tr1::weak_ptr<GWChannel> srvchan;
 
+    mutable epicsMutex queueLock;
     // guards queues and member variables
     bool initial;
     bool running;
@@ -81,11 +153,21 @@ struct MonitorUser : public epics::pvData::Monitor
     size_t nwakeups; // # of monitorEvent() calls to req
     size_t nevents;  // total # events queued
     size_t ndropped; // # of events drop because our queue was full
+    size_t nbytes;   // estimated bytes of events poll()'d
+    size_t seq;      // MonitorCacheEntry::seq of the last update queued, or of start()
+    PeerStats::shared_pointer peer; // downstream client totals
 
     std::deque<epics::pvData::MonitorElementPtr> filled, empty;
     std::set<epics::pvData::MonitorElementPtr> inuse;
+    // epicsMonotonicGet() when each element of 'filled' was received from upstream.
+    // zero for the initial update
+    std::deque<epicsUInt64> filledtime;
+    // estimateUpdateSize() of each element of 'filled'.
+    // computed once for each upstream update, not for each MonitorUser.
+    std::deque<size_t> filledbytes;
 
     epics::pvData::MonitorElementPtr overflowElement;
+    epicsUInt64 overflowtime; // when the oldest update merged into overflowElement was received
 
     MonitorUser(const MonitorCacheEntry::shared_pointer&);
     virtual ~MonitorUser();
@@ -100,13 +182,235 @@ struct MonitorUser : public epics::pvData::Monitor
     virtual std::string getRequesterName();
 };
 
+/** An upstream ChannelGet shared by all downstream ChannelGets
+ *  with the same pvRequest.  Downstream get()s which arrive while
+ *  an upstream get() is in flight are completed with its result.
+ */
+struct GetCacheEntry
+{
+    POINTER_DEFINITIONS(GetCacheEntry);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    ChannelCacheEntry * const chan;
+    const epics::pvData::PVStructure::shared_pointer pvRequest;
+
+    epicsMutex mutex;
+    // guarded by mutex
+    epics::pvAccess::ChannelGet::shared_pointer upstream;
+    bool connected; // channelGetConnect() received
+    bool inflight;  // upstream get() in progress
+    epics::pvData::Status connectresult;
+    epics::pvData::StructureConstPtr typedesc;
+
+    typedef std::vector<std::tr1::weak_ptr<GWGet> > waiters_t;
+    waiters_t connecting; // waiting for channelGetConnect()
+    waiters_t waiting;    // waiting for getDone()
+
+    GetCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+    ~GetCacheEntry();
+
+    //! find or create the entry for this pvRequest
+    static shared_pointer lookup(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+
+    //! calls channelGetConnect() for the downstream get, now or when the upstream connects
+    void connect(const std::tr1::shared_ptr<GWGet>& get);
+    //! queue a downstream get() and start an upstream get() if none in flight
+    void get(const std::tr1::shared_ptr<GWGet>& get);
+
+    // this exists as a seperate object to prevent a reference loop
+    // GetCacheEntry -> pva::ChannelGet -> URequester
+    struct URequester : public epics::pvAccess::ChannelGetRequester
+    {
+        static size_t num_instances;
+
+        URequester(const GetCacheEntry::shared_pointer& p);
+        virtual ~URequester();
+        GetCacheEntry::weak_pointer owner;
+        // for Requester
+        virtual std::string getRequesterName();
+        // for ChannelGetRequester
+        virtual void channelGetConnect(const epics::pvData::Status& status,
+                                       epics::pvAccess::ChannelGet::shared_pointer const & channelGet,
+                                       epics::pvData::Structure::const_shared_pointer const & structure);
+        virtual void getDone(const epics::pvData::Status& status,
+                             epics::pvAccess::ChannelGet::shared_pointer const & channelGet,
+                             epics::pvData::PVStructure::shared_pointer const & pvStructure,
+                             epics::pvData::BitSet::shared_pointer const & bitSet);
+    };
+};
+
+/** An upstream ChannelPut shared by all downstream ChannelPuts with
+ *  the same pvRequest on a channel configured for put coalescing.
+ *  Downstream put()s which arrive while an upstream put() is in flight
+ *  are merged (last writer wins) and sent together when it completes.
+ *  As a ChannelPut handles one request at a time, get()s are also queued.
+ */
+struct PutCacheEntry
+{
+    POINTER_DEFINITIONS(PutCacheEntry);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    ChannelCacheEntry * const chan;
+    const epics::pvData::PVStructure::shared_pointer pvRequest;
+
+    enum op_t {Idle, Put, Get};
+
+    epicsMutex mutex;
+    // guarded by mutex
+    epics::pvAccess::ChannelPut::shared_pointer upstream;
+    bool connected; // channelPutConnect() received, and not disconnected since
+    op_t inflight;  // upstream request in progress
+    op_t lastop;    // last upstream request issued, so that queued puts and gets take turns
+    epics::pvData::Status connectresult;
+    epics::pvData::StructureConstPtr typedesc;
+
+    typedef std::vector<std::tr1::weak_ptr<GWPut> > waiters_t;
+    waiters_t connecting; // waiting for channelPutConnect()
+    waiters_t putting;    // waiting for putDone() of the upstream put() in flight
+    waiters_t queued;     // merged into 'pending', waiting for the next upstream put()
+    waiters_t getting;    // waiting for getDone() of the upstream get() in flight
+    waiters_t getqueued;  // waiting for the next upstream get()
+
+    // merged value of 'queued' puts, and the changed fields
+    epics::pvData::PVStructure::shared_pointer pending;
+    epics::pvData::BitSet::shared_pointer pendingChanged;
+    // value of the upstream put() in flight when it was merged.
+    // re-used as 'pending' once that put() completes.
+    epics::pvData::PVStructure::shared_pointer sending;
+    epics::pvData::BitSet::shared_pointer sendingChanged;
+
+    PutCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+    ~PutCacheEntry();
+
+    //! find or create the entry for this pvRequest
+    static shared_pointer lookup(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+
+    //! calls channelPutConnect() for the downstream put, now or when the upstream connects
+    void connect(const std::tr1::shared_ptr<GWPut>& put);
+    //! send a downstream put(), or merge it with others while busy
+    void put(const std::tr1::shared_ptr<GWPut>& put,
+             const epics::pvData::PVStructure::shared_pointer& value,
+             const epics::pvData::BitSet::shared_pointer& changed);
+    //! queue a downstream get()
+    void get(const std::tr1::shared_ptr<GWPut>& put);
+
+    //! caller must hold mutex.  When idle, choose the next upstream request to issue.
+    op_t next();
+    //! issue the request chosen by next(), without mutex held
+    void start(op_t op, const epics::pvAccess::ChannelPut::shared_pointer& U,
+               const epics::pvData::PVStructure::shared_pointer& value,
+               const epics::pvData::BitSet::shared_pointer& changed);
+    //! putDone() to all waiters
+    static void complete(const waiters_t& waiters, const epics::pvData::Status& sts);
+
+    // this exists as a seperate object to prevent a reference loop
+    // PutCacheEntry -> pva::ChannelPut -> URequester
+    struct URequester : public epics::pvAccess::ChannelPutRequester
+    {
+        static size_t num_instances;
+
+        URequester(const PutCacheEntry::shared_pointer& p);
+        virtual ~URequester();
+        PutCacheEntry::weak_pointer owner;
+        // for Requester
+        virtual std::string getRequesterName();
+        // for ChannelBaseRequester
+        virtual void channelDisconnect(bool destroy);
+        // for ChannelPutRequester
+        virtual void channelPutConnect(const epics::pvData::Status& status,
+                                       epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                                       epics::pvData::Structure::const_shared_pointer const & structure);
+        virtual void putDone(const epics::pvData::Status& status,
+                             epics::pvAccess::ChannelPut::shared_pointer const & channelPut);
+        virtual void getDone(const epics::pvData::Status& status,
+                             epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                             epics::pvData::PVStructure::shared_pointer const & pvStructure,
+                             epics::pvData::BitSet::shared_pointer const & bitSet);
+    };
+};
+
+/** An upstream ChannelArray shared by all downstream ChannelArrays
+ *  selecting the same scalar array field, used to fetch the complete array
+ *  when no subscription holds its current value.  The result is kept
+ *  for p2pArrayCacheAge seconds, and slices are served from it.
+ */
+struct ArrayCacheEntry
+{
+    POINTER_DEFINITIONS(ArrayCacheEntry);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    ChannelCacheEntry * const chan;
+    const epics::pvData::PVStructure::shared_pointer pvRequest;
+
+    epicsMutex mutex;
+    // guarded by mutex
+    epics::pvAccess::ChannelArray::shared_pointer upstream;
+    bool connected; // channelArrayConnect() received
+    bool inflight;  // upstream getArray() in progress
+    epics::pvData::Status connectresult;
+    // complete array from the last upstream getArray(), and when it was received
+    epics::pvData::PVScalarArray::shared_pointer value;
+    epicsTimeStamp fetched;
+
+    struct waiter_t {
+        std::tr1::weak_ptr<GWArray> array;
+        size_t offset, count, stride;
+    };
+    typedef std::vector<waiter_t> waiters_t;
+    waiters_t waiting; // waiting for getArrayDone()
+
+    ArrayCacheEntry(ChannelCacheEntry *ent, const epics::pvData::PVStructure::shared_pointer& pvr);
+    ~ArrayCacheEntry();
+
+    //! find or create the entry for the array field selected by pvRequest
+    static shared_pointer lookup(ChannelCacheEntry *ent, const std::string& field,
+                                 const epics::pvData::PVStructure::shared_pointer& pvr);
+
+    //! answer a downstream getArray() from 'value' if recent, or after an upstream getArray()
+    void getArray(const std::tr1::shared_ptr<GWArray>& array, size_t offset, size_t count, size_t stride);
+    //! forget 'value' (after a put through the gateway)
+    void invalidate();
+
+    // this exists as a seperate object to prevent a reference loop
+    // ArrayCacheEntry -> pva::ChannelArray -> URequester
+    struct URequester : public epics::pvAccess::ChannelArrayRequester
+    {
+        static size_t num_instances;
+
+        URequester(const ArrayCacheEntry::shared_pointer& p);
+        virtual ~URequester();
+        ArrayCacheEntry::weak_pointer owner;
+        // for Requester
+        virtual std::string getRequesterName();
+        // for ChannelArrayRequester
+        virtual void channelArrayConnect(const epics::pvData::Status& status,
+                                         epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                         epics::pvData::Array::const_shared_pointer const & array);
+        virtual void putArrayDone(const epics::pvData::Status& status,
+                                  epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+        virtual void getArrayDone(const epics::pvData::Status& status,
+                                  epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                  epics::pvData::PVArray::shared_pointer const & pvArray);
+        virtual void getLengthDone(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                   size_t length);
+        virtual void setLengthDone(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+    };
+};
+
 struct ChannelCacheEntry
 {
     POINTER_DEFINITIONS(ChannelCacheEntry);
     static size_t num_instances;
+    weak_pointer weakref;
 
     const std::string channelName;
     ChannelCache * const cache;
+    const size_t chanid; // unique, identifies this channel in the trace
 
     // to avoid yet another mutex borrow interested.mutex() for our members
     inline epicsMutex& mutex() const { return interested.mutex(); }
@@ -117,6 +421,15 @@ struct ChannelCacheEntry
 
     bool dropPoke;
 
+    size_t nget;         // # of downstream ChannelGet::get() calls
+    size_t ngetcached;   // # of those answered from a MonitorCacheEntry
+    size_t ngetupstream; // # of upstream ChannelGet::get() calls
+    size_t nput;         // # of downstream ChannelPut::put() calls on coalescing channels
+    size_t nputupstream; // # of upstream ChannelPut::put() calls on coalescing channels
+    size_t ngetarray;         // # of downstream ChannelArray::getArray() calls
+    size_t ngetarraycached;   // # of those answered from a MonitorCacheEntry
+    size_t ngetarrayupstream; // # of upstream ChannelArray::getArray() calls
+
     typedef weak_set<GWChannel> interested_t;
     interested_t interested;
 
@@ -124,9 +437,36 @@ struct ChannelCacheEntry
     typedef weak_value_map<pvrequest_t, MonitorCacheEntry> mon_entries_t;
     mon_entries_t mon_entries;
 
+    typedef weak_value_map<pvrequest_t, GetCacheEntry> get_entries_t;
+    get_entries_t get_entries;
+
+    typedef weak_value_map<pvrequest_t, PutCacheEntry> put_entries_t;
+    put_entries_t put_entries;
+
+    // indexed by array field name
+    typedef weak_value_map<std::string, ArrayCacheEntry> array_entries_t;
+    array_entries_t array_entries;
+
+    // getField() results by subField, guarded by mutex()
+    typedef std::map<std::string, epics::pvData::FieldConstPtr> fields_t;
+    fields_t fields;
+    // requesters waiting for an upstream getField(), guarded by mutex()
+    typedef std::vector<epics::pvAccess::GetFieldRequester::shared_pointer> fieldwaiters_t;
+    std::map<std::string, fieldwaiters_t> fieldwaiters;
+    unsigned fieldsgen; // incremented when 'fields' is invalidated
+    size_t ngetfield, ngetfieldcached;
+
     ChannelCacheEntry(ChannelCache*, const std::string& n);
     virtual ~ChannelCacheEntry();
 
+    //! answer from 'fields', or pass to upstream
+    void getField(const epics::pvAccess::GetFieldRequester::shared_pointer& requester,
+                  const std::string& subField);
+    //! forget cached getField() results
+    void invalidateFields();
+    //! invalidate if the top level type has changed
+    void checkFields(const epics::pvData::FieldConstPtr& top);
+
     // this exists as a seperate object to prevent a reference loop
     // ChannelCacheEntry -> pva::Channel -> CRequester
     struct CRequester : public epics::pvAccess::ChannelRequester
@@ -144,6 +484,20 @@ struct ChannelCacheEntry
         virtual void channelStateChange(epics::pvAccess::Channel::shared_pointer const & channel,
                                         epics::pvAccess::Channel::ConnectionState connectionState);
     };
+
+    struct FRequester : public epics::pvAccess::GetFieldRequester
+    {
+        FRequester(const ChannelCacheEntry::shared_pointer& p, const std::string& sub, unsigned gen);
+        virtual ~FRequester();
+        ChannelCacheEntry::weak_pointer chan;
+        const std::string subField;
+        const unsigned gen; // fieldsgen when upstream getField() was issued
+        // for Requester
+        virtual std::string getRequesterName();
+        // for GetFieldRequester
+        virtual void getDone(const epics::pvData::Status& status,
+                             epics::pvData::FieldConstPtr const & field);
+    };
 };
 
 /** Holds the set of channels the GW is searching for, or has found.
@@ -166,10 +520,41 @@ struct ChannelCache
     size_t cleanerRuns;
     size_t cleanerDust;
 
+    // totals over all entries, past and present
+    size_t nget, ngetcached, ngetupstream, nput, nputupstream;
+
+    // downstream monitor totals by client address.  guarded by cacheLock
+    typedef std::map<std::string, PeerStats::shared_pointer> peers_t;
+    peers_t peers;
+
+    // glob patterns of channel names for which ChannelPut is coalesced.
+    // set during configuration.
+    std::vector<std::string> coalescePut;
+    // rate limits for put/process/RPC, first match applies.
+    // set during configuration.
+    typedef std::vector<RateLimit::shared_pointer> limits_t;
+    limits_t limits;
+
+    // upstream monitor updates, when recording
+    Recorder recorder;
+
+    // channel names served by this worker process.
+    // set during configuration.
+    Partition partition;
+
     ChannelCache(const epics::pvAccess::ChannelProvider::shared_pointer& prov);
     ~ChannelCache();
 
     ChannelCacheEntry::shared_pointer lookup(const std::string& name);
+
+    //! find or create the PeerStats for a downstream client address
+    PeerStats::shared_pointer peer(const std::string& address);
+
+    //! does 'name' match one of coalescePut
+    bool coalescePuts(const std::string& name) const;
+
+    //! bucket limiting requests on channel 'name' from client address 'peer'.  NULL if not limited
+    TokenBucket::shared_pointer limiter(const std::string& name, const std::string& peer) const;
 };
 
 #endif // CHANCACHE_H
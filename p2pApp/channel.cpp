@@ -12,13 +12,16 @@
 
 #define epicsExportSharedSymbols
 #include "helper.h"
+#include "pvahelper.h"
 #include "pva2pva.h"
 #include "channel.h"
+#include "trace.h"
 
 namespace pva = epics::pvAccess;
 namespace pvd = epics::pvData;
 
 int p2pReadOnly = 0;
+extern double p2pArrayCacheAge;
 
 size_t GWChannel::num_instances;
 
@@ -85,8 +88,7 @@ void
 GWChannel::getField(pva::GetFieldRequester::shared_pointer const & requester,
                             std::string const & subField)
 {
-    //TODO: cache for top level field?
-    entry->channel->getField(requester, subField);
+    entry->getField(requester, subField);
 }
 
 pva::AccessRights
@@ -100,10 +102,23 @@ GWChannel::createChannelProcess(
         pva::ChannelProcessRequester::shared_pointer const & channelProcessRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    if(!p2pReadOnly)
-        return entry->channel->createChannelProcess(channelProcessRequester, pvRequest);
-    else
+    if(p2pReadOnly)
         return Channel::createChannelProcess(channelProcessRequester, pvRequest);
+
+    TokenBucket::shared_pointer bucket(entry->cache->limiter(entry->channelName, address));
+    if(!bucket)
+        return entry->channel->createChannelProcess(channelProcessRequester, pvRequest);
+
+    LimitedProcess::shared_pointer limited(new LimitedProcess(shared_pointer(weakref), bucket, channelProcessRequester));
+    limited->weakref = limited;
+    limited->urequester.reset(new LimitedProcess::URequester(limited));
+
+    pva::ChannelProcess::shared_pointer U(entry->channel->createChannelProcess(limited->urequester, pvRequest));
+
+    Guard G(limited->mutex);
+    if(!limited->upstream)
+        limited->upstream = U;
+    return limited;
 }
 
 pva::ChannelGet::shared_pointer
@@ -111,7 +126,47 @@ GWChannel::createChannelGet(
         pva::ChannelGetRequester::shared_pointer const & channelGetRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    return entry->channel->createChannelGet(channelGetRequester, pvRequest);
+    MonitorCacheEntry::shared_pointer ment;
+
+    // opt-out with record._options.cache=false.
+    // processing must go upstream, and values of fields with _options may differ from upstream
+    std::string usecache, proc;
+    if((!getS<std::string>(pvRequest, "record._options.cache", usecache)
+            || (usecache!="false" && usecache!="0"))
+        && (!getS<std::string>(pvRequest, "record._options.process", proc) || proc!="true")
+        && !MonitorCacheEntry::fieldOptions(pvRequest))
+    {
+        // look for a subscription with the same field selection which has the current value
+        const ChannelCacheEntry::pvrequest_t key(MonitorCacheEntry::fieldKey(pvRequest));
+
+        ChannelCacheEntry::mon_entries_t::lock_vector_type mons(entry->mon_entries.lock_vector());
+
+        FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it, end, mons)
+        {
+            MonitorCacheEntry::shared_pointer M(it->second);
+            if(M->fieldkey!=key)
+                continue;
+            Guard G(M->mutex());
+            if(M->fresh()) {
+                ment = M;
+                break;
+            }
+        }
+    }
+
+    GetCacheEntry::shared_pointer gent;
+    if(!ment) // share upstream get() with other clients
+        gent = GetCacheEntry::lookup(entry.get(), pvRequest);
+
+    GWGet::shared_pointer ret(new GWGet(shared_pointer(weakref), channelGetRequester, pvRequest, ment, gent));
+    ret->weakref = ret;
+
+    if(ment)
+        channelGetRequester->channelGetConnect(pvd::Status::Ok, ret, ret->typedesc);
+    else
+        gent->connect(ret);
+
+    return ret;
 }
 
 pva::ChannelPut::shared_pointer
@@ -120,10 +175,42 @@ GWChannel::createChannelPut(
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
     //TODO: allow ChannelPut::get()
-    if(!p2pReadOnly)
-        return entry->channel->createChannelPut(channelPutRequester, pvRequest);
-    else
+    if(p2pReadOnly)
         return Channel::createChannelPut(channelPutRequester, pvRequest);
+
+    pva::ChannelPutRequester::shared_pointer req(channelPutRequester);
+
+    LimitedPut::shared_pointer limited;
+    TokenBucket::shared_pointer bucket(entry->cache->limiter(entry->channelName, address));
+    if(bucket) {
+        limited.reset(new LimitedPut(shared_pointer(weakref), bucket, channelPutRequester));
+        limited->weakref = limited;
+        req = limited->urequester = pva::ChannelPutRequester::shared_pointer(new LimitedPut::URequester(limited));
+    }
+
+    pva::ChannelPut::shared_pointer ret;
+
+    if(!entry->cache->coalescePuts(entry->channelName)) {
+        ret = entry->channel->createChannelPut(req, pvRequest);
+
+    } else {
+        // share upstream put() with other clients, merging puts which arrive while busy
+        PutCacheEntry::shared_pointer pent(PutCacheEntry::lookup(entry.get(), pvRequest));
+
+        GWPut::shared_pointer put(new GWPut(shared_pointer(weakref), req, pent));
+        put->weakref = put;
+
+        pent->connect(put);
+        ret = put;
+    }
+
+    if(limited) {
+        Guard G(limited->mutex);
+        if(!limited->upstream)
+            limited->upstream = ret;
+        return limited;
+    }
+    return ret;
 }
 
 pva::ChannelPutGet::shared_pointer
@@ -142,10 +229,23 @@ GWChannel::createChannelRPC(
         pva::ChannelRPCRequester::shared_pointer const & channelRPCRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    if(!p2pReadOnly)
-        return entry->channel->createChannelRPC(channelRPCRequester, pvRequest);
-    else
+    if(p2pReadOnly)
         return Channel::createChannelRPC(channelRPCRequester, pvRequest);
+
+    TokenBucket::shared_pointer bucket(entry->cache->limiter(entry->channelName, address));
+    if(!bucket)
+        return entry->channel->createChannelRPC(channelRPCRequester, pvRequest);
+
+    LimitedRPC::shared_pointer limited(new LimitedRPC(shared_pointer(weakref), bucket, channelRPCRequester));
+    limited->weakref = limited;
+    limited->urequester.reset(new LimitedRPC::URequester(limited));
+
+    pva::ChannelRPC::shared_pointer U(entry->channel->createChannelRPC(limited->urequester, pvRequest));
+
+    Guard G(limited->mutex);
+    if(!limited->upstream)
+        limited->upstream = U;
+    return limited;
 }
 
 namespace {
@@ -165,6 +265,7 @@ GWChannel::createMonitor(
 
     MonitorCacheEntry::shared_pointer ment;
     MonitorUser::shared_pointer mon;
+    PeerStats::shared_pointer peer(entry->cache->peer(address));
 
     pvd::Status startresult;
     pvd::StructureConstPtr typedesc;
@@ -176,6 +277,7 @@ GWChannel::createMonitor(
             // TODO: no-cache/no-share flag in pvRequest
 
             ment = entry->mon_entries.find(ser);
+            trace(TraceCreateMonitor, entry->chanid, !ment);
             if(!ment) {
                 ment.reset(new MonitorCacheEntry(entry.get(), pvRequest));
                 entry->mon_entries[ser] = ment; // ref. wrapped
@@ -201,6 +303,7 @@ GWChannel::createMonitor(
         ment->interested.insert(mon);
         mon->weakref = mon;
         mon->srvchan = shared_pointer(weakref);
+        mon->peer = peer;
         mon->req = monitorRequester;
 
         typedesc = ment->typedesc;
@@ -228,7 +331,16 @@ GWChannel::createChannelArray(
         pva::ChannelArrayRequester::shared_pointer const & channelArrayRequester,
         pvd::PVStructure::shared_pointer const & pvRequest)
 {
-    return entry->channel->createChannelArray(channelArrayRequester, pvRequest);
+    GWArray::shared_pointer ret(new GWArray(shared_pointer(weakref), channelArrayRequester, pvRequest));
+    ret->weakref = ret;
+    ret->urequester.reset(new GWArray::URequester(ret));
+
+    pva::ChannelArray::shared_pointer U(entry->channel->createChannelArray(ret->urequester, pvRequest));
+
+    Guard G(ret->mutex);
+    if(!ret->upstream)
+        ret->upstream = U;
+    return ret;
 }
 
 
@@ -242,4 +354,6 @@ GWChannel::printInfo(std::ostream& out)
 void registerReadOnly()
 {
     epics::iocshVariable<int, &p2pReadOnly>("p2pReadOnly");
+    epics::iocshVariable<double, &p2pArrayCacheAge>("p2pArrayCacheAge");
+    epics::iocshVariable<int, &p2pTrace>("p2pTrace");
 }
@@ -1,9 +1,13 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <epicsAtomic.h>
+
 #include <pv/pvAccess.h>
 
+#include "pva2pva.h"
 #include "chancache.h"
+#include "limiter.h"
 
 struct GWChannel : public epics::pvAccess::Channel
 {
@@ -66,4 +70,420 @@ struct GWChannel : public epics::pvAccess::Channel
 
 };
 
+/** Downstream ChannelGet.  Answered from the value held by an existing
+ *  upstream subscription (MonitorCacheEntry) with the same field selection,
+ *  or through a GetCacheEntry shared with other downstream gets.
+ */
+struct GWGet : public epics::pvAccess::ChannelGet
+{
+    POINTER_DEFINITIONS(GWGet);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    const GWChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelGetRequester::weak_pointer requester;
+    const epics::pvData::PVStructure::shared_pointer pvRequest;
+    const MonitorCacheEntry::weak_pointer ment;
+
+    // type given to channelGetConnect()
+    epics::pvData::StructureConstPtr typedesc;
+    // our copy of MonitorCacheEntry::lastelem
+    epics::pvData::PVStructure::shared_pointer value;
+    const epics::pvData::BitSet::shared_pointer changed;
+
+    epicsMutex mutex;
+    // guarded by mutex.  Created on demand when answered from a MonitorCacheEntry
+    GetCacheEntry::shared_pointer gent;
+
+    GWGet(const GWChannel::shared_pointer& chan,
+          const epics::pvAccess::ChannelGetRequester::shared_pointer& req,
+          const epics::pvData::PVStructure::shared_pointer& pvRequest,
+          const MonitorCacheEntry::shared_pointer& ment,
+          const GetCacheEntry::shared_pointer& gent);
+    virtual ~GWGet();
+
+    // for Destroyable
+    virtual void destroy();
+
+    // for ChannelRequest
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel();
+    virtual void cancel();
+    virtual void lastRequest();
+
+    // for ChannelGet
+    virtual void get();
+};
+
+/** Downstream ChannelPut on a channel configured for put coalescing.
+ *  Requests are passed through a PutCacheEntry shared with other
+ *  downstream puts using the same pvRequest.
+ */
+struct GWPut : public epics::pvAccess::ChannelPut
+{
+    POINTER_DEFINITIONS(GWPut);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    const GWChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelPutRequester::weak_pointer requester;
+    const PutCacheEntry::shared_pointer pent;
+
+    GWPut(const GWChannel::shared_pointer& chan,
+          const epics::pvAccess::ChannelPutRequester::shared_pointer& req,
+          const PutCacheEntry::shared_pointer& pent);
+    virtual ~GWPut();
+
+    // for Destroyable
+    virtual void destroy();
+
+    // for ChannelRequest
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel();
+    virtual void cancel();
+    virtual void lastRequest();
+
+    // for ChannelPut
+    virtual void put(epics::pvData::PVStructure::shared_pointer const & pvPutStructure,
+                     epics::pvData::BitSet::shared_pointer const & putBitSet);
+    virtual void get();
+};
+
+/** Downstream ChannelArray.  getArray() and getLength() of a scalar array
+ *  are answered from an existing subscription (MonitorCacheEntry) which includes
+ *  the field, or from a recent complete array held by an ArrayCacheEntry.
+ *  Other requests are passed through our own upstream ChannelArray.
+ */
+struct GWArray : public epics::pvAccess::ChannelArray
+{
+    POINTER_DEFINITIONS(GWArray);
+    static size_t num_instances;
+    weak_pointer weakref;
+
+    const GWChannel::shared_pointer channel;
+    const epics::pvAccess::ChannelArrayRequester::weak_pointer requester;
+    const epics::pvData::PVStructure::shared_pointer pvRequest;
+    // name of the selected array field.  empty if not known
+    const std::string field;
+    // passed upstream in place of 'requester'.  set after construction
+    epics::pvAccess::ChannelArrayRequester::shared_pointer urequester;
+
+    epicsMutex mutex;
+    // guarded by mutex
+    epics::pvAccess::ChannelArray::shared_pointer upstream;
+    // given to channelArrayConnect().  NULL if not a scalar array
+    epics::pvData::ScalarArrayConstPtr type;
+    // created on first cache miss
+    ArrayCacheEntry::shared_pointer aent;
+
+    GWArray(const GWChannel::shared_pointer& chan,
+            const epics::pvAccess::ChannelArrayRequester::shared_pointer& req,
+            const epics::pvData::PVStructure::shared_pointer& pvRequest);
+    virtual ~GWArray();
+
+    //! name of the array field selected by a pvRequest, or empty if ambiguous
+    static std::string arrayField(const epics::pvData::PVStructure::shared_pointer& pvRequest);
+    //! elements [offset, offset+count*stride) of 'src'.  count==0 selects all remaining elements
+    static epics::pvData::PVScalarArray::shared_pointer slice(const epics::pvData::PVScalarArray& src,
+                                                              size_t offset, size_t count, size_t stride);
+
+    // for Destroyable
+    virtual void destroy();
+
+    // for ChannelRequest
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel();
+    virtual void cancel();
+    virtual void lastRequest();
+
+    // for ChannelArray
+    virtual void putArray(epics::pvData::PVArray::shared_pointer const & putArray,
+                          size_t offset, size_t count, size_t stride);
+    virtual void getArray(size_t offset, size_t count, size_t stride);
+    virtual void getLength();
+    virtual void setLength(size_t length);
+
+    // this exists as a seperate object to prevent a reference loop
+    // GWArray -> upstream ChannelArray -> URequester
+    struct URequester : public epics::pvAccess::ChannelArrayRequester
+    {
+        URequester(const GWArray::shared_pointer& p);
+        virtual ~URequester();
+        GWArray::weak_pointer owner;
+        // for Requester
+        virtual std::string getRequesterName();
+        // for ChannelBaseRequester
+        virtual void channelDisconnect(bool destroy);
+        // for ChannelArrayRequester
+        virtual void channelArrayConnect(const epics::pvData::Status& status,
+                                         epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                         epics::pvData::Array::const_shared_pointer const & array);
+        virtual void putArrayDone(const epics::pvData::Status& status,
+                                  epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+        virtual void getArrayDone(const epics::pvData::Status& status,
+                                  epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                  epics::pvData::PVArray::shared_pointer const & pvArray);
+        virtual void getLengthDone(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelArray::shared_pointer const & channelArray,
+                                   size_t length);
+        virtual void setLengthDone(const epics::pvData::Status& status,
+                                   epics::pvAccess::ChannelArray::shared_pointer const & channelArray);
+    };
+};
+
+/** Common part of a downstream operation subject to a rate limit.
+ *  Op is the pva::ChannelRequest sub-class (eg. ChannelPut) and Req its requester.
+ *  Requests which change something upstream are admit()ed only while the
+ *  client's TokenBucket has a token.
+ */
+template<typename Op, typename Req>
+struct LimitedOp : public Op
+{
+    static size_t num_instances;
+
+    const GWChannel::shared_pointer channel;
+    const TokenBucket::shared_pointer bucket;
+    const typename Req::weak_pointer requester;
+    // passed upstream in place of 'requester'.  set after construction
+    typename Req::shared_pointer urequester;
+
+    epicsMutex mutex;
+    // guarded by mutex
+    typename Op::shared_pointer upstream;
+
+    LimitedOp(const GWChannel::shared_pointer& chan,
+              const TokenBucket::shared_pointer& bucket,
+              const typename Req::shared_pointer& req)
+        :channel(chan)
+        ,bucket(bucket)
+        ,requester(req)
+    {
+        epicsAtomicIncrSizeT(&num_instances);
+    }
+    virtual ~LimitedOp()
+    {
+        destroy();
+        epicsAtomicDecrSizeT(&num_instances);
+    }
+
+    //! the upstream operation, or NULL if not connected
+    typename Op::shared_pointer getUpstream()
+    {
+        Guard G(mutex);
+        return upstream;
+    }
+
+    //! the upstream operation if connected and a token is available.
+    //! Otherwise NULL, with the reason in 'sts'
+    typename Op::shared_pointer admit(epics::pvData::Status& sts)
+    {
+        typename Op::shared_pointer U(getUpstream());
+        if(!U) {
+            sts = epics::pvData::Status(epics::pvData::Status::STATUSTYPE_ERROR, "Not connected");
+        } else if(!bucket->take()) {
+            sts = bucket->overLimit();
+            U.reset();
+        }
+        return U;
+    }
+
+    // for Destroyable
+    virtual void destroy()
+    {
+        typename Op::shared_pointer U;
+        {
+            Guard G(mutex);
+            U.swap(upstream);
+        }
+        if(U)
+            U->destroy();
+    }
+
+    // for ChannelRequest
+    virtual std::tr1::shared_ptr<epics::pvAccess::Channel> getChannel() { return channel; }
+    virtual void cancel()
+    {
+        typename Op::shared_pointer U(getUpstream());
+        if(U)
+            U->cancel();
+    }
+    virtual void lastRequest()
+    {
+        typename Op::shared_pointer U(getUpstream());
+        if(U)
+            U->lastRequest();
+    }
+};
+
+template<typename Op, typename Req>
+size_t LimitedOp<Op, Req>::num_instances;
+
+/** Common part of the requester passed upstream by a LimitedOp.
+ *  This exists as a seperate object to prevent a reference loop
+ *  Owner -> upstream Op -> URequester
+ */
+template<typename Owner, typename Req>
+struct LimitedRequester : public Req
+{
+    static size_t num_instances;
+
+    const std::tr1::weak_ptr<Owner> owner;
+    const char * const name;
+
+    LimitedRequester(const std::tr1::shared_ptr<Owner>& p, const char *name)
+        :owner(p)
+        ,name(name)
+    {
+        epicsAtomicIncrSizeT(&num_instances);
+    }
+    virtual ~LimitedRequester()
+    {
+        epicsAtomicDecrSizeT(&num_instances);
+    }
+
+    //! the downstream requester, or NULL.  'self' is set to the owner
+    typename Req::shared_pointer downstream(std::tr1::shared_ptr<Owner>& self)
+    {
+        typename Req::shared_pointer req;
+        self = owner.lock();
+        if(self)
+            req = self->requester.lock();
+        return req;
+    }
+
+    //! save the upstream operation when connected, and return the downstream requester
+    template<typename Op>
+    typename Req::shared_pointer connected(std::tr1::shared_ptr<Owner>& self,
+                                           const std::tr1::shared_ptr<Op>& op)
+    {
+        typename Req::shared_pointer req(downstream(self));
+        if(self) {
+            Guard G(self->mutex);
+            self->upstream = op;
+        }
+        return req;
+    }
+
+    // for Requester
+    virtual std::string getRequesterName()
+    {
+        std::tr1::shared_ptr<Owner> self;
+        typename Req::shared_pointer req(downstream(self));
+        return req ? req->getRequesterName() : std::string(name);
+    }
+    // for ChannelBaseRequester
+    virtual void channelDisconnect(bool destroy)
+    {
+        std::tr1::shared_ptr<Owner> self;
+        typename Req::shared_pointer req(downstream(self));
+        if(req)
+            req->channelDisconnect(destroy);
+    }
+};
+
+template<typename Owner, typename Req>
+size_t LimitedRequester<Owner, Req>::num_instances;
+
+/** Downstream ChannelPut subject to a rate limit.  put() is
+ *  rejected when the client's TokenBucket is empty, otherwise passed upstream.
+ *  get() is not limited.
+ */
+struct LimitedPut : public LimitedOp<epics::pvAccess::ChannelPut, epics::pvAccess::ChannelPutRequester>
+{
+    POINTER_DEFINITIONS(LimitedPut);
+    weak_pointer weakref;
+
+    LimitedPut(const GWChannel::shared_pointer& chan,
+               const TokenBucket::shared_pointer& bucket,
+               const epics::pvAccess::ChannelPutRequester::shared_pointer& req)
+        :LimitedOp<epics::pvAccess::ChannelPut, epics::pvAccess::ChannelPutRequester>(chan, bucket, req)
+    {}
+    virtual ~LimitedPut() {}
+
+    // for ChannelPut
+    virtual void put(epics::pvData::PVStructure::shared_pointer const & pvPutStructure,
+                     epics::pvData::BitSet::shared_pointer const & putBitSet);
+    virtual void get();
+
+    struct URequester : public LimitedRequester<LimitedPut, epics::pvAccess::ChannelPutRequester>
+    {
+        URequester(const LimitedPut::shared_pointer& p)
+            :LimitedRequester<LimitedPut, epics::pvAccess::ChannelPutRequester>(p, "LimitedPut")
+        {}
+        virtual ~URequester() {}
+        // for ChannelPutRequester
+        virtual void channelPutConnect(const epics::pvData::Status& status,
+                                       epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                                       epics::pvData::Structure::const_shared_pointer const & structure);
+        virtual void putDone(const epics::pvData::Status& status,
+                             epics::pvAccess::ChannelPut::shared_pointer const & channelPut);
+        virtual void getDone(const epics::pvData::Status& status,
+                             epics::pvAccess::ChannelPut::shared_pointer const & channelPut,
+                             epics::pvData::PVStructure::shared_pointer const & pvStructure,
+                             epics::pvData::BitSet::shared_pointer const & bitSet);
+    };
+};
+
+/** Downstream ChannelProcess subject to a rate limit.  process() is
+ *  rejected when the client's TokenBucket is empty, otherwise passed upstream.
+ */
+struct LimitedProcess : public LimitedOp<epics::pvAccess::ChannelProcess, epics::pvAccess::ChannelProcessRequester>
+{
+    POINTER_DEFINITIONS(LimitedProcess);
+    weak_pointer weakref;
+
+    LimitedProcess(const GWChannel::shared_pointer& chan,
+                   const TokenBucket::shared_pointer& bucket,
+                   const epics::pvAccess::ChannelProcessRequester::shared_pointer& req)
+        :LimitedOp<epics::pvAccess::ChannelProcess, epics::pvAccess::ChannelProcessRequester>(chan, bucket, req)
+    {}
+    virtual ~LimitedProcess() {}
+
+    // for ChannelProcess
+    virtual void process();
+
+    struct URequester : public LimitedRequester<LimitedProcess, epics::pvAccess::ChannelProcessRequester>
+    {
+        URequester(const LimitedProcess::shared_pointer& p)
+            :LimitedRequester<LimitedProcess, epics::pvAccess::ChannelProcessRequester>(p, "LimitedProcess")
+        {}
+        virtual ~URequester() {}
+        // for ChannelProcessRequester
+        virtual void channelProcessConnect(const epics::pvData::Status& status,
+                                           epics::pvAccess::ChannelProcess::shared_pointer const & channelProcess);
+        virtual void processDone(const epics::pvData::Status& status,
+                                 epics::pvAccess::ChannelProcess::shared_pointer const & channelProcess);
+    };
+};
+
+/** Downstream ChannelRPC subject to a rate limit.  request() is
+ *  rejected when the client's TokenBucket is empty, otherwise passed upstream.
+ */
+struct LimitedRPC : public LimitedOp<epics::pvAccess::ChannelRPC, epics::pvAccess::ChannelRPCRequester>
+{
+    POINTER_DEFINITIONS(LimitedRPC);
+    weak_pointer weakref;
+
+    LimitedRPC(const GWChannel::shared_pointer& chan,
+               const TokenBucket::shared_pointer& bucket,
+               const epics::pvAccess::ChannelRPCRequester::shared_pointer& req)
+        :LimitedOp<epics::pvAccess::ChannelRPC, epics::pvAccess::ChannelRPCRequester>(chan, bucket, req)
+    {}
+    virtual ~LimitedRPC() {}
+
+    // for ChannelRPC
+    virtual void request(epics::pvData::PVStructure::shared_pointer const & pvArgument);
+
+    struct URequester : public LimitedRequester<LimitedRPC, epics::pvAccess::ChannelRPCRequester>
+    {
+        URequester(const LimitedRPC::shared_pointer& p)
+            :LimitedRequester<LimitedRPC, epics::pvAccess::ChannelRPCRequester>(p, "LimitedRPC")
+        {}
+        virtual ~URequester() {}
+        // for ChannelRPCRequester
+        virtual void channelRPCConnect(const epics::pvData::Status& status,
+                                       epics::pvAccess::ChannelRPC::shared_pointer const & channelRPC);
+        virtual void requestDone(const epics::pvData::Status& status,
+                                 epics::pvAccess::ChannelRPC::shared_pointer const & channelRPC,
+                                 epics::pvData::PVStructure::shared_pointer const & pvResponse);
+    };
+};
+
 #endif // CHANNEL_H
@@ -0,0 +1,381 @@
+
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsEndian.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pvahelper.h"
+#include "pva2pva.h"
+#include "chancache.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+size_t GWGet::num_instances;
+size_t GetCacheEntry::num_instances;
+size_t GetCacheEntry::URequester::num_instances;
+
+GWGet::GWGet(const GWChannel::shared_pointer& chan,
+             const pva::ChannelGetRequester::shared_pointer& req,
+             const pvd::PVStructure::shared_pointer& pvRequest,
+             const MonitorCacheEntry::shared_pointer& ment,
+             const GetCacheEntry::shared_pointer& gent)
+    :channel(chan)
+    ,requester(req)
+    ,pvRequest(pvRequest)
+    ,ment(ment)
+    ,changed(new pvd::BitSet)
+    ,gent(gent)
+{
+    if(ment) {
+        typedesc = ment->typedesc;
+        value = pvd::getPVDataCreate()->createPVStructure(typedesc);
+    }
+    changed->set(0); // always a complete update
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GWGet::~GWGet()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+void
+GWGet::destroy()
+{
+    GetCacheEntry::shared_pointer E;
+    {
+        Guard G(mutex);
+        E.swap(gent);
+    }
+}
+
+std::tr1::shared_ptr<pva::Channel>
+GWGet::getChannel()
+{
+    return channel;
+}
+
+void
+GWGet::cancel()
+{
+    // the upstream get() is shared, so isn't cancelled on behalf of one downstream
+}
+
+void
+GWGet::lastRequest()
+{}
+
+void
+GWGet::get()
+{
+    pva::ChannelGetRequester::shared_pointer req(requester.lock());
+    if(!req)
+        return;
+    shared_pointer self(weakref);
+
+    ChannelCacheEntry *entry = channel->entry.get();
+    epicsAtomicIncrSizeT(&entry->nget);
+    epicsAtomicIncrSizeT(&entry->cache->nget);
+
+    if(value) {
+        MonitorCacheEntry::shared_pointer M(ment.lock());
+        bool hit = false;
+        if(M) {
+            Guard G(M->mutex());
+            if(M->fresh()) {
+                // downstream won't get() again until the previous getDone()
+                // is sent, so 'value' is not being serialized concurrently.
+                value->copyUnchecked(*M->lastelem->pvStructurePtr);
+                hit = true;
+            }
+        }
+        if(hit) {
+            epicsAtomicIncrSizeT(&entry->ngetcached);
+            epicsAtomicIncrSizeT(&entry->cache->ngetcached);
+            req->getDone(pvd::Status::Ok, self, value, changed);
+            return;
+        }
+    }
+
+    // subscription is gone, or not currently connected.  Ask upstream.
+    GetCacheEntry::shared_pointer E;
+    {
+        Guard G(mutex);
+        E = gent;
+    }
+    if(!E) {
+        E = GetCacheEntry::lookup(entry, pvRequest);
+        Guard G(mutex);
+        if(!gent)
+            gent = E;
+    }
+
+    E->get(self);
+}
+
+GetCacheEntry::GetCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+    :chan(ent)
+    ,pvRequest(pvr)
+    ,connected(false)
+    ,inflight(false)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GetCacheEntry::~GetCacheEntry()
+{
+    pva::ChannelGet::shared_pointer U;
+    U.swap(upstream);
+    if(U) {
+        U->destroy();
+    }
+    epicsAtomicDecrSizeT(&num_instances);
+    const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
+}
+
+GetCacheEntry::shared_pointer
+GetCacheEntry::lookup(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+{
+    // each get() which processes must reach upstream, so is never coalesced
+    std::string proc;
+    const bool shared = !getS<std::string>(pvr, "record._options.process", proc) || proc!="true";
+
+    ChannelCacheEntry::pvrequest_t ser;
+    // serialize request struct to string using host byte order (only used for local comparison)
+    if(shared)
+        pvd::serializeToVector(pvr.get(), EPICS_BYTE_ORDER, ser);
+
+    GetCacheEntry::shared_pointer ret;
+
+    Guard G(ent->mutex());
+
+    if(shared)
+        ret = ent->get_entries.find(ser);
+    if(!ret) {
+        ret.reset(new GetCacheEntry(ent, pvr));
+        if(shared)
+            ent->get_entries[ser] = ret; // ref. wrapped
+        ret->weakref = ret;
+
+        // We've added an incomplete entry (no ChannelGet)
+        // which will queue connect() and get() until channelGetConnect()
+        pva::ChannelGetRequester::shared_pointer req(new URequester(ret));
+        pva::ChannelGet::shared_pointer C;
+        {
+            UnGuard U(G);
+
+            C = ent->channel->createChannelGet(req, pvr); // may call channelGetConnect() recursively
+        }
+        Guard G2(ret->mutex);
+        if(!ret->upstream)
+            ret->upstream = C;
+    }
+
+    return ret;
+}
+
+void
+GetCacheEntry::connect(const GWGet::shared_pointer& get)
+{
+    bool now;
+    pvd::Status sts;
+    pvd::StructureConstPtr type;
+    {
+        Guard G(mutex);
+        now = connected;
+        if(!now)
+            connecting.push_back(get);
+        sts = connectresult;
+        type = typedesc;
+    }
+
+    if(now) {
+        pva::ChannelGetRequester::shared_pointer req(get->requester.lock());
+        get->typedesc = type;
+        if(req)
+            req->channelGetConnect(sts, get, type);
+    }
+}
+
+void
+GetCacheEntry::get(const GWGet::shared_pointer& get)
+{
+    pva::ChannelGet::shared_pointer U;
+    pvd::Status fail;
+    bool failed = false;
+    {
+        Guard G(mutex);
+
+        if(connected && !connectresult.isSuccess()) {
+            failed = true;
+            fail = connectresult;
+
+        } else {
+            // if an upstream get() is in flight, we will be completed with its result
+            waiting.push_back(get);
+
+            if(!inflight && connected && upstream) {
+                inflight = true;
+                U = upstream;
+            }
+        }
+    }
+
+    if(U) {
+        epicsAtomicIncrSizeT(&chan->ngetupstream);
+        epicsAtomicIncrSizeT(&chan->cache->ngetupstream);
+        U->get();
+
+    } else if(failed) {
+        pva::ChannelGetRequester::shared_pointer req(get->requester.lock());
+        if(req)
+            req->getDone(fail, get, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+    }
+}
+
+GetCacheEntry::URequester::URequester(const GetCacheEntry::shared_pointer& p)
+    :owner(p)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GetCacheEntry::URequester::~URequester()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+std::string
+GetCacheEntry::URequester::getRequesterName()
+{
+    return "GetCacheEntry";
+}
+
+void
+GetCacheEntry::URequester::channelGetConnect(const pvd::Status& status,
+                                             pva::ChannelGet::shared_pointer const & channelGet,
+                                             pvd::Structure::const_shared_pointer const & structure)
+{
+    GetCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    pvd::Status sts(status);
+    if(sts.isSuccess() && !structure)
+        sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream provides no type");
+
+    waiters_t toconnect, tofail;
+    pvd::StructureConstPtr type;
+    bool start = false;
+    {
+        Guard G(self->mutex);
+
+        // we shouldn't see a type change since the ChannelCacheEntry is dropped on disconnect
+        if(sts.isSuccess() && self->typedesc && !(*self->typedesc==*structure))
+            sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream type changed");
+
+        self->upstream = channelGet;
+        self->connected = true;
+        self->connectresult = sts;
+        if(sts.isSuccess() && !self->typedesc)
+            self->typedesc = structure;
+        type = self->typedesc;
+
+        if(!sts.isSuccess()) {
+            tofail.swap(self->waiting);
+            self->inflight = false;
+
+        } else if(!self->waiting.empty()) {
+            // get()s queued before (re)connect
+            start = true;
+            self->inflight = true;
+        }
+
+        toconnect.swap(self->connecting);
+    }
+
+    if(sts.isSuccess() && MonitorCacheEntry::fieldKey(self->pvRequest).empty())
+        self->chan->checkFields(type); // complete type, compare with getField() cache
+
+    FOREACH(waiters_t::const_iterator, it, end, toconnect) {
+        GWGet::shared_pointer get(it->lock());
+        if(!get)
+            continue;
+        pva::ChannelGetRequester::shared_pointer req(get->requester.lock());
+        get->typedesc = type;
+        if(req)
+            req->channelGetConnect(sts, get, type);
+    }
+
+    if(start) {
+        epicsAtomicIncrSizeT(&self->chan->ngetupstream);
+        epicsAtomicIncrSizeT(&self->chan->cache->ngetupstream);
+        channelGet->get();
+    }
+
+    FOREACH(waiters_t::const_iterator, it, end, tofail) {
+        GWGet::shared_pointer get(it->lock());
+        if(!get)
+            continue;
+        pva::ChannelGetRequester::shared_pointer req(get->requester.lock());
+        if(req)
+            req->getDone(sts, get, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+    }
+}
+
+void
+GetCacheEntry::URequester::getDone(const pvd::Status& status,
+                                   pva::ChannelGet::shared_pointer const & channelGet,
+                                   pvd::PVStructure::shared_pointer const & pvStructure,
+                                   pvd::BitSet::shared_pointer const & bitSet)
+{
+    GetCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    waiters_t todo;
+    {
+        Guard G(self->mutex);
+        self->inflight = false;
+        todo.swap(self->waiting);
+    }
+
+    // Downstream serializes after we return, while upstream may re-use pvStructure
+    // for the next get().  So give all waiters the same private copy.
+    pvd::PVStructurePtr snap;
+    pvd::BitSet::shared_pointer snapchanged;
+    if(status.isSuccess() && pvStructure) {
+        snap = pvd::getPVDataCreate()->createPVStructure(pvStructure->getStructure());
+        snap->copyUnchecked(*pvStructure);
+        if(bitSet) {
+            snapchanged.reset(new pvd::BitSet(*bitSet));
+        } else {
+            snapchanged.reset(new pvd::BitSet);
+            snapchanged->set(0);
+        }
+    }
+
+    FOREACH(waiters_t::const_iterator, it, end, todo) {
+        GWGet::shared_pointer get(it->lock());
+        if(!get)
+            continue;
+        pva::ChannelGetRequester::shared_pointer req(get->requester.lock());
+        if(!req)
+            continue;
+
+        if(snap && get->typedesc && get->typedesc!=snap->getStructure()
+                && !(*get->typedesc==*snap->getStructure()))
+        {
+            // connected from a MonitorCacheEntry with a different type (shouldn't happen)
+            req->getDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream type changed"),
+                         get, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+        } else {
+            req->getDone(status, get, snap, snapchanged);
+        }
+    }
+}
@@ -1,12 +1,18 @@
 
+#include <stdio.h>
+
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
 #include <map>
+#include <algorithm>
 
 #if !defined(_WIN32)
 #include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #define USE_SIGNAL
+#define USE_WORKERS
 #endif
 
 #include <epicsStdlib.h>
@@ -27,6 +33,8 @@
 #include <pv/logger.h>
 
 #include "server.h"
+#include "status.h"
+#include "trace.h"
 #include "pva2pva.h"
 
 namespace pvd = epics::pvData;
@@ -39,6 +47,7 @@ namespace {
 pvd::StructureConstPtr schema(pvd::getFieldCreate()->createFieldBuilder()
                               ->add("version", pvd::pvUInt)
                               ->add("readOnly", pvd::pvBoolean)
+                              ->add("workers", pvd::pvUInt)
                               ->addNestedStructureArray("clients")
                                  ->add("name", pvd::pvString)
                                  ->add("provider", pvd::pvString)
@@ -46,6 +55,16 @@ pvd::StructureConstPtr schema(pvd::getFieldCreate()->createFieldBuilder()
                                  ->add("autoaddrlist", pvd::pvBoolean)
                                  ->add("serverport", pvd::pvUShort)
                                  ->add("bcastport", pvd::pvUShort)
+                                 ->addArray("coalesce_put", pvd::pvString)
+                                 ->addNestedStructureArray("limits")
+                                    ->add("pattern", pvd::pvString)
+                                    ->add("rate", pvd::pvDouble)
+                                    ->add("burst", pvd::pvDouble)
+                                 ->endNested()
+                                 ->add("record_file", pvd::pvString)
+                                 ->add("replay_file", pvd::pvString)
+                                 ->add("replay_speed", pvd::pvDouble)
+                                 ->add("replay_loop", pvd::pvBoolean)
                               ->endNested()
                               ->addNestedStructureArray("servers")
                                  ->add("name", pvd::pvString)
@@ -62,7 +81,7 @@ pvd::StructureConstPtr schema(pvd::getFieldCreate()->createFieldBuilder()
 
 void usage(const char *me)
 {
-    std::cerr<<"Usage: "<<me<<" [-vhiIC] <config file>\n";
+    std::cerr<<"Usage: "<<me<<" [-vhiIC] [-w <worker#>] <config file>\n";
 }
 
 void getargs(ServerConfig& arg, int argc, char *argv[])
@@ -70,7 +89,7 @@ void getargs(ServerConfig& arg, int argc, char *argv[])
     int opt;
     bool checkonly = false;
 
-    while( (opt=getopt(argc, argv, "qvhiIC"))!=-1)
+    while( (opt=getopt(argc, argv, "qvhiICw:"))!=-1)
     {
         switch(opt) {
         case 'q':
@@ -88,6 +107,16 @@ void getargs(ServerConfig& arg, int argc, char *argv[])
         case 'C':
             checkonly = true;
             break;
+        case 'w':
+        {
+            epicsUInt32 idx;
+            if(epicsParseUInt32(optarg, &idx, 10, NULL)) {
+                std::cerr<<"Invalid worker number '"<<optarg<<"'\n";
+                exit(1);
+            }
+            arg.worker = idx;
+        }
+            break;
         default:
             std::cerr<<"Unknown argument -"<<char(opt)<<"\n";
         case 'h':
@@ -102,8 +131,9 @@ void getargs(ServerConfig& arg, int argc, char *argv[])
         exit(1);
     }
 
+    arg.conffile = argv[optind];
     arg.conf = pvd::getPVDataCreate()->createPVStructure(schema);
-    std::ifstream strm(argv[optind]);
+    std::ifstream strm(arg.conffile.c_str());
     pvd::parseJSON(strm, arg.conf);
 
     p2pReadOnly = arg.conf->getSubFieldT<pvd::PVScalar>("readOnly")->getAs<pvd::boolean>();
@@ -115,6 +145,19 @@ void getargs(ServerConfig& arg, int argc, char *argv[])
         std::cerr<<"config file version mis-match. expect 1 found "<<version<<"\n";
         exit(1);
     }
+    arg.nworkers = arg.conf->getSubFieldT<pvd::PVUInt>("workers")->get();
+    if(arg.nworkers==0)
+        arg.nworkers = 1;
+    if(arg.worker>=0 && unsigned(arg.worker)>=arg.nworkers) {
+        std::cerr<<"Worker "<<arg.worker<<" out of range.  config has "<<arg.nworkers<<" workers\n";
+        exit(1);
+    }
+#ifndef USE_WORKERS
+    if(arg.nworkers>1) {
+        std::cerr<<"\"workers\" not supported on this target\n";
+        exit(1);
+    }
+#endif
     if(arg.conf->getSubFieldT<pvd::PVStructureArray>("clients")->view().empty()) {
         std::cerr<<"No clients configured\n";
         exit(1);
@@ -146,11 +189,59 @@ GWServerChannelProvider::shared_pointer configure_client(ServerConfig& arg, cons
                                          .push_map()
                                          .build());
 
-    pva::ChannelProvider::shared_pointer base(pva::ChannelProviderRegistry::clients()->createProvider(provider, C));
+    pva::ChannelProvider::shared_pointer base;
+    std::string replay(conf->getSubFieldT<pvd::PVString>("replay_file")->get());
+    if(!replay.empty()) {
+        double speed = conf->getSubFieldT<pvd::PVDouble>("replay_speed")->get();
+        bool loop = conf->getSubFieldT<pvd::PVScalar>("replay_loop")->getAs<pvd::boolean>();
+
+        LOG(pva::logLevelInfo, "Client '%s' replays '%s'", name.c_str(), replay.c_str());
+
+        ReplayProvider::shared_pointer R(new ReplayProvider(replay, speed, loop));
+        R->start();
+        base = R;
+    } else {
+        base = pva::ChannelProviderRegistry::clients()->createProvider(provider, C);
+    }
     if(!base)
         throw std::runtime_error("Can't create ChannelProvider");
 
     GWServerChannelProvider::shared_pointer ret(new GWServerChannelProvider(base));
+
+    if(arg.worker>=0)
+        ret->cache.partition = Partition(arg.worker, arg.nworkers);
+
+    pvd::PVStringArray::const_svector coalesce(conf->getSubFieldT<pvd::PVStringArray>("coalesce_put")->view());
+    ret->cache.coalescePut.assign(coalesce.begin(), coalesce.end());
+
+    pvd::PVStructureArray::const_svector limits(conf->getSubFieldT<pvd::PVStructureArray>("limits")->view());
+    for(size_t i=0; i<limits.size(); i++) {
+        if(!limits[i]) continue;
+        const pvd::PVStructurePtr& limit = limits[i];
+
+        std::string pattern(limit->getSubFieldT<pvd::PVString>("pattern")->get());
+        double rate = limit->getSubFieldT<pvd::PVDouble>("rate")->get(),
+               burst = limit->getSubFieldT<pvd::PVDouble>("burst")->get();
+        if(pattern.empty() || rate<=0.0)
+            throw std::runtime_error("Rate limit requires a channel pattern and rate>0");
+
+        LOG(pva::logLevelInfo, "Client '%s' limit '%s' to %f/s, burst %f", name.c_str(), pattern.c_str(), rate, burst);
+
+        ret->cache.limits.push_back(RateLimit::shared_pointer(new RateLimit(pattern, rate, burst)));
+    }
+
+    std::string record(conf->getSubFieldT<pvd::PVString>("record_file")->get());
+    if(!record.empty() && arg.worker>=0) {
+        // each worker records its own channels
+        char sfx[16];
+        sprintf(sfx, ".%d", arg.worker);
+        record += sfx;
+    }
+    if(!record.empty()) {
+        LOG(pva::logLevelInfo, "Client '%s' recording to '%s'", name.c_str(), record.c_str());
+        ret->cache.recorder.open(record);
+    }
+
     return ret;
 }
 
@@ -160,11 +251,20 @@ pva::ServerContext::shared_pointer configure_server(ServerConfig& arg, const pvd
 
     LOG(pva::logLevelInfo, "Configure server '%s'", name.c_str());
 
+    unsigned serverport = conf->getSubFieldT<pvd::PVScalar>("serverport")->getAs<pvd::uint16>();
+    if(serverport && arg.worker>=0) {
+        // workers can't share a TCP port, so each has its own
+        serverport += arg.worker;
+        if(serverport>0xffff)
+            throw std::runtime_error("serverport + worker# out of range");
+        LOG(pva::logLevelInfo, "Server '%s' worker %d on TCP port %u", name.c_str(), arg.worker, serverport);
+    }
+
     pva::Configuration::shared_pointer C(pva::ConfigurationBuilder()
                                          .add("EPICS_PVAS_INTF_ADDR_LIST", conf->getSubFieldT<pvd::PVString>("interface")->get())
                                          .add("EPICS_PVAS_BEACON_ADDR_LIST", conf->getSubFieldT<pvd::PVString>("addrlist")->get())
                                          .add("EPICS_PVAS_AUTO_BEACON_ADDR_LIST", conf->getSubFieldT<pvd::PVScalar>("autoaddrlist")->getAs<std::string>())
-                                         .add("EPICS_PVAS_SERVER_PORT", conf->getSubFieldT<pvd::PVScalar>("serverport")->getAs<pvd::uint16>())
+                                         .add("EPICS_PVAS_SERVER_PORT", serverport)
                                          .add("EPICS_PVAS_BROADCAST_PORT", conf->getSubFieldT<pvd::PVScalar>("bcastport")->getAs<pvd::uint16>())
                                          .add("EPICS_PVA_DEBUG", arg.debug>=5 ? 5 : 0)
                                          .push_map()
@@ -173,6 +273,7 @@ pva::ServerContext::shared_pointer configure_server(ServerConfig& arg, const pvd
     pvd::PVStringArray::shared_pointer clients(conf->getSubFieldT<pvd::PVStringArray>("clients"));
     pvd::PVStringArray::const_svector names(clients->view());
     std::vector<pva::ChannelProvider::shared_pointer> providers;
+    ServerConfig::clients_t served;
 
     for(pvd::PVStringArray::const_svector::const_iterator it(names.begin()), end(names.end()); it!=end; ++it)
     {
@@ -180,6 +281,23 @@ pva::ServerContext::shared_pointer configure_server(ServerConfig& arg, const pvd
         if(it2==arg.clients.end())
             throw std::runtime_error("Server references non-existant client");
         providers.push_back(it2->second);
+        served[it2->first] = it2->second;
+    }
+
+    std::string prefix(conf->getSubFieldT<pvd::PVString>("control_prefix")->get());
+    if(!prefix.empty() && arg.worker>=0) {
+        // status PVs are not partitioned.  each worker serves its own.
+        char sfx[16];
+        sprintf(sfx, "%d:", arg.worker);
+        prefix += sfx;
+    }
+    if(!prefix.empty()) {
+        LOG(pva::logLevelInfo, "Server '%s' status PVs with prefix '%s'", name.c_str(), prefix.c_str());
+
+        std::tr1::shared_ptr<GWStatus> status(new GWStatus(name, prefix, served));
+        arg.statuses.push_back(status);
+        // ahead of clients, so that our PVs aren't searched for upstream
+        providers.insert(providers.begin(), status->provider.provider());
     }
 
     pva::ServerContext::shared_pointer ret(pva::ServerContext::create(pva::ServerContext::Config()
@@ -200,6 +318,85 @@ void sigdone(int num)
 }
 #endif
 
+#ifdef USE_WORKERS
+/* Run one copy of ourself with "-w <index>" for each worker,
+ * until signaled, or until one exits.
+ * Each worker serves only channel names in its partition,
+ * and downstream searches reach all workers.
+ */
+int run_workers(const ServerConfig& arg, char *exe)
+{
+    std::vector<pid_t> pids(arg.nworkers, 0);
+
+    // the same verbosity, non-interactive
+    std::vector<char*> common;
+    common.push_back(exe);
+    for(int lvl=1; lvl<arg.debug; lvl++)
+        common.push_back(const_cast<char*>("-v"));
+    for(int lvl=arg.debug; lvl<1; lvl++)
+        common.push_back(const_cast<char*>("-q"));
+    common.push_back(const_cast<char*>("-i"));
+
+    for(unsigned i=0; i<arg.nworkers; i++) {
+        char idx[16];
+        sprintf(idx, "%u", i);
+
+        std::vector<char*> args(common);
+        args.push_back(const_cast<char*>("-w"));
+        args.push_back(idx);
+        args.push_back(const_cast<char*>(arg.conffile.c_str()));
+        args.push_back(NULL);
+
+        pid_t pid = fork();
+        if(pid==0) {
+            execvp(exe, &args[0]);
+            perror("exec worker");
+            _exit(127);
+        } else if(pid<0) {
+            perror("fork worker");
+            break;
+        }
+        pids[i] = pid;
+        LOG(pva::logLevelInfo, "Started worker %u as PID %ld", i, (long)pid);
+    }
+
+    signal(SIGINT, sigdone);
+    signal(SIGTERM, sigdone);
+    signal(SIGQUIT, sigdone);
+
+    int ret = 0;
+    if(std::find(pids.begin(), pids.end(), pid_t(0))!=pids.end())
+        quit = ret = 1; // some failed to start
+
+    while(!quit) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if(pid>0) {
+            for(size_t i=0; i<pids.size(); i++) {
+                if(pids[i]!=pid)
+                    continue;
+                std::cerr<<"Worker "<<i<<" exits with "<<status<<".  Stopping all workers\n";
+                pids[i] = 0;
+            }
+            quit = ret = 1;
+        } else {
+            done.wait(1.0);
+        }
+    }
+
+    for(size_t i=0; i<pids.size(); i++) {
+        if(pids[i])
+            kill(pids[i], SIGTERM);
+    }
+    for(size_t i=0; i<pids.size(); i++) {
+        int status;
+        if(pids[i])
+            waitpid(pids[i], &status, 0);
+    }
+    return ret;
+}
+#endif
+
 ServerConfig* volatile theserver;
 
 void iocsh_drop(const char *client, const char *channel)
@@ -235,6 +432,26 @@ void gwcr(int lvl, const char *client, const char *channel)
     }
 }
 
+void gwrec(const char *client, const char *fname)
+{
+    if(!theserver)
+        return;
+    try {
+        theserver->record(client, fname);
+    }catch(std::exception& e){
+        std::cout<<"Error: "<<e.what()<<"\n";
+    }
+}
+
+void gwtrace(int count, const char *thread)
+{
+    try {
+        traceShow(std::cout, count>0 ? size_t(count) : 0u, thread);
+    }catch(std::exception& e){
+        std::cout<<"Error: "<<e.what()<<"\n";
+    }
+}
+
 }// namespace
 
 int main(int argc, char *argv[])
@@ -245,6 +462,8 @@ int main(int argc, char *argv[])
         epics::iocshRegister<const char*, const char*, &iocsh_drop>("drop", "client", "channel");
         epics::iocshRegister<int, const char*, &gwsr>("gwsr", "level", "channel");
         epics::iocshRegister<int, const char*, const char*, &gwcr>("gwcr", "level", "client", "channel");
+        epics::iocshRegister<int, const char*, &gwtrace>("gwtrace", "count", "thread");
+        epics::iocshRegister<const char*, const char*, &gwrec>("gwrec", "client", "file");
 
         libComRegister();
         registerReadOnly();
@@ -253,6 +472,23 @@ int main(int argc, char *argv[])
         epics::registerRefCounter("GWChannel", &GWChannel::num_instances);
         epics::registerRefCounter("MonitorCacheEntry", &MonitorCacheEntry::num_instances);
         epics::registerRefCounter("MonitorUser", &MonitorUser::num_instances);
+        epics::registerRefCounter("GWGet", &GWGet::num_instances);
+        epics::registerRefCounter("GetCacheEntry", &GetCacheEntry::num_instances);
+        epics::registerRefCounter("GetCacheEntry::URequester", &GetCacheEntry::URequester::num_instances);
+        epics::registerRefCounter("GWPut", &GWPut::num_instances);
+        epics::registerRefCounter("PutCacheEntry", &PutCacheEntry::num_instances);
+        epics::registerRefCounter("PutCacheEntry::URequester", &PutCacheEntry::URequester::num_instances);
+        epics::registerRefCounter("LimitedPut", &LimitedPut::num_instances);
+        epics::registerRefCounter("LimitedProcess", &LimitedProcess::num_instances);
+        epics::registerRefCounter("LimitedRPC", &LimitedRPC::num_instances);
+        epics::registerRefCounter("LimitedPut::URequester", &LimitedPut::URequester::num_instances);
+        epics::registerRefCounter("LimitedProcess::URequester", &LimitedProcess::URequester::num_instances);
+        epics::registerRefCounter("LimitedRPC::URequester", &LimitedRPC::URequester::num_instances);
+        epics::registerRefCounter("GWArray", &GWArray::num_instances);
+        epics::registerRefCounter("ArrayCacheEntry", &ArrayCacheEntry::num_instances);
+        epics::registerRefCounter("ArrayCacheEntry::URequester", &ArrayCacheEntry::URequester::num_instances);
+        epics::registerRefCounter("ReplayChannel", &ReplayChannel::num_instances);
+        epics::registerRefCounter("ReplayMonitor", &ReplayMonitor::num_instances);
 
         ServerConfig arg;
         theserver = &arg;
@@ -284,6 +520,14 @@ int main(int argc, char *argv[])
             lvl = pva::logLevelAll;
         SET_LOG_LEVEL(lvl);
 
+#ifdef USE_WORKERS
+        if(arg.nworkers>1 && arg.worker<0) {
+            // we only start and stop workers, so no client or server contexts here
+            theserver = 0;
+            return run_workers(arg, argv[0]);
+        }
+#endif
+
         pva::ClientFactory::start();
 
         pvd::PVStructureArray::const_svector arr;
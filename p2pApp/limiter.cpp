@@ -0,0 +1,276 @@
+
+#include <algorithm>
+#include <sstream>
+
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsTime.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "limiter.h"
+#include "chancache.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+TokenBucket::TokenBucket(double rate, double burst)
+    :rate(rate)
+    ,burst(burst)
+    ,tokens(burst)
+    ,naccepted(0)
+    ,nrejected(0)
+{
+    epicsTimeGetCurrent(&last);
+}
+
+bool
+TokenBucket::take()
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    Guard G(mutex);
+
+    double dT = epicsTimeDiffInSeconds(&now, &last);
+    if(dT>0.0) { // ignore clock stepping backwards
+        tokens = std::min(burst, tokens + dT*rate);
+        last = now;
+    }
+
+    if(tokens>=1.0) {
+        tokens -= 1.0;
+        naccepted++;
+        return true;
+    } else {
+        nrejected++;
+        return false;
+    }
+}
+
+bool
+TokenBucket::refilled(const epicsTimeStamp& now) const
+{
+    double dT = epicsTimeDiffInSeconds(&now, &last);
+    return tokens + std::max(0.0, dT)*rate >= burst;
+}
+
+RateLimit::RateLimit(const std::string& pattern, double rate, double burst)
+    :pattern(pattern)
+    ,rate(rate)
+    ,burst(std::max(1.0, burst))
+    ,expaccepted(0)
+    ,exprejected(0)
+{}
+
+TokenBucket::shared_pointer
+RateLimit::bucket(const std::string& peer)
+{
+    // limit by host, so that a client can't reset its bucket by reconnecting
+    std::string host(peer.substr(0, peer.find_last_of(':')));
+
+    Guard G(mutex);
+    TokenBucket::shared_pointer& ret = buckets[host];
+    if(!ret)
+        ret.reset(new TokenBucket(rate, burst));
+    return ret;
+}
+
+size_t
+RateLimit::expire()
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    size_t nexpired = 0;
+
+    Guard G(mutex);
+    buckets_t::iterator cur=buckets.begin(), next, end=buckets.end();
+    while(cur!=end) {
+        next = cur;
+        ++next;
+
+        // only referenced by the map, so no LimitedOp can take() concurrently
+        if(cur->second.unique()) {
+            bool idle;
+            {
+                Guard G2(cur->second->mutex);
+                idle = cur->second->refilled(now);
+                if(idle) {
+                    expaccepted += cur->second->naccepted;
+                    exprejected += cur->second->nrejected;
+                }
+            }
+            if(idle) {
+                buckets.erase(cur);
+                nexpired++;
+            }
+        }
+
+        cur = next;
+    }
+    return nexpired;
+}
+
+void
+RateLimit::stats(size_t& nhosts, size_t& naccepted, size_t& nrejected) const
+{
+    Guard G(mutex);
+    nhosts = buckets.size();
+    naccepted = expaccepted;
+    nrejected = exprejected;
+    FOREACH(buckets_t::const_iterator, it, end, buckets) {
+        Guard G2(it->second->mutex);
+        naccepted += it->second->naccepted;
+        nrejected += it->second->nrejected;
+    }
+}
+
+pvd::Status
+TokenBucket::overLimit() const
+{
+    std::ostringstream msg;
+    msg<<"Gateway rate limit exceeded ("<<rate<<" requests/sec, burst "<<burst<<")";
+    return pvd::Status(pvd::Status::STATUSTYPE_ERROR, msg.str());
+}
+
+void
+LimitedPut::put(pvd::PVStructure::shared_pointer const & pvPutStructure,
+                pvd::BitSet::shared_pointer const & putBitSet)
+{
+    pvd::Status sts;
+    pva::ChannelPut::shared_pointer U(admit(sts));
+    if(U) {
+        U->put(pvPutStructure, putBitSet);
+        return;
+    }
+
+    pva::ChannelPutRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->putDone(sts, shared_pointer(weakref));
+}
+
+void
+LimitedPut::get()
+{
+    // reads are not limited
+    pva::ChannelPut::shared_pointer U(getUpstream());
+    if(U) {
+        U->get();
+        return;
+    }
+
+    pva::ChannelPutRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->getDone(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not connected"), shared_pointer(weakref),
+                     pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+}
+
+void
+LimitedPut::URequester::channelPutConnect(const pvd::Status& status,
+                                          pva::ChannelPut::shared_pointer const & channelPut,
+                                          pvd::Structure::const_shared_pointer const & structure)
+{
+    LimitedPut::shared_pointer self;
+    pva::ChannelPutRequester::shared_pointer req(connected(self, channelPut));
+    if(req)
+        req->channelPutConnect(status, self, structure);
+}
+
+void
+LimitedPut::URequester::putDone(const pvd::Status& status,
+                                pva::ChannelPut::shared_pointer const & channelPut)
+{
+    LimitedPut::shared_pointer self;
+    pva::ChannelPutRequester::shared_pointer req(downstream(self));
+    if(req)
+        req->putDone(status, self);
+}
+
+void
+LimitedPut::URequester::getDone(const pvd::Status& status,
+                                pva::ChannelPut::shared_pointer const & channelPut,
+                                pvd::PVStructure::shared_pointer const & pvStructure,
+                                pvd::BitSet::shared_pointer const & bitSet)
+{
+    LimitedPut::shared_pointer self;
+    pva::ChannelPutRequester::shared_pointer req(downstream(self));
+    if(req)
+        req->getDone(status, self, pvStructure, bitSet);
+}
+
+void
+LimitedProcess::process()
+{
+    pvd::Status sts;
+    pva::ChannelProcess::shared_pointer U(admit(sts));
+    if(U) {
+        U->process();
+        return;
+    }
+
+    pva::ChannelProcessRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->processDone(sts, shared_pointer(weakref));
+}
+
+void
+LimitedProcess::URequester::channelProcessConnect(const pvd::Status& status,
+                                                  pva::ChannelProcess::shared_pointer const & channelProcess)
+{
+    LimitedProcess::shared_pointer self;
+    pva::ChannelProcessRequester::shared_pointer req(connected(self, channelProcess));
+    if(req)
+        req->channelProcessConnect(status, self);
+}
+
+void
+LimitedProcess::URequester::processDone(const pvd::Status& status,
+                                        pva::ChannelProcess::shared_pointer const & channelProcess)
+{
+    LimitedProcess::shared_pointer self;
+    pva::ChannelProcessRequester::shared_pointer req(downstream(self));
+    if(req)
+        req->processDone(status, self);
+}
+
+void
+LimitedRPC::request(pvd::PVStructure::shared_pointer const & pvArgument)
+{
+    pvd::Status sts;
+    pva::ChannelRPC::shared_pointer U(admit(sts));
+    if(U) {
+        U->request(pvArgument);
+        return;
+    }
+
+    pva::ChannelRPCRequester::shared_pointer req(requester.lock());
+    if(req)
+        req->requestDone(sts, shared_pointer(weakref), pvd::PVStructurePtr());
+}
+
+void
+LimitedRPC::URequester::channelRPCConnect(const pvd::Status& status,
+                                          pva::ChannelRPC::shared_pointer const & channelRPC)
+{
+    LimitedRPC::shared_pointer self;
+    pva::ChannelRPCRequester::shared_pointer req(connected(self, channelRPC));
+    if(req)
+        req->channelRPCConnect(status, self);
+}
+
+void
+LimitedRPC::URequester::requestDone(const pvd::Status& status,
+                                    pva::ChannelRPC::shared_pointer const & channelRPC,
+                                    pvd::PVStructure::shared_pointer const & pvResponse)
+{
+    LimitedRPC::shared_pointer self;
+    pva::ChannelRPCRequester::shared_pointer req(downstream(self));
+    if(req)
+        req->requestDone(status, self, pvResponse);
+}
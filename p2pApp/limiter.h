@@ -0,0 +1,72 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <string>
+#include <map>
+
+#include <epicsMutex.h>
+#include <epicsTime.h>
+
+#include <pv/sharedPtr.h>
+#include <pv/status.h>
+
+/** Token bucket limiting the rate of upstream requests (put/process/RPC)
+ *  from one downstream client host.
+ */
+struct TokenBucket
+{
+    POINTER_DEFINITIONS(TokenBucket);
+
+    const double rate;  // tokens added per second
+    const double burst; // max. tokens
+
+    mutable epicsMutex mutex;
+    // guarded by mutex
+    double tokens;
+    epicsTimeStamp last; // when tokens was last updated
+    size_t naccepted, nrejected;
+
+    TokenBucket(double rate, double burst);
+
+    //! take one token if available
+    bool take();
+
+    //! would be full at time 'now'.  caller must hold mutex
+    bool refilled(const epicsTimeStamp& now) const;
+
+    //! error returned for a rejected request
+    epics::pvData::Status overLimit() const;
+};
+
+/** A rate limit rule applied to channels with names matching 'pattern'.
+ *  Each downstream client host has its own bucket.
+ */
+struct RateLimit
+{
+    POINTER_DEFINITIONS(RateLimit);
+
+    const std::string pattern;
+    const double rate;
+    const double burst;
+
+    mutable epicsMutex mutex;
+    // guarded by mutex.  indexed by client host
+    typedef std::map<std::string, TokenBucket::shared_pointer> buckets_t;
+    buckets_t buckets;
+    // totals of buckets already expire()d
+    size_t expaccepted, exprejected;
+
+    RateLimit(const std::string& pattern, double rate, double burst);
+
+    //! find or create the bucket for a client address ("host:port")
+    TokenBucket::shared_pointer bucket(const std::string& peer);
+
+    //! forget buckets which are not in use and have refilled,
+    //! so forgetting them changes nothing.  Returns the number removed.
+    size_t expire();
+
+    //! totals over all buckets
+    void stats(size_t& nhosts, size_t& naccepted, size_t& nrejected) const;
+};
+
+#endif // LIMITER_H
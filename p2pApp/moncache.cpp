@@ -4,6 +4,8 @@
 
 #include <epicsMutex.h>
 #include <epicsTimer.h>
+#include <epicsTime.h>
+#include <epicsEndian.h>
 
 #include <pv/pvAccess.h>
 
@@ -11,14 +13,76 @@
 #include "helper.h"
 #include "pva2pva.h"
 #include "chancache.h"
+#include "trace.h"
 
 namespace pva = epics::pvAccess;
 namespace pvd = epics::pvData;
 
 size_t MonitorCacheEntry::num_instances;
 size_t MonitorUser::num_instances;
+LatencyHist MonitorCacheEntry::latencyAll;
 
 namespace {
+// size of a pvAccess encoded count
+size_t sizeSize(size_t n)
+{
+    return n<254 ? 1 : 5;
+}
+
+size_t fieldSize(const pvd::PVField& fld)
+{
+    switch(fld.getField()->getType()) {
+    case pvd::scalar: {
+        pvd::ScalarType stype = static_cast<const pvd::PVScalar&>(fld).getScalar()->getScalarType();
+        if(stype==pvd::pvString) {
+            size_t len = static_cast<const pvd::PVString&>(fld).get().size();
+            return sizeSize(len) + len;
+        }
+        return pvd::ScalarTypeFunc::elementSize(stype);
+    }
+    case pvd::scalarArray: {
+        const pvd::PVScalarArray& arr = static_cast<const pvd::PVScalarArray&>(fld);
+        pvd::ScalarType stype = arr.getScalarArray()->getElementType();
+        if(stype==pvd::pvString) {
+            pvd::PVStringArray::const_svector strs(static_cast<const pvd::PVStringArray&>(fld).view());
+            size_t ret = sizeSize(strs.size());
+            for(size_t i=0; i<strs.size(); i++)
+                ret += sizeSize(strs[i].size()) + strs[i].size();
+            return ret;
+        }
+        size_t len = arr.getLength();
+        return sizeSize(len) + len*pvd::ScalarTypeFunc::elementSize(stype);
+    }
+    case pvd::structure: {
+        const pvd::PVFieldPtrArray& fields = static_cast<const pvd::PVStructure&>(fld).getPVFields();
+        size_t ret = 0;
+        for(size_t i=0; i<fields.size(); i++)
+            ret += fieldSize(*fields[i]);
+        return ret;
+    }
+    case pvd::structureArray: {
+        pvd::PVStructureArray::const_svector elems(static_cast<const pvd::PVStructureArray&>(fld).view());
+        size_t ret = sizeSize(elems.size());
+        for(size_t i=0; i<elems.size(); i++)
+            ret += 1 + (elems[i] ? fieldSize(*elems[i]) : 0); // null flag
+        return ret;
+    }
+    case pvd::union_: {
+        // selector, ignoring the type description sent with variant unions
+        pvd::PVFieldPtr val(static_cast<const pvd::PVUnion&>(fld).get());
+        return 1 + (val ? fieldSize(*val) : 0);
+    }
+    case pvd::unionArray: {
+        pvd::PVUnionArray::const_svector elems(static_cast<const pvd::PVUnionArray&>(fld).view());
+        size_t ret = sizeSize(elems.size());
+        for(size_t i=0; i<elems.size(); i++)
+            ret += 1 + (elems[i] ? fieldSize(*elems[i]) : 0);
+        return ret;
+    }
+    }
+    return 0;
+}
+
 // fetch scalar value or default
 template<typename T>
 T getS(const pvd::PVStructurePtr& s, const char* name, T dft)
@@ -29,15 +93,97 @@ T getS(const pvd::PVStructurePtr& s, const char* name, T dft)
         return dft;
     }
 }
+
+// does any field under 'fld' have _options (eg. array slice, deadband)
+bool hasOptions(const pvd::PVStructure& fld)
+{
+    const pvd::PVFieldPtrArray& subs = fld.getPVFields();
+    for(size_t i=0; i<subs.size(); i++) {
+        if(subs[i]->getField()->getType()!=pvd::structure)
+            continue;
+        if(subs[i]->getFieldName()=="_options"
+                || hasOptions(static_cast<const pvd::PVStructure&>(*subs[i])))
+            return true;
+    }
+    return false;
+}
+}
+
+size_t estimateUpdateSize(const pvd::PVStructure& value, const pvd::BitSet& changed)
+{
+    size_t ret = sizeSize(changed.size()/8u) + changed.size()/8u; // the BitSet itself
+
+    for(pvd::int32 i = changed.nextSetBit(0); i>=0; ) {
+        if(i==0)
+            return ret + fieldSize(value); // everything
+
+        pvd::PVFieldPtr fld(value.getSubField(i));
+        if(!fld)
+            break;
+        ret += fieldSize(*fld); // includes any sub-fields
+        i = changed.nextSetBit(fld->getNextFieldOffset());
+    }
+    return ret;
+}
+
+LatencyHist::LatencyHist()
+{
+    for(size_t i=0; i<NBuckets; i++)
+        buckets[i] = 0;
+}
+
+void
+LatencyHist::add(epicsUInt64 ns)
+{
+    epicsUInt64 us = ns/1000u;
+    size_t i = 0;
+    while(us>1u && i<NBuckets-1) {
+        us >>= 1;
+        i++;
+    }
+    epicsAtomicIncrSizeT(&buckets[i]);
+}
+
+void
+LatencyHist::show(std::ostream& strm, const char *indent) const
+{
+    size_t counts[NBuckets], total = 0;
+    for(size_t i=0; i<NBuckets; i++)
+        total += counts[i] = epicsAtomicGetSizeT(const_cast<size_t*>(&buckets[i]));
+    if(!total)
+        return;
+
+    strm<<indent<<"latency (us)";
+    for(size_t i=0; i<NBuckets; i++) {
+        if(counts[i])
+            strm<<" <"<<(epicsUInt64(1u)<<(i+1))<<":"<<counts[i];
+    }
+    strm<<"\n"<<indent<<"  ";
+
+    // upper bounds of percentiles
+    const double pct[] = {0.5, 0.9, 0.99};
+    size_t cum = 0, p = 0;
+    for(size_t i=0; i<NBuckets && p<3; i++) {
+        cum += counts[i];
+        while(p<3 && cum>=pct[p]*total) {
+            strm<<" p"<<pct[p]*100<<"<"<<(epicsUInt64(1u)<<(i+1))<<"us";
+            p++;
+        }
+    }
+    strm<<" of "<<total<<"\n";
 }
 
 MonitorCacheEntry::MonitorCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
     :chan(ent)
     ,bufferSize(getS<pvd::uint32>(pvr, "record._options.queueSize", 2)) // should be same default as pvAccess, but not required
+    ,fieldkey(fieldKey(pvr))
+    ,fieldopts(fieldOptions(pvr))
     ,havedata(false)
     ,done(false)
+    ,seq(0)
     ,nwakeups(0)
     ,nevents(0)
+    ,nbytes(0)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
@@ -53,6 +199,36 @@ MonitorCacheEntry::~MonitorCacheEntry()
     const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
 }
 
+MonitorCacheEntry::pvrequest_t
+MonitorCacheEntry::fieldKey(const pvd::PVStructure::shared_pointer& pvr)
+{
+    pvrequest_t ret;
+    pvd::PVStructurePtr fld(pvr ? pvr->getSubField<pvd::PVStructure>("field") : pvd::PVStructurePtr());
+    // no 'field' or 'field()' both select everything
+    if(fld && fld->getStructure()->getNumberFields()>0) {
+        // serialize type and value (eg. of _options) using host byte order (only used for local comparison)
+        pvd::serializeToVector(fld->getStructure().get(), EPICS_BYTE_ORDER, ret);
+        pvrequest_t val;
+        pvd::serializeToVector(fld.get(), EPICS_BYTE_ORDER, val);
+        ret.insert(ret.end(), val.begin(), val.end());
+    }
+    return ret;
+}
+
+bool
+MonitorCacheEntry::fieldOptions(const pvd::PVStructure::shared_pointer& pvr)
+{
+    pvd::PVStructurePtr fld(pvr ? pvr->getSubField<pvd::PVStructure>("field") : pvd::PVStructurePtr());
+    return fld && hasOptions(*fld);
+}
+
+bool
+MonitorCacheEntry::fresh() const
+{
+    return havedata && !done && mon && lastelem && startresult.isSuccess()
+            && chan && chan->channel && chan->channel->isConnected();
+}
+
 void
 MonitorCacheEntry::monitorConnect(pvd::Status const & status,
                                   pvd::MonitorPtr const & monitor,
@@ -88,6 +264,8 @@ MonitorCacheEntry::monitorConnect(pvd::Status const & status,
 
     if(!startresult.isSuccess())
         std::cout<<"upstream monitor start() fails\n";
+    else if(fieldkey.empty())
+        chan->checkFields(structure); // complete type, compare with getField() cache
 
     shared_pointer self(weakref); // keeps us alive all MonitorUsers are destroy()ed
 
@@ -127,34 +305,65 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
     typedef std::vector<MonitorUser::shared_pointer> dsnotify_t;
     dsnotify_t dsnotify;
 
+    // mutex() is only held to poll() upstream and update lastelem.
+    // Each update is then copied from lastelem to each MonitorUser holding only that user's lock.
     {
-        Guard G(mutex()); // MCE and MU guarded by the same mutex
-        if(!havedata)
-            havedata = true;
+        Guard F(fanoutLock);
 
         //TODO: flow control, if all MU buffers are full, break before poll()==NULL
-        while((update=monitor->poll()))
+        while(true)
         {
+            epicsUInt64 now;
+            size_t curseq;
+            {
+                Guard G(mutex());
+                if(!(update=monitor->poll()))
+                    break;
+                if(!havedata)
+                    havedata = true;
+
+                now = epicsMonotonicGet();
+
+                lastelem->pvStructurePtr->copyUnchecked(*update->pvStructurePtr,
+                                                        *update->changedBitSet);
+                *lastelem->changedBitSet = *update->changedBitSet;
+                *lastelem->overrunBitSet = *update->overrunBitSet;
+                monitor->release(update);
+                update.reset();
+
+                curseq = ++seq;
+
+                fanout.clear();
+                interested.lock_vector(fanout); // recursively locks interested.mutex() (assumes this->mutex() is interestd.mutex())
+            }
+            // lastelem is now only read, which fanoutLock allows
+
+            const size_t bytes = estimateUpdateSize(*lastelem->pvStructurePtr, *lastelem->changedBitSet);
             epicsAtomicIncrSizeT(&nevents);
+            epicsAtomicAddSizeT(&nbytes, bytes);
+            trace(TraceUpstreamEvent, chan->chanid, bytes);
 
-            lastelem->pvStructurePtr->copyUnchecked(*update->pvStructurePtr,
-                                                    *update->changedBitSet);
-            *lastelem->changedBitSet = *update->changedBitSet;
-            *lastelem->overrunBitSet = *update->overrunBitSet;
-            monitor->release(update);
-            update.reset();
+            if(fieldkey.empty() && chan->cache->recorder.recording())
+                chan->cache->recorder.update(chan->chanid, chan->channelName, typedesc, *lastelem->pvStructurePtr,
+                                             *lastelem->changedBitSet, *lastelem->overrunBitSet);
 
-            interested_t::iterator IIT(interested); // recursively locks interested.mutex() (assumes this->mutex() is interestd.mutex())
-            for(interested_t::value_pointer pusr = IIT.next(); pusr; pusr = IIT.next())
+            FOREACH(interested_t::vector_type::iterator, it, end, fanout)
             {
-                MonitorUser *usr = pusr.get();
+                MonitorUser *usr = it->get();
 
                 {
                     Guard G(usr->mutex());
                     if(usr->initial)
                         continue; // no start() yet
+                    if(usr->seq>=curseq)
+                        continue; // start() already queued this update
+                    usr->seq = curseq;
                     // TODO: track overflow when !running (after stop())?
                     if(!usr->running || usr->empty.empty()) {
+                        if(!usr->inoverflow) {
+                            usr->overflowtime = now;
+                            trace(TraceOverflow, chan->chanid);
+                        }
                         usr->inoverflow = true;
 
                         /* overrun |= lastelem->overrun           // upstream overflows
@@ -179,7 +388,7 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
                     assert(!usr->inoverflow);
 
                     if(usr->filled.empty())
-                        dsnotify.push_back(pusr);
+                        dsnotify.push_back(*it);
 
                     pvd::MonitorElementPtr elem(usr->empty.front());
 
@@ -190,17 +399,24 @@ MonitorCacheEntry::monitorEvent(pvd::MonitorPtr const & monitor)
                     elem->pvStructurePtr->copyUnchecked(*lastelem->pvStructurePtr);
 
                     usr->filled.push_back(elem);
+                    usr->filledtime.push_back(now);
+                    usr->filledbytes.push_back(bytes);
                     usr->empty.pop_front();
 
                     epicsAtomicIncrSizeT(&usr->nevents);
                 }
             }
         }
+
+        fanout.clear();
     }
 
     // unlock here, race w/ stop(), unlisten()?
     //TODO: notify from worker thread
 
+    if(!dsnotify.empty())
+        trace(TraceFanout, chan->chanid, dsnotify.size());
+
     FOREACH(dsnotify_t::iterator, it,end,dsnotify) {
         MonitorUser *usr = (*it).get();
         pvd::MonitorRequester::shared_pointer req(usr->req);
@@ -230,7 +446,12 @@ MonitorCacheEntry::unlisten(pvd::MonitorPtr const & monitor)
     FOREACH(interested_t::vector_type::iterator, it, end, tonotify) {
         MonitorUser *usr = it->get();
         pvd::MonitorRequester::shared_pointer req(usr->req);
-        if(usr->inuse.empty()) // TODO: what about stopped?
+        bool idle;
+        {
+            Guard G(usr->mutex());
+            idle = usr->inuse.empty();
+        }
+        if(idle) // TODO: what about stopped?
             req->unlisten(*it);
     }
 }
@@ -248,6 +469,9 @@ MonitorUser::MonitorUser(const MonitorCacheEntry::shared_pointer &e)
     ,inoverflow(false)
     ,nevents(0)
     ,ndropped(0)
+    ,nbytes(0)
+    ,seq(0)
+    ,overflowtime(0u)
 {
     epicsAtomicIncrSizeT(&num_instances);
 }
@@ -276,11 +500,14 @@ MonitorUser::start()
 
     bool doEvt = false;
     {
-        Guard G(entry->mutex()); // MCE and MU have share a lock
+        Guard G(entry->mutex()); // lastelem may be copied below
+        Guard U(mutex());
 
         if(!entry->startresult.isSuccess())
             return entry->startresult;
 
+        seq = entry->seq; // monitorEvent() skips updates already included in lastelem
+
         pvd::PVStructurePtr lval;
         if(entry->havedata)
             lval = entry->lastelem->pvStructurePtr;
@@ -309,6 +536,8 @@ MonitorUser::start()
             elem->changedBitSet->set(0); // indicate all changed
             elem->overrunBitSet->clear();
             filled.push_back(elem);
+            filledtime.push_back(0u); // not a new update, so not counted
+            filledbytes.push_back(estimateUpdateSize(*elem->pvStructurePtr, *elem->changedBitSet));
             empty.pop_front();
         }
 
@@ -337,6 +566,22 @@ MonitorUser::poll()
         ret = filled.front();
         inuse.insert(ret); // track which ones are out for client use
         filled.pop_front();
+
+        epicsUInt64 recvd = filledtime.front();
+        filledtime.pop_front();
+        const size_t bytes = filledbytes.front();
+        filledbytes.pop_front();
+        if(recvd) {
+            epicsUInt64 dT = epicsMonotonicGet()-recvd;
+            entry->latency.add(dT);
+            MonitorCacheEntry::latencyAll.add(dT);
+        }
+
+        epicsAtomicAddSizeT(&nbytes, bytes);
+        if(peer) {
+            epicsAtomicIncrSizeT(&peer->nupdates);
+            epicsAtomicAddSizeT(&peer->nbytes, bytes);
+        }
         //TODO: track lost buffers w/ wrapped shared_ptr?
     }
     return ret;
@@ -357,14 +602,19 @@ MonitorUser::release(pva::MonitorElementPtr const & monitorElement)
             // and replace it with the element being release()d
 
             filled.push_back(overflowElement);
+            filledtime.push_back(overflowtime);
+            // once for all of the updates merged
+            filledbytes.push_back(estimateUpdateSize(*overflowElement->pvStructurePtr, *overflowElement->changedBitSet));
             overflowElement = monitorElement;
             overflowElement->changedBitSet->clear();
             overflowElement->overrunBitSet->clear();
 
             inoverflow = false;
+            trace(TraceRelease, entry->chan->chanid, 1);
         } else {
             // push_back empty element
             empty.push_back(monitorElement);
+            trace(TraceRelease, entry->chan->chanid);
         }
     } else {
         // oh no, we've been given an element which we didn't give to downstream
@@ -0,0 +1,67 @@
+
+#include <stdio.h>
+#include <algorithm>
+#include <stdexcept>
+
+#define epicsExportSharedSymbols
+#include "partition.h"
+
+namespace {
+// points on the ring for each worker.  More gives a more even split
+const unsigned npoints = 128u;
+}
+
+Partition::Partition()
+    :index(0u)
+    ,count(1u)
+{}
+
+Partition::Partition(unsigned index, unsigned count)
+    :index(index)
+    ,count(count)
+{
+    if(count==0u || index>=count)
+        throw std::invalid_argument("Worker index out of range");
+
+    ring.reserve(count*npoints);
+    for(unsigned w=0; w<count; w++) {
+        for(unsigned p=0; p<npoints; p++) {
+            char key[32];
+            int len = sprintf(key, "worker%u-%u", w, p);
+            ring.push_back(std::make_pair(hash(key, len), w));
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+unsigned
+Partition::owner(const std::string& name) const
+{
+    if(ring.empty())
+        return 0u;
+
+    ring_t::value_type key(hash(name.c_str(), name.size()), 0u);
+    // first point at or after the hash of 'name', wrapping around
+    ring_t::const_iterator it(std::lower_bound(ring.begin(), ring.end(), key));
+    if(it==ring.end())
+        it = ring.begin();
+    return it->second;
+}
+
+// 32-bit FNV-1a, with the murmur3 finalizer so that similar names spread around the ring.
+// Must not change, as all workers must agree.
+epicsUInt32
+Partition::hash(const char *s, size_t len)
+{
+    epicsUInt32 h = 2166136261u;
+    for(size_t i=0; i<len; i++) {
+        h ^= epicsUInt8(s[i]);
+        h *= 16777619u;
+    }
+    h ^= h>>16;
+    h *= 0x85ebca6bu;
+    h ^= h>>13;
+    h *= 0xc2b2ae35u;
+    h ^= h>>16;
+    return h;
+}
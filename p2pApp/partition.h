@@ -0,0 +1,40 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <epicsTypes.h>
+
+/** Assignment of channel names to one of 'count' worker processes by consistent hashing.
+ *
+ * Each worker is placed at several points on a ring of 32-bit hashes,
+ * and owns the names which hash to the interval ending at each of its points.
+ * Changing the number of workers only moves about 1/count of the names.
+ */
+struct Partition
+{
+    unsigned index; // which worker we are
+    unsigned count; // number of workers
+
+    //! a single partition which owns all names
+    Partition();
+    Partition(unsigned index, unsigned count);
+
+    //! worker which owns 'name'
+    unsigned owner(const std::string& name) const;
+
+    inline bool owns(const std::string& name) const {
+        return count<=1u || owner(name)==index;
+    }
+
+    static epicsUInt32 hash(const char *s, size_t len);
+
+private:
+    // (point, worker) sorted by point
+    typedef std::vector<std::pair<epicsUInt32, unsigned> > ring_t;
+    ring_t ring;
+};
+
+#endif // PARTITION_H
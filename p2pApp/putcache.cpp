@@ -0,0 +1,506 @@
+
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsEndian.h>
+
+#include <pv/pvAccess.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "chancache.h"
+#include "channel.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+size_t GWPut::num_instances;
+size_t PutCacheEntry::num_instances;
+size_t PutCacheEntry::URequester::num_instances;
+
+GWPut::GWPut(const GWChannel::shared_pointer& chan,
+             const pva::ChannelPutRequester::shared_pointer& req,
+             const PutCacheEntry::shared_pointer& pent)
+    :channel(chan)
+    ,requester(req)
+    ,pent(pent)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+GWPut::~GWPut()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+void
+GWPut::destroy()
+{}
+
+std::tr1::shared_ptr<pva::Channel>
+GWPut::getChannel()
+{
+    return channel;
+}
+
+void
+GWPut::cancel()
+{
+    // the upstream put() may carry values from other downstream puts, so isn't cancelled
+}
+
+void
+GWPut::lastRequest()
+{}
+
+void
+GWPut::put(pvd::PVStructure::shared_pointer const & pvPutStructure,
+           pvd::BitSet::shared_pointer const & putBitSet)
+{
+    pvd::BitSet::shared_pointer changed(putBitSet);
+    if(!changed) {
+        changed.reset(new pvd::BitSet);
+        changed->set(0);
+    }
+    pent->put(shared_pointer(weakref), pvPutStructure, changed);
+}
+
+void
+GWPut::get()
+{
+    pent->get(shared_pointer(weakref));
+}
+
+PutCacheEntry::PutCacheEntry(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+    :chan(ent)
+    ,pvRequest(pvr)
+    ,connected(false)
+    ,inflight(Idle)
+    ,lastop(Idle)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+PutCacheEntry::~PutCacheEntry()
+{
+    pva::ChannelPut::shared_pointer U;
+    U.swap(upstream);
+    if(U) {
+        U->destroy();
+    }
+    epicsAtomicDecrSizeT(&num_instances);
+    const_cast<ChannelCacheEntry*&>(chan) = NULL; // spoil to fault use after free
+}
+
+PutCacheEntry::shared_pointer
+PutCacheEntry::lookup(ChannelCacheEntry *ent, const pvd::PVStructure::shared_pointer& pvr)
+{
+    ChannelCacheEntry::pvrequest_t ser;
+    // serialize request struct to string using host byte order (only used for local comparison)
+    pvd::serializeToVector(pvr.get(), EPICS_BYTE_ORDER, ser);
+
+    PutCacheEntry::shared_pointer ret;
+
+    Guard G(ent->mutex());
+
+    ret = ent->put_entries.find(ser);
+    if(!ret) {
+        ret.reset(new PutCacheEntry(ent, pvr));
+        ent->put_entries[ser] = ret; // ref. wrapped
+        ret->weakref = ret;
+
+        // We've added an incomplete entry (no ChannelPut)
+        // which will queue connect(), put(), and get() until channelPutConnect()
+        pva::ChannelPutRequester::shared_pointer req(new URequester(ret));
+        pva::ChannelPut::shared_pointer C;
+        {
+            UnGuard U(G);
+
+            C = ent->channel->createChannelPut(req, pvr); // may call channelPutConnect() recursively
+        }
+        Guard G2(ret->mutex);
+        if(!ret->upstream)
+            ret->upstream = C;
+    }
+
+    return ret;
+}
+
+void
+PutCacheEntry::connect(const GWPut::shared_pointer& put)
+{
+    bool now;
+    pvd::Status sts;
+    pvd::StructureConstPtr type;
+    {
+        Guard G(mutex);
+        now = connected || !connectresult.isSuccess();
+        if(!now)
+            connecting.push_back(put);
+        sts = connectresult;
+        type = typedesc;
+    }
+
+    if(now) {
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->channelPutConnect(sts, put, type);
+    }
+}
+
+PutCacheEntry::op_t
+PutCacheEntry::next()
+{
+    if(inflight!=Idle || !connected || !connectresult.isSuccess() || !upstream)
+        return Idle;
+
+    // alternate when both puts and gets are queued
+    if(!queued.empty() && (getqueued.empty() || lastop!=Put)) {
+        // the previous upstream put() has completed, so its buffer may be re-used
+        pending.swap(sending);
+        pendingChanged.swap(sendingChanged);
+        if(pendingChanged)
+            pendingChanged->clear();
+        putting.swap(queued);
+        inflight = Put;
+
+    } else if(!getqueued.empty()) {
+        getting.swap(getqueued);
+        inflight = Get;
+    }
+    if(inflight!=Idle)
+        lastop = inflight;
+    return inflight;
+}
+
+void
+PutCacheEntry::start(op_t op, const pva::ChannelPut::shared_pointer& U,
+                     const pvd::PVStructure::shared_pointer& value,
+                     const pvd::BitSet::shared_pointer& changed)
+{
+    if(op==Put) {
+        epicsAtomicIncrSizeT(&chan->nputupstream);
+        epicsAtomicIncrSizeT(&chan->cache->nputupstream);
+        U->put(value, changed);
+
+    } else if(op==Get) {
+        U->get();
+    }
+}
+
+void
+PutCacheEntry::complete(const waiters_t& waiters, const pvd::Status& sts)
+{
+    FOREACH(waiters_t::const_iterator, it, end, waiters) {
+        GWPut::shared_pointer put(it->lock());
+        if(!put)
+            continue;
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->putDone(sts, put);
+    }
+}
+
+void
+PutCacheEntry::put(const GWPut::shared_pointer& put,
+                   const pvd::PVStructure::shared_pointer& value,
+                   const pvd::BitSet::shared_pointer& changed)
+{
+    epicsAtomicIncrSizeT(&chan->nput);
+    epicsAtomicIncrSizeT(&chan->cache->nput);
+
+    pva::ChannelPut::shared_pointer U;
+    pvd::Status fail;
+    bool failed = false;
+    {
+        Guard G(mutex);
+
+        if(!connectresult.isSuccess()) {
+            failed = true;
+            fail = connectresult;
+
+        } else if(!typedesc || (value->getStructure()!=typedesc
+                                && !(*value->getStructure()==*typedesc))) {
+            failed = true;
+            fail = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Put type does not match channelPutConnect()");
+
+        } else if(inflight==Idle && connected && upstream) {
+            // nothing to merge with, so send as is.
+            // downstream won't re-use 'value' until we call putDone()
+            inflight = lastop = Put;
+            putting.push_back(put);
+            U = upstream;
+
+        } else {
+            // merge with other puts waiting for the upstream put() in flight
+            // (or for reconnect).  Last writer wins for each field.
+            if(!pending)
+                pending = pvd::getPVDataCreate()->createPVStructure(typedesc);
+            if(!pendingChanged)
+                pendingChanged.reset(new pvd::BitSet);
+
+            pending->copyUnchecked(*value, *changed);
+            *pendingChanged |= *changed;
+            queued.push_back(put);
+        }
+    }
+
+    if(U) {
+        start(Put, U, value, changed);
+
+    } else if(failed) {
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->putDone(fail, put);
+    }
+}
+
+void
+PutCacheEntry::get(const GWPut::shared_pointer& put)
+{
+    op_t op = Idle;
+    pva::ChannelPut::shared_pointer U;
+    pvd::PVStructure::shared_pointer value;
+    pvd::BitSet::shared_pointer changed;
+    pvd::Status fail;
+    bool failed = false;
+    {
+        Guard G(mutex);
+
+        if(!connectresult.isSuccess()) {
+            failed = true;
+            fail = connectresult;
+
+        } else if(inflight==Get) {
+            // we will be completed with the result of the upstream get() in flight
+            getting.push_back(put);
+
+        } else {
+            getqueued.push_back(put);
+            op = next();
+            U = upstream;
+            value = sending;
+            changed = sendingChanged;
+        }
+    }
+
+    if(failed) {
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->getDone(fail, put, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+    } else {
+        start(op, U, value, changed);
+    }
+}
+
+PutCacheEntry::URequester::URequester(const PutCacheEntry::shared_pointer& p)
+    :owner(p)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+PutCacheEntry::URequester::~URequester()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+std::string
+PutCacheEntry::URequester::getRequesterName()
+{
+    return "PutCacheEntry";
+}
+
+void
+PutCacheEntry::URequester::channelDisconnect(bool destroy)
+{
+    PutCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    waiters_t toput, toget;
+    {
+        Guard G(self->mutex);
+        self->connected = false;
+        self->inflight = Idle;
+        // requests in flight are lost.  queued requests are sent after reconnect,
+        // unless the upstream channel is destroyed, in which case there will be no reconnect.
+        toput.swap(self->putting);
+        toget.swap(self->getting);
+        if(destroy) {
+            toput.insert(toput.end(), self->queued.begin(), self->queued.end());
+            toget.insert(toget.end(), self->getqueued.begin(), self->getqueued.end());
+            self->queued.clear();
+            self->getqueued.clear();
+            if(self->pendingChanged)
+                self->pendingChanged->clear();
+        }
+    }
+
+    pvd::Status sts(pvd::Status::STATUSTYPE_ERROR, "Upstream disconnected");
+
+    complete(toput, sts);
+
+    FOREACH(waiters_t::const_iterator, it, end, toget) {
+        GWPut::shared_pointer put(it->lock());
+        if(!put)
+            continue;
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->getDone(sts, put, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+    }
+}
+
+void
+PutCacheEntry::URequester::channelPutConnect(const pvd::Status& status,
+                                             pva::ChannelPut::shared_pointer const & channelPut,
+                                             pvd::Structure::const_shared_pointer const & structure)
+{
+    PutCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    pvd::Status sts(status);
+    if(sts.isSuccess() && !structure)
+        sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream provides no type");
+
+    waiters_t toconnect, toput, toget;
+    pvd::StructureConstPtr type;
+    op_t op = Idle;
+    pvd::PVStructure::shared_pointer value;
+    pvd::BitSet::shared_pointer changed;
+    {
+        Guard G(self->mutex);
+
+        // we shouldn't see a type change since the ChannelCacheEntry is dropped on disconnect
+        if(sts.isSuccess() && self->typedesc && !(*self->typedesc==*structure))
+            sts = pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Upstream type changed");
+
+        self->upstream = channelPut;
+        self->connected = true;
+        self->connectresult = sts;
+        if(sts.isSuccess() && !self->typedesc)
+            self->typedesc = structure;
+        type = self->typedesc;
+
+        if(!sts.isSuccess()) {
+            toput.swap(self->queued);
+            toget.swap(self->getqueued);
+            self->inflight = Idle;
+
+        } else {
+            // requests queued before (re)connect
+            op = self->next();
+            value = self->sending;
+            changed = self->sendingChanged;
+        }
+
+        toconnect.swap(self->connecting);
+    }
+
+    FOREACH(waiters_t::const_iterator, it, end, toconnect) {
+        GWPut::shared_pointer put(it->lock());
+        if(!put)
+            continue;
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->channelPutConnect(sts, put, type);
+    }
+
+    self->start(op, channelPut, value, changed);
+
+    complete(toput, sts);
+
+    FOREACH(waiters_t::const_iterator, it, end, toget) {
+        GWPut::shared_pointer put(it->lock());
+        if(!put)
+            continue;
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->getDone(sts, put, pvd::PVStructurePtr(), pvd::BitSet::shared_pointer());
+    }
+}
+
+void
+PutCacheEntry::URequester::putDone(const pvd::Status& status,
+                                   pva::ChannelPut::shared_pointer const & channelPut)
+{
+    PutCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    waiters_t todo;
+    op_t op;
+    pvd::PVStructure::shared_pointer value;
+    pvd::BitSet::shared_pointer changed;
+    {
+        Guard G(self->mutex);
+        if(self->inflight!=Put)
+            return; // already failed by channelDisconnect()
+        self->inflight = Idle;
+        todo.swap(self->putting);
+
+        // send anything merged while we were busy
+        op = self->next();
+        value = self->sending;
+        changed = self->sendingChanged;
+    }
+
+    self->start(op, channelPut, value, changed);
+
+    // each downstream put() is complete when the upstream put() carrying its value completes
+    complete(todo, status);
+}
+
+void
+PutCacheEntry::URequester::getDone(const pvd::Status& status,
+                                   pva::ChannelPut::shared_pointer const & channelPut,
+                                   pvd::PVStructure::shared_pointer const & pvStructure,
+                                   pvd::BitSet::shared_pointer const & bitSet)
+{
+    PutCacheEntry::shared_pointer self(owner.lock());
+    if(!self)
+        return;
+
+    waiters_t todo;
+    op_t op;
+    pvd::PVStructure::shared_pointer value;
+    pvd::BitSet::shared_pointer changed;
+    {
+        Guard G(self->mutex);
+        if(self->inflight!=Get)
+            return; // already failed by channelDisconnect()
+        self->inflight = Idle;
+        todo.swap(self->getting);
+
+        op = self->next();
+        value = self->sending;
+        changed = self->sendingChanged;
+    }
+
+    // Downstream serializes after we return, while upstream may re-use pvStructure
+    // for the next get().  So give all waiters the same private copy.
+    pvd::PVStructurePtr snap;
+    pvd::BitSet::shared_pointer snapchanged;
+    if(status.isSuccess() && pvStructure) {
+        snap = pvd::getPVDataCreate()->createPVStructure(pvStructure->getStructure());
+        snap->copyUnchecked(*pvStructure);
+        if(bitSet) {
+            snapchanged.reset(new pvd::BitSet(*bitSet));
+        } else {
+            snapchanged.reset(new pvd::BitSet);
+            snapchanged->set(0);
+        }
+    }
+
+    self->start(op, channelPut, value, changed);
+
+    FOREACH(waiters_t::const_iterator, it, end, todo) {
+        GWPut::shared_pointer put(it->lock());
+        if(!put)
+            continue;
+        pva::ChannelPutRequester::shared_pointer req(put->requester.lock());
+        if(req)
+            req->getDone(status, put, snap, snapchanged);
+    }
+}
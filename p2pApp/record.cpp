@@ -0,0 +1,539 @@
+
+#include <string.h>
+#include <errno.h>
+
+#include <stdexcept>
+#include <sstream>
+#include <set>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define USE_MMAP
+#endif
+
+#include <epicsAtomic.h>
+#include <epicsGuard.h>
+#include <epicsTime.h>
+#include <epicsEndian.h>
+
+#include <pv/byteBuffer.h>
+#include <pv/serialize.h>
+#include <pv/pvAccess.h>
+#include <pv/logger.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "record.h"
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+size_t ReplayChannel::num_instances;
+size_t ReplayMonitor::num_instances;
+
+namespace {
+
+const char recMagic[8] = {'P', '2', 'P', 'R', 'E', 'C', '\0', '\0'};
+
+size_t pad8(size_t n) { return (n+7u)&~size_t(7u); }
+
+// Serialize by appending to a vector
+struct ToVector : public pvd::SerializableControl
+{
+    std::vector<char>& out;
+    pvd::ByteBuffer buf;
+
+    explicit ToVector(std::vector<char>& out) :out(out), buf(16u*1024u, EPICS_BYTE_ORDER) {}
+    virtual ~ToVector() {}
+
+    void flush()
+    {
+        buf.flip();
+        out.insert(out.end(), buf.getBuffer(), buf.getBuffer()+buf.getLimit());
+        buf.clear();
+    }
+
+    virtual void flushSerializeBuffer() { flush(); }
+    virtual void ensureBuffer(std::size_t size)
+    {
+        if(buf.getRemaining()<size)
+            flush();
+    }
+    virtual void alignBuffer(std::size_t alignment) {}
+    virtual bool directSerialize(pvd::ByteBuffer *existingBuffer, const char* toSerialize,
+                                 std::size_t elementCount, std::size_t elementSize)
+    { return false; }
+    virtual void cachedSerialize(std::tr1::shared_ptr<const pvd::Field> const & field, pvd::ByteBuffer* buffer)
+    { field->serialize(buffer, this); }
+};
+
+// Deserialize one complete record body
+struct FromMemory : public pvd::DeserializableControl
+{
+    pvd::ByteBuffer buf;
+
+    FromMemory(const char *body, size_t len, int byteOrder)
+        :buf(const_cast<char*>(body), len, byteOrder) // only read
+    {}
+    virtual ~FromMemory() {}
+
+    virtual void ensureData(std::size_t size)
+    {
+        if(buf.getRemaining()<size)
+            throw std::runtime_error("Truncated record");
+    }
+    virtual void alignData(std::size_t alignment) {}
+    virtual bool directDeserialize(pvd::ByteBuffer *existingBuffer, char* deserializeTo,
+                                   std::size_t elementCount, std::size_t elementSize)
+    { return false; }
+    virtual std::tr1::shared_ptr<const pvd::Field> cachedDeserialize(pvd::ByteBuffer* buffer)
+    { return pvd::getFieldCreate()->deserialize(buffer, this); }
+};
+
+} // namespace
+
+Recorder::Recorder()
+    :active(0)
+    ,fp(0)
+    ,start(0u)
+    ,nupdates(0u)
+    ,nbytes(0u)
+{}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+void
+Recorder::open(const std::string& fname)
+{
+    FILE *F = fopen(fname.c_str(), "wb");
+    if(!F) {
+        std::ostringstream msg;
+        msg<<"Unable to open '"<<fname<<"' : "<<strerror(errno);
+        throw std::runtime_error(msg.str());
+    }
+
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+
+    RecFileHeader H;
+    memset(&H, 0, sizeof(H));
+    memcpy(H.magic, recMagic, sizeof(H.magic));
+    H.version = 1u;
+    H.byteOrder = EPICS_BYTE_ORDER;
+    H.startSec = now.secPastEpoch;
+    H.startNSec = now.nsec;
+
+    if(fwrite(&H, sizeof(H), 1, F)!=1) {
+        fclose(F);
+        throw std::runtime_error("Unable to write recording header");
+    }
+
+    close();
+
+    Guard G(mutex);
+    fp = F;
+    this->fname = fname;
+    start = epicsMonotonicGet();
+    chans.clear();
+    nupdates = nbytes = 0u;
+    epicsAtomicSetIntT(&active, 1);
+}
+
+void
+Recorder::close()
+{
+    Guard G(mutex);
+    epicsAtomicSetIntT(&active, 0);
+    if(fp) {
+        fclose(fp);
+        fp = 0;
+    }
+}
+
+void
+Recorder::write(epicsUInt16 kind, epicsUInt32 chan, epicsUInt64 time)
+{
+    // assume mutex is locked
+    RecHeader H;
+    memset(&H, 0, sizeof(H));
+    H.length = scratch.size();
+    H.kind = kind;
+    H.chan = chan;
+    H.time = time;
+
+    scratch.resize(pad8(scratch.size()), '\0');
+
+    if(fwrite(&H, sizeof(H), 1, fp)!=1 || fwrite(&scratch[0], 1, scratch.size(), fp)!=scratch.size()) {
+        // disk full?  stop rather than writing a corrupt recording
+        epicsAtomicSetIntT(&active, 0);
+        fclose(fp);
+        fp = 0;
+        return;
+    }
+    nbytes += sizeof(H)+scratch.size();
+}
+
+void
+Recorder::update(size_t chanid,
+                 const std::string& name,
+                 const pvd::StructureConstPtr& type,
+                 const pvd::PVStructure& value,
+                 const pvd::BitSet& changed,
+                 const pvd::BitSet& overrun)
+{
+    Guard G(mutex);
+    if(!fp)
+        return;
+
+    const epicsUInt64 now = epicsMonotonicGet()-start;
+
+    chans_t::const_iterator it(chans.find(chanid));
+    epicsUInt32 idx;
+    const pvd::BitSet *mask = &changed;
+    pvd::BitSet all;
+    if(it==chans.end()) {
+        // first update of a channel is complete, so replay begins with a known value
+        all.set(0);
+        mask = &all;
+
+        idx = chans.size();
+        chans[chanid] = idx;
+
+        epicsUInt32 namelen = name.size();
+        scratch.resize(sizeof(namelen)+name.size());
+        memcpy(&scratch[0], &namelen, sizeof(namelen));
+        memcpy(&scratch[sizeof(namelen)], name.c_str(), name.size());
+        {
+            ToVector C(scratch);
+            C.cachedSerialize(type, &C.buf);
+            C.flush();
+        }
+        write(RecType, idx, now);
+        if(!fp)
+            return;
+    } else {
+        idx = it->second;
+    }
+
+    scratch.clear();
+    {
+        ToVector C(scratch);
+        mask->serialize(&C.buf, &C);
+        overrun.serialize(&C.buf, &C);
+        value.serialize(&C.buf, &C, mask);
+        C.flush();
+    }
+    write(RecUpdate, idx, now);
+    nupdates++;
+}
+
+void
+Recorder::show(std::ostream& strm) const
+{
+    Guard G(mutex);
+    if(fp)
+        strm<<"Recording to '"<<fname<<"' "<<chans.size()<<" channels, "
+            <<nupdates<<" updates, "<<nbytes<<" bytes\n";
+}
+
+ReplayPV::ReplayPV(const std::string& name, const pvd::StructureConstPtr& type)
+    :name(name)
+    ,type(type)
+    ,value(pvd::getPVDataCreate()->createPVStructure(type))
+{}
+
+ReplayChannel::ReplayChannel(const ReplayPV::shared_pointer& pv,
+                             const std::tr1::shared_ptr<ReplayProvider>& prov,
+                             const pva::ChannelRequester::shared_pointer& req)
+    :BaseChannel(pv->name, prov, req, pv->type)
+    ,pv(pv)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+ReplayChannel::~ReplayChannel()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+pvd::Monitor::shared_pointer
+ReplayChannel::createMonitor(pvd::MonitorRequester::shared_pointer const & monitorRequester,
+                             pvd::PVStructure::shared_pointer const & pvRequest)
+{
+    ReplayMonitor::shared_pointer ret(new ReplayMonitor(pv, monitorRequester, pvRequest));
+    ret->weakself = ret;
+    {
+        BaseMonitor::guard_t G(pv->lock);
+        pv->monitors.insert(ret);
+        ret->connect(G, pv->value); // calls monitorConnect()
+    }
+    return ret;
+}
+
+ReplayMonitor::ReplayMonitor(const ReplayPV::shared_pointer& pv,
+                             const requester_t::weak_pointer& requester,
+                             const pvd::PVStructure::shared_pointer& pvReq)
+    :BaseMonitor(pv->lock, requester, pvReq)
+    ,pv(pv)
+{
+    epicsAtomicIncrSizeT(&num_instances);
+}
+
+ReplayMonitor::~ReplayMonitor()
+{
+    epicsAtomicDecrSizeT(&num_instances);
+}
+
+void
+ReplayMonitor::onStart()
+{
+    // initial update with current value
+    guard_t G(lock);
+    post(G);
+}
+
+ReplayProvider::ReplayProvider(const std::string& fname, double speed, bool loop)
+    :speed(speed>0.0 ? speed : 1.0)
+    ,loop(loop)
+    ,base(0)
+    ,size(0u)
+    ,mapped(false)
+    ,byteOrder(EPICS_BYTE_ORDER)
+    ,worker(*this, "p2pReplay",
+            epicsThreadGetStackSize(epicsThreadStackSmall),
+            epicsThreadPriorityMedium)
+    ,started(false)
+    ,quit(0)
+{
+#ifdef USE_MMAP
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd>=0) {
+        struct stat info;
+        if(fstat(fd, &info)==0 && info.st_size>0) {
+            void *M = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(M!=MAP_FAILED) {
+                base = static_cast<const char*>(M);
+                size = info.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+    }
+#endif
+    if(!mapped) {
+        FILE *F = fopen(fname.c_str(), "rb");
+        if(F) {
+            char buf[4096];
+            size_t n;
+            while((n=fread(buf, 1, sizeof(buf), F))>0)
+                storage.insert(storage.end(), buf, buf+n);
+            fclose(F);
+        }
+        base = storage.empty() ? 0 : &storage[0];
+        size = storage.size();
+    }
+
+    try {
+        if(size<sizeof(RecFileHeader))
+            throw std::runtime_error("Not a recording");
+
+        const RecFileHeader *H = reinterpret_cast<const RecFileHeader*>(base);
+        if(memcmp(H->magic, recMagic, sizeof(recMagic))!=0 || H->version!=1u)
+            throw std::runtime_error("Not a recording, or unsupported version");
+        if(H->byteOrder!=EPICS_BYTE_ORDER)
+            throw std::runtime_error("Recording made on a host with different byte order");
+        byteOrder = H->byteOrder;
+
+        std::set<ReplayPV*> initial;
+
+        // validate record boundaries, and collect types and initial values
+        for(size_t pos = sizeof(RecFileHeader); pos<size; ) {
+            if(size-pos < sizeof(RecHeader))
+                throw std::runtime_error("Truncated recording");
+
+            const RecHeader *R = reinterpret_cast<const RecHeader*>(base+pos);
+            const char *body = base+pos+sizeof(RecHeader);
+            if(size-pos-sizeof(RecHeader) < R->length)
+                throw std::runtime_error("Truncated recording");
+
+            if(R->kind==RecType) {
+                epicsUInt32 namelen;
+                if(R->length<sizeof(namelen))
+                    throw std::runtime_error("Truncated channel definition");
+                memcpy(&namelen, body, sizeof(namelen));
+                if(R->length-sizeof(namelen) < namelen)
+                    throw std::runtime_error("Truncated channel definition");
+                std::string name(body+sizeof(namelen), namelen);
+
+                FromMemory C(body+sizeof(namelen)+namelen, R->length-sizeof(namelen)-namelen, byteOrder);
+                pvd::StructureConstPtr type(std::tr1::dynamic_pointer_cast<const pvd::Structure>(C.cachedDeserialize(&C.buf)));
+                if(!type)
+                    throw std::runtime_error("Channel definition is not a Structure");
+
+                if(R->chan>=bychan.size())
+                    bychan.resize(R->chan+1u);
+
+                ReplayPV::shared_pointer& pv = pvs[name];
+                if(!pv) {
+                    pv.reset(new ReplayPV(name, type));
+                    bychan[R->chan] = pv;
+
+                } else if(*pv->type==*type) {
+                    bychan[R->chan] = pv;
+
+                } else {
+                    LOG(pva::logLevelWarn, "Replay ignores type change of '%s'", name.c_str());
+                }
+
+            } else if(R->kind==RecUpdate) {
+                if(R->chan<bychan.size() && bychan[R->chan] && !initial.count(bychan[R->chan].get())) {
+                    // channel starts with its first recorded value
+                    initial.insert(bychan[R->chan].get());
+                    apply(*bychan[R->chan], body, R->length, false);
+                }
+            }
+
+            pos += sizeof(RecHeader) + pad8(R->length);
+        }
+    } catch(...) {
+#ifdef USE_MMAP
+        if(mapped)
+            munmap(const_cast<char*>(base), size);
+#endif
+        throw;
+    }
+}
+
+ReplayProvider::~ReplayProvider()
+{
+    if(started) {
+        epicsAtomicSetIntT(&quit, 1);
+        wakeup.signal();
+        worker.exitWait();
+    }
+#ifdef USE_MMAP
+    if(mapped)
+        munmap(const_cast<char*>(base), size);
+#endif
+}
+
+void
+ReplayProvider::start()
+{
+    if(!started) {
+        started = true;
+        worker.start();
+    }
+}
+
+void
+ReplayProvider::join()
+{
+    if(started)
+        worker.exitWait();
+}
+
+std::tr1::shared_ptr<pva::ChannelProvider>
+ReplayProvider::getChannelProvider()
+{
+    return shared_from_this();
+}
+
+pva::ChannelFind::shared_pointer
+ReplayProvider::channelFind(std::string const & channelName,
+                            pva::ChannelFindRequester::shared_pointer const & channelFindRequester)
+{
+    pva::ChannelFind::shared_pointer ret;
+    bool found = pvs.find(channelName)!=pvs.end();
+    if(found)
+        ret = shared_from_this();
+    channelFindRequester->channelFindResult(pvd::Status::Ok, ret, found);
+    return ret;
+}
+
+pva::ChannelFind::shared_pointer
+ReplayProvider::channelList(pva::ChannelListRequester::shared_pointer const & channelListRequester)
+{
+    pva::ChannelFind::shared_pointer ret(shared_from_this());
+    pvd::PVStringArray::svector names;
+    names.reserve(pvs.size());
+    FOREACH(pvs_t::const_iterator, it, end, pvs)
+        names.push_back(it->first);
+    channelListRequester->channelListResult(pvd::Status::Ok, ret, pvd::freeze(names), false);
+    return ret;
+}
+
+pva::Channel::shared_pointer
+ReplayProvider::createChannel(std::string const & channelName,
+                              pva::ChannelRequester::shared_pointer const & channelRequester,
+                              short priority, std::string const & address)
+{
+    pva::Channel::shared_pointer ret;
+    pvs_t::const_iterator it(pvs.find(channelName));
+
+    if(it!=pvs.end()) {
+        ret.reset(new ReplayChannel(it->second, shared_from_this(), channelRequester));
+        channelRequester->channelCreated(pvd::Status::Ok, ret);
+    } else {
+        channelRequester->channelCreated(pvd::Status(pvd::Status::STATUSTYPE_ERROR, "Not in recording"), ret);
+    }
+    return ret;
+}
+
+void
+ReplayProvider::apply(ReplayPV& pv, const char *body, size_t len, bool notify)
+{
+    pvd::BitSet changed, overrun;
+
+    BaseMonitor::guard_t G(pv.lock);
+
+    FromMemory C(body, len, byteOrder);
+    changed.deserialize(&C.buf, &C);
+    overrun.deserialize(&C.buf, &C);
+    pv.value->deserialize(&C.buf, &C, &changed);
+
+    if(!notify)
+        return;
+
+    ReplayPV::monitors_t::vector_type mons(pv.monitors.lock_vector());
+    FOREACH(ReplayPV::monitors_t::vector_type::const_iterator, it, end, mons) {
+        (*it)->post(G, changed, overrun); // unlocks to notify
+    }
+}
+
+void
+ReplayProvider::run()
+{
+    do {
+        const epicsUInt64 begin = epicsMonotonicGet();
+
+        for(size_t pos = sizeof(RecFileHeader); pos<size; ) {
+            const RecHeader *R = reinterpret_cast<const RecHeader*>(base+pos);
+            pos += sizeof(RecHeader) + pad8(R->length);
+
+            if(R->kind!=RecUpdate || R->chan>=bychan.size() || !bychan[R->chan])
+                continue;
+
+            const epicsUInt64 due = begin + epicsUInt64(R->time/speed);
+            epicsUInt64 now;
+            while(!epicsAtomicGetIntT(&quit) && due>(now=epicsMonotonicGet()))
+                wakeup.wait((due-now)*1e-9);
+            if(epicsAtomicGetIntT(&quit))
+                return;
+
+            try {
+                apply(*bychan[R->chan], reinterpret_cast<const char*>(R+1), R->length, true);
+            } catch(std::exception& e) {
+                LOG(pva::logLevelError, "Replay of '%s' fails : %s", bychan[R->chan]->name.c_str(), e.what());
+                bychan[R->chan].reset(); // ignore further updates
+            }
+        }
+    } while(loop && !epicsAtomicGetIntT(&quit));
+}
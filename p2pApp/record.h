@@ -0,0 +1,221 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <ostream>
+
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTypes.h>
+
+#include <pv/pvAccess.h>
+
+#include "pvahelper.h"
+#include "weakset.h"
+
+/** Recording of upstream monitor updates.
+ *
+ * File layout, all in the byte order of the recording host, with records
+ * aligned to 8 bytes so that a mapped file can be walked in place.
+ *
+ *  RecFileHeader
+ *  RecHeader + body padded to 8 bytes
+ *  ...
+ *
+ * A RecType body defines a channel index: name length (epicsUInt32), name,
+ * and the serialized Structure.
+ * A RecUpdate body is the serialized changed and overrun BitSets
+ * followed by the changed fields of the value.
+ */
+struct RecFileHeader {
+    char magic[8];          // "P2PREC\0\0"
+    epicsUInt32 version;    // 1
+    epicsUInt32 byteOrder;  // EPICS_BYTE_ORDER
+    epicsUInt64 startSec;   // wall clock time of the start of recording
+    epicsUInt32 startNSec;
+    epicsUInt32 reserved;
+};
+
+struct RecHeader {
+    epicsUInt32 length;     // of body, excluding padding
+    epicsUInt16 kind;       // RecType or RecUpdate
+    epicsUInt16 reserved;
+    epicsUInt32 chan;       // channel index
+    epicsUInt32 reserved2;
+    epicsUInt64 time;       // ns since start of recording
+};
+
+enum {RecType=1, RecUpdate=2};
+
+/** Writes monitor updates of complete (no field selection) upstream subscriptions.
+ *  One per ChannelCache.  When not recording, costs one atomic read per update.
+ */
+struct Recorder
+{
+    Recorder();
+    ~Recorder();
+
+    //! start recording to a new file.  Replaces any current recording.
+    void open(const std::string& fname);
+    //! stop recording
+    void close();
+
+    inline bool recording() const { return epicsAtomicGetIntT(const_cast<int*>(&active)); }
+
+    //! record one update.  'chanid' identifies the client channel.
+    //! 'value' must be complete, as the first update of each channel records all fields.
+    void update(size_t chanid,
+                const std::string& name,
+                const epics::pvData::StructureConstPtr& type,
+                const epics::pvData::PVStructure& value,
+                const epics::pvData::BitSet& changed,
+                const epics::pvData::BitSet& overrun);
+
+    void show(std::ostream& strm) const;
+
+private:
+    int active;
+
+    mutable epicsMutex mutex;
+    // guarded by mutex
+    FILE *fp;
+    std::string fname;
+    epicsUInt64 start; // epicsMonotonicGet()
+    typedef std::map<size_t, epicsUInt32> chans_t;
+    chans_t chans;     // chanid -> channel index
+    size_t nupdates, nbytes;
+    std::vector<char> scratch;
+
+    void write(epicsUInt16 kind, epicsUInt32 chan, epicsUInt64 time);
+
+    Recorder(const Recorder&);
+    Recorder& operator=(const Recorder&);
+};
+
+struct ReplayProvider;
+struct ReplayMonitor;
+
+//! A channel read from a recording
+struct ReplayPV
+{
+    POINTER_DEFINITIONS(ReplayPV);
+
+    const std::string name;
+    const epics::pvData::StructureConstPtr type;
+
+    epicsMutex lock;
+    // guarded by lock
+    const epics::pvData::PVStructurePtr value;
+
+    typedef weak_set<ReplayMonitor> monitors_t;
+    monitors_t monitors;
+
+    ReplayPV(const std::string& name, const epics::pvData::StructureConstPtr& type);
+};
+
+struct ReplayChannel : public BaseChannel
+{
+    POINTER_DEFINITIONS(ReplayChannel);
+    static size_t num_instances;
+
+    const ReplayPV::shared_pointer pv;
+
+    ReplayChannel(const ReplayPV::shared_pointer& pv,
+                  const std::tr1::shared_ptr<ReplayProvider>& prov,
+                  const epics::pvAccess::ChannelRequester::shared_pointer& req);
+    virtual ~ReplayChannel();
+
+    virtual ConnectionState getConnectionState() OVERRIDE FINAL { return CONNECTED; }
+
+    virtual epics::pvData::Monitor::shared_pointer createMonitor(
+            epics::pvData::MonitorRequester::shared_pointer const & monitorRequester,
+            epics::pvData::PVStructure::shared_pointer const & pvRequest) OVERRIDE FINAL;
+};
+
+struct ReplayMonitor : public BaseMonitor
+{
+    POINTER_DEFINITIONS(ReplayMonitor);
+    static size_t num_instances;
+
+    const ReplayPV::shared_pointer pv;
+
+    ReplayMonitor(const ReplayPV::shared_pointer& pv,
+                  const requester_t::weak_pointer& requester,
+                  const epics::pvData::PVStructure::shared_pointer& pvReq);
+    virtual ~ReplayMonitor();
+
+    virtual void onStart() OVERRIDE FINAL;
+};
+
+/** Serves a recording through the ChannelProvider interface.
+ *  Updates are replayed, in order, at the original rate times 'speed'
+ *  from when start() is called.
+ */
+struct ReplayProvider :
+        public epics::pvAccess::ChannelProvider,
+        public epics::pvAccess::ChannelFind,
+        public std::tr1::enable_shared_from_this<ReplayProvider>,
+        public epicsThreadRunable
+{
+    POINTER_DEFINITIONS(ReplayProvider);
+
+    ReplayProvider(const std::string& fname, double speed, bool loop);
+    virtual ~ReplayProvider();
+
+    //! begin replay
+    void start();
+    //! wait for replay to end (never when looping)
+    void join();
+
+    virtual std::string getProviderName() OVERRIDE FINAL { return "replay"; }
+
+    virtual std::tr1::shared_ptr<ChannelProvider> getChannelProvider() OVERRIDE FINAL;
+    virtual void cancel() OVERRIDE FINAL {}
+
+    virtual void destroy() OVERRIDE FINAL {}
+
+    virtual epics::pvAccess::ChannelFind::shared_pointer channelFind(std::string const & channelName,
+                                             epics::pvAccess::ChannelFindRequester::shared_pointer const & channelFindRequester) OVERRIDE FINAL;
+    virtual epics::pvAccess::ChannelFind::shared_pointer channelList(epics::pvAccess::ChannelListRequester::shared_pointer const & channelListRequester) OVERRIDE FINAL;
+
+    using epics::pvAccess::ChannelProvider::createChannel;
+    virtual epics::pvAccess::Channel::shared_pointer createChannel(std::string const & channelName,
+                                                       epics::pvAccess::ChannelRequester::shared_pointer const & channelRequester,
+                                                       short priority, std::string const & address) OVERRIDE FINAL;
+
+    virtual void run() OVERRIDE FINAL;
+
+private:
+    const double speed;
+    const bool loop;
+
+    // contents of the recording.  mapped, or read into 'storage'
+    const char *base;
+    size_t size;
+    std::vector<char> storage;
+    bool mapped;
+    int byteOrder;
+
+    typedef std::map<std::string, ReplayPV::shared_pointer> pvs_t;
+    pvs_t pvs;  // fixed after ctor
+    std::vector<ReplayPV::shared_pointer> bychan; // by channel index.  NULL if ignored
+
+    epicsThread worker;
+    epicsEvent wakeup;
+    bool started;
+    int quit;
+
+    //! decode an update into pv.value, and optionally post() to subscribers
+    void apply(ReplayPV& pv, const char *body, size_t len, bool notify);
+
+    ReplayProvider(const ReplayProvider&);
+    ReplayProvider& operator=(const ReplayProvider&);
+};
+
+#endif // RECORD_H
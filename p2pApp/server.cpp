@@ -14,6 +14,7 @@
 #include "helper.h"
 #include "pva2pva.h"
 #include "server.h"
+#include "trace.h"
 
 #if defined(PVDATA_VERSION_INT)
 #if PVDATA_VERSION_INT > VERSION_INT(7,0,0,0)
@@ -39,7 +40,8 @@ GWServerChannelProvider::channelFind(std::string const & channelName,
     pva::ChannelFind::shared_pointer ret;
     bool found = false;
 
-    if(!channelName.empty())
+    // names owned by another worker are left for it to answer
+    if(!channelName.empty() && cache.partition.owns(channelName))
     {
         LOG(pva::logLevelDebug, "Searching for '%s'", channelName.c_str());
         ChannelCacheEntry::shared_pointer ent(cache.lookup(channelName));
@@ -47,6 +49,7 @@ GWServerChannelProvider::channelFind(std::string const & channelName,
             found = true;
             ret = shared_from_this();
         }
+        trace(TraceSearch, ent ? ent->chanid : 0u, found);
     }
 
     // unlock for callback
@@ -66,7 +69,7 @@ GWServerChannelProvider::createChannel(std::string const & channelName,
     GWChannel::shared_pointer ret;
     std::string address = channelRequester->getRequesterName();
 
-    if(!channelName.empty())
+    if(!channelName.empty() && cache.partition.owns(channelName))
     {
         Guard G(cache.cacheLock);
 
@@ -137,6 +140,22 @@ void ServerConfig::drop(const char *client, const char *channel)
     }
 }
 
+void ServerConfig::record(const char *client, const char *fname)
+{
+    if(!client || client[0]=='\0')
+        throw std::runtime_error("Client name required");
+
+    clients_t::const_iterator it(clients.find(client));
+    if(it==clients.end())
+        throw std::runtime_error("No such client");
+
+    if(!fname || fname[0]=='\0') {
+        it->second->cache.recorder.close();
+    } else {
+        it->second->cache.recorder.open(fname);
+    }
+}
+
 void ServerConfig::status_server(int lvl, const char *server)
 {
     if(!server)
@@ -164,6 +183,11 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
 
     bool iswild = strchr(channel, '?') || strchr(channel, '*');
 
+    if(lvl>1) {
+        std::cout<<"All subscriptions\n";
+        MonitorCacheEntry::latencyAll.show(std::cout, "  ");
+    }
+
     FOREACH(clients_t::const_iterator, it, end, clients)
     {
         if(client[0]!='\0' && client[0]!='*' && it->first!=client)
@@ -174,16 +198,23 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
         std::cout<<"==> Client: "<<it->first<<"\n";
 
         ChannelCache::entries_t entries;
+        ChannelCache::peers_t peers;
 
-        size_t ncache, ncleaned, ndust;
+        size_t ncache, ncleaned, ndust, nget, ngetcached, ngetupstream, nput, nputupstream;
         {
             Guard G(prov->cache.cacheLock);
 
             ncache = prov->cache.entries.size();
             ncleaned = prov->cache.cleanerRuns;
             ndust = prov->cache.cleanerDust;
+            nget = epicsAtomicGetSizeT(&prov->cache.nget);
+            ngetcached = epicsAtomicGetSizeT(&prov->cache.ngetcached);
+            ngetupstream = epicsAtomicGetSizeT(&prov->cache.ngetupstream);
+            nput = epicsAtomicGetSizeT(&prov->cache.nput);
+            nputupstream = epicsAtomicGetSizeT(&prov->cache.nputupstream);
 
             if(lvl>0) {
+                peers = prov->cache.peers; // copy of std::map
                 if(!iswild) { // no string or some glob pattern
                     entries = prov->cache.entries; // copy of std::map
                 } else { // just one channel
@@ -196,10 +227,36 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
 
         std::cout<<"Cache has "<<ncache<<" channels.  Cleaned "
                 <<ncleaned<<" times closing "<<ndust<<" channels\n";
+        if(nget) {
+            size_t nforward = nget-ngetcached;
+            std::cout<<"Gets "<<nget<<" with "<<ngetcached<<" from monitor cache, "
+                     <<nforward<<" coalesced into "<<ngetupstream<<" upstream";
+            if(ngetupstream)
+                std::cout<<" (ratio "<<double(nforward)/ngetupstream<<")";
+            std::cout<<"\n";
+        }
+        if(nput) {
+            std::cout<<"Coalescing puts "<<nput<<" merged into "<<nputupstream<<" upstream\n";
+        }
+        FOREACH(ChannelCache::limits_t::const_iterator, it, end, prov->cache.limits) {
+            const RateLimit& L = **it;
+            size_t nhosts, naccepted, nrejected;
+            L.stats(nhosts, naccepted, nrejected);
+            std::cout<<"Limit '"<<L.pattern<<"' "<<L.rate<<"/s burst "<<L.burst<<" for "
+                     <<nhosts<<" client host(s).  "<<naccepted<<" accepted, "<<nrejected<<" rejected\n";
+        }
+        prov->cache.recorder.show(std::cout);
 
         if(lvl<=0)
             continue;
 
+        FOREACH(ChannelCache::peers_t::const_iterator, it2, end2, peers)
+        {
+            std::cout<<"Downstream "<<it2->first<<" "
+                     <<epicsAtomicGetSizeT(&it2->second->nupdates)<<" updates "
+                     <<epicsAtomicGetSizeT(&it2->second->nbytes)<<" bytes\n";
+        }
+
         FOREACH(ChannelCache::entries_t::const_iterator, it2, end2, entries)
         {
             const std::string& channame = it2->first;
@@ -208,7 +265,7 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
 
             ChannelCacheEntry& E = *it2->second;
             ChannelCacheEntry::mon_entries_t::lock_vector_type mons;
-            size_t nsrv, nmon;
+            size_t nsrv, nmon, nget, ngetcached, ngetupstream, nput, nputupstream;
             bool dropflag;
             const char *chstate;
             {
@@ -217,6 +274,11 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                 nsrv = E.interested.size();
                 nmon = E.mon_entries.size();
                 dropflag = E.dropPoke;
+                nget = epicsAtomicGetSizeT(&E.nget);
+                ngetcached = epicsAtomicGetSizeT(&E.ngetcached);
+                ngetupstream = epicsAtomicGetSizeT(&E.ngetupstream);
+                nput = epicsAtomicGetSizeT(&E.nput);
+                nputupstream = epicsAtomicGetSizeT(&E.nputupstream);
 
                 if(lvl>1)
                     mons = E.mon_entries.lock_vector();
@@ -224,9 +286,21 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
 
             std::cout<<chstate
                      <<" Client Channel '"<<channame
-                     <<"' used by "<<nsrv<<" Server channel(s) with "
+                     <<"' #"<<E.chanid<<" used by "<<nsrv<<" Server channel(s) with "
                      <<nmon<<" unique subscription(s) "
                      <<(dropflag?'!':'_')<<"\n";
+            if(nget)
+                std::cout<<"  "<<nget<<" gets, "<<ngetcached<<" from monitor cache, "
+                         <<ngetupstream<<" upstream\n";
+            if(nput)
+                std::cout<<"  "<<nput<<" coalescing puts, "<<nputupstream<<" upstream\n";
+            if(E.ngetarray)
+                std::cout<<"  "<<epicsAtomicGetSizeT(&E.ngetarray)<<" getArray, "
+                         <<epicsAtomicGetSizeT(&E.ngetarraycached)<<" from cache, "
+                         <<epicsAtomicGetSizeT(&E.ngetarrayupstream)<<" complete arrays upstream\n";
+            if(E.ngetfield)
+                std::cout<<"  "<<epicsAtomicGetSizeT(&E.ngetfield)<<" getField, "
+                         <<epicsAtomicGetSizeT(&E.ngetfieldcached)<<" from cache\n";
 
             if(lvl<=1)
                 continue;
@@ -263,7 +337,9 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                          <<"opened, Has "<<(hasdata?"":"not ")
                          <<"recv'd some data, Has "<<(isdone?"":"not ")<<"finalized\n"
                            "    "<<      epicsAtomicGetSizeT(&ME.nwakeups)<<" wakeups "
-                         <<epicsAtomicGetSizeT(&ME.nevents)<<" events\n";
+                         <<epicsAtomicGetSizeT(&ME.nevents)<<" events "
+                         <<epicsAtomicGetSizeT(&ME.nbytes)<<" bytes\n";
+                ME.latency.show(std::cout, "    ");
 #ifdef USE_MSTATS
                 if(mstats.nempty || mstats.nfilled || mstats.noutstanding)
                     std::cout<<"    US monitor queue "<<mstats.nfilled
@@ -302,7 +378,8 @@ void ServerConfig::status_client(int lvl, const char *client, const char *channe
                              <<" out "<<nused<<"/"<<total
                              <<" "<<epicsAtomicGetSizeT(&MU.nwakeups)<<" wakeups "
                              <<epicsAtomicGetSizeT(&MU.nevents)<<" events "
-                             <<epicsAtomicGetSizeT(&MU.ndropped)<<" drops\n";
+                             <<epicsAtomicGetSizeT(&MU.ndropped)<<" drops "
+                             <<epicsAtomicGetSizeT(&MU.nbytes)<<" bytes\n";
                 }
             }
 
@@ -6,6 +6,8 @@
 #include "chancache.h"
 #include "channel.h"
 
+struct GWStatus;
+
 struct GWServerChannelProvider :
         public epics::pvAccess::ChannelProvider,
         public epics::pvAccess::ChannelFind,
@@ -39,6 +41,8 @@ struct ServerConfig {
     int debug;
     bool interactive;
     epics::pvData::PVStructure::shared_pointer conf;
+    // path of the config file, as given
+    std::string conffile;
 
     typedef std::map<std::string, GWServerChannelProvider::shared_pointer> clients_t;
     clients_t clients;
@@ -46,9 +50,19 @@ struct ServerConfig {
     typedef std::map<std::string, epics::pvAccess::ServerContext::shared_pointer> servers_t;
     servers_t servers;
 
-    ServerConfig() :debug(1), interactive(true) {}
+    // status PVs of servers with a control_prefix
+    typedef std::vector<std::tr1::shared_ptr<GWStatus> > statuses_t;
+    statuses_t statuses;
+
+    // set by -w when started as one of several worker processes
+    int worker;
+    unsigned nworkers;
+
+    ServerConfig() :debug(1), interactive(true), worker(-1), nworkers(1u) {}
 
     void drop(const char *client, const char *channel);
+    //! start recording upstream monitor updates of 'client' to 'fname', or stop if 'fname' is empty
+    void record(const char *client, const char *fname);
     void status_server(int lvl, const char *server);
     void status_client(int lvl, const char *client, const char *channel);
 };
@@ -0,0 +1,416 @@
+
+#include <algorithm>
+
+#include <epicsAtomic.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+
+#include <pv/pvAccess.h>
+#include <pv/standardField.h>
+#include <pv/reftrack.h>
+#include <pv/logger.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "server.h"
+#include "status.h"
+
+namespace pva = epics::pvAccess;
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct column_t {
+    const char *name;
+    pvd::ScalarType type;
+};
+
+const column_t clientCols[] = {
+    {"client", pvd::pvString},
+    {"channels", pvd::pvULong},
+    {"subscriptions", pvd::pvULong},
+    {"cleanerRuns", pvd::pvULong},
+    {"cleanerDust", pvd::pvULong},
+    {"gets", pvd::pvULong},
+    {"getsCached", pvd::pvULong},
+    {"getsUpstream", pvd::pvULong},
+    {"eventRate", pvd::pvDouble},
+    {"dropRate", pvd::pvDouble},
+    {"upstreamByteRate", pvd::pvDouble},
+    {"downstreamByteRate", pvd::pvDouble},
+};
+
+const column_t eventCols[] = {
+    {"client", pvd::pvString},
+    {"channel", pvd::pvString},
+    {"eventRate", pvd::pvDouble},
+    {"events", pvd::pvULong},
+    {"byteRate", pvd::pvDouble},
+};
+
+const column_t peerCols[] = {
+    {"client", pvd::pvString},
+    {"address", pvd::pvString},
+    {"updateRate", pvd::pvDouble},
+    {"byteRate", pvd::pvDouble},
+    {"bytes", pvd::pvULong},
+};
+
+const column_t dropCols[] = {
+    {"client", pvd::pvString},
+    {"channel", pvd::pvString},
+    {"dropRate", pvd::pvDouble},
+    {"dropped", pvd::pvULong},
+};
+
+const column_t refCols[] = {
+    {"name", pvd::pvString},
+    {"count", pvd::pvULong},
+};
+
+#define NELEM(ARR) (sizeof(ARR)/sizeof(ARR[0]))
+
+// an empty NTTable
+pvd::PVStructurePtr makeTable(const column_t *cols, size_t ncols)
+{
+    pvd::FieldBuilderPtr B(pvd::getFieldCreate()->createFieldBuilder()
+                           ->setId("epics:nt/NTTable:1.0")
+                           ->addArray("labels", pvd::pvString)
+                           ->addNestedStructure("value"));
+    for(size_t i=0; i<ncols; i++)
+        B = B->addArray(cols[i].name, cols[i].type);
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(B->endNested()
+                                                                      ->add("timeStamp", pvd::getStandardField()->timeStamp())
+                                                                      ->createStructure()));
+
+    pvd::shared_vector<std::string> labels(ncols);
+    for(size_t i=0; i<ncols; i++)
+        labels[i] = cols[i].name;
+    ret->getSubFieldT<pvd::PVStringArray>("labels")->replace(pvd::freeze(labels));
+
+    return ret;
+}
+
+template<typename T>
+void setColumn(pvd::PVStructure& table, const char *name, const std::vector<T>& col)
+{
+    pvd::shared_vector<T> arr(col.size());
+    std::copy(col.begin(), col.end(), arr.begin());
+    table.getSubFieldT<pvd::PVScalarArray>(std::string("value.")+name)->putFrom<T>(pvd::freeze(arr));
+}
+
+void post(pvas::SharedPV& pv, pvd::PVStructure& table, const epicsTimeStamp& now)
+{
+    table.getSubFieldT<pvd::PVLong>("timeStamp.secondsPastEpoch")->put(now.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
+    table.getSubFieldT<pvd::PVInt>("timeStamp.nanoseconds")->put(now.nsec);
+
+    pvd::BitSet changed;
+    changed.set(0);
+    pv.post(table, changed);
+}
+
+struct chanstat_t {
+    std::string client, channel;
+    size_t nevents, ndropped;
+    double eventRate, dropRate, byteRate;
+};
+
+bool byEventRate(const chanstat_t& lhs, const chanstat_t& rhs) { return lhs.eventRate>rhs.eventRate; }
+bool byDropRate(const chanstat_t& lhs, const chanstat_t& rhs) { return lhs.dropRate>rhs.dropRate; }
+
+struct peerstat_t {
+    std::string client, address;
+    size_t nbytes;
+    double updateRate, byteRate;
+};
+
+bool byByteRate(const peerstat_t& lhs, const peerstat_t& rhs) { return lhs.byteRate>rhs.byteRate; }
+
+// rate of increase of a counter.  Counts may decrease when a subscription is closed
+double counterRate(size_t cur, size_t prev, double dT)
+{
+    return cur>prev ? (cur-prev)/dT : 0.0;
+}
+
+} // namespace
+
+GWStatus::GWStatus(const std::string& server, const std::string& prefix, const ServerConfig::clients_t& clients)
+    :prefix(prefix)
+    ,clients(clients)
+    ,period(1.0)
+    ,topN(20)
+    ,provider("gwstatus:"+server)
+    ,pv_clients(pvas::SharedPV::buildReadOnly())
+    ,pv_topevent(pvas::SharedPV::buildReadOnly())
+    ,pv_topdrop(pvas::SharedPV::buildReadOnly())
+    ,pv_peers(pvas::SharedPV::buildReadOnly())
+    ,pv_refs(pvas::SharedPV::buildReadOnly())
+    ,timerQueue(&epicsTimerQueueActive::allocate(1, epicsThreadPriorityCAServerLow-2))
+{
+    epicsTimeGetCurrent(&lastupdate);
+
+    pv_clients->open(*makeTable(clientCols, NELEM(clientCols)));
+    pv_topevent->open(*makeTable(eventCols, NELEM(eventCols)));
+    pv_topdrop->open(*makeTable(dropCols, NELEM(dropCols)));
+    pv_peers->open(*makeTable(peerCols, NELEM(peerCols)));
+    pv_refs->open(*makeTable(refCols, NELEM(refCols)));
+
+    provider.add(prefix+"clients", pv_clients);
+    provider.add(prefix+"topEventRate", pv_topevent);
+    provider.add(prefix+"topDropRate", pv_topdrop);
+    provider.add(prefix+"peers", pv_peers);
+    provider.add(prefix+"refs", pv_refs);
+
+    timer = &timerQueue->createTimer();
+    timer->start(*this, period);
+}
+
+GWStatus::~GWStatus()
+{
+    timer->destroy(); // waits for expire() to complete
+    timerQueue->release();
+}
+
+epicsTimerNotify::expireStatus
+GWStatus::expire(const epicsTime &currentTime)
+{
+    try {
+        update();
+    } catch(std::exception& e) {
+        LOG(pva::logLevelError, "Error updating status PVs '%s' : %s", prefix.c_str(), e.what());
+    }
+    return epicsTimerNotify::expireStatus(epicsTimerNotify::restart, period);
+}
+
+void
+GWStatus::update()
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    double dT = epicsTimeDiffInSeconds(&now, &lastupdate);
+    lastupdate = now;
+    if(dT<=0.0)
+        dT = period;
+
+    std::vector<std::string> cl_name;
+    std::vector<pvd::uint64> cl_chans, cl_subs, cl_runs, cl_dust, cl_get, cl_getcached, cl_getupstream;
+    std::vector<double> cl_erate, cl_drate, cl_usrate, cl_dsrate;
+
+    std::vector<chanstat_t> chans;
+    std::vector<peerstat_t> peerstats;
+    prevs_t nextprevs, nextpeers;
+
+    FOREACH(ServerConfig::clients_t::const_iterator, it, end, clients)
+    {
+        ChannelCache& cache = it->second->cache;
+
+        ChannelCache::entries_t entries;
+        ChannelCache::peers_t peers;
+        {
+            Guard G(cache.cacheLock);
+            entries = cache.entries; // copy of std::map
+            peers = cache.peers;
+            cl_runs.push_back(cache.cleanerRuns);
+            cl_dust.push_back(cache.cleanerDust);
+        }
+        cl_name.push_back(it->first);
+        cl_chans.push_back(entries.size());
+        cl_get.push_back(epicsAtomicGetSizeT(&cache.nget));
+        cl_getcached.push_back(epicsAtomicGetSizeT(&cache.ngetcached));
+        cl_getupstream.push_back(epicsAtomicGetSizeT(&cache.ngetupstream));
+
+        size_t nsubs = 0;
+        double erate = 0.0, drate = 0.0, usrate = 0.0, dsrate = 0.0;
+
+        FOREACH(ChannelCache::peers_t::const_iterator, it2, end2, peers)
+        {
+            const prevs_t::key_type key(it->first, it2->first);
+            prev_t cur = {0u, 0u, 0u};
+            cur.nevents = epicsAtomicGetSizeT(&it2->second->nupdates);
+            cur.nbytes = epicsAtomicGetSizeT(&it2->second->nbytes);
+
+            peerstat_t S;
+            S.client = it->first;
+            S.address = it2->first;
+            S.nbytes = cur.nbytes;
+            S.updateRate = S.byteRate = 0.0;
+
+            prevs_t::const_iterator P(prevpeers.find(key));
+            if(P!=prevpeers.end()) {
+                S.updateRate = counterRate(cur.nevents, P->second.nevents, dT);
+                S.byteRate = counterRate(cur.nbytes, P->second.nbytes, dT);
+            }
+            nextpeers[key] = cur;
+
+            dsrate += S.byteRate;
+            peerstats.push_back(S);
+        }
+
+        FOREACH(ChannelCache::entries_t::const_iterator, it2, end2, entries)
+        {
+            ChannelCacheEntry& E = *it2->second;
+
+            ChannelCacheEntry::mon_entries_t::lock_vector_type mons;
+            {
+                Guard G(E.mutex());
+                mons = E.mon_entries.lock_vector();
+            }
+            nsubs += mons.size();
+
+            prev_t cur = {0u, 0u, 0u};
+
+            FOREACH(ChannelCacheEntry::mon_entries_t::lock_vector_type::const_iterator, it3, end3, mons)
+            {
+                MonitorCacheEntry& ME = *it3->second;
+
+                MonitorCacheEntry::interested_t::vector_type usrs;
+                {
+                    Guard G(ME.mutex());
+                    usrs = ME.interested.lock_vector();
+                }
+
+                cur.nevents += epicsAtomicGetSizeT(&ME.nevents);
+                cur.nbytes += epicsAtomicGetSizeT(&ME.nbytes);
+                FOREACH(MonitorCacheEntry::interested_t::vector_type::const_iterator, it4, end4, usrs)
+                    cur.ndropped += epicsAtomicGetSizeT(&(*it4)->ndropped);
+            }
+
+            const prevs_t::key_type key(it->first, it2->first);
+
+            chanstat_t S;
+            S.client = it->first;
+            S.channel = it2->first;
+            S.nevents = cur.nevents;
+            S.ndropped = cur.ndropped;
+            S.eventRate = S.dropRate = S.byteRate = 0.0;
+
+            prevs_t::const_iterator P(prevs.find(key));
+            if(P!=prevs.end()) {
+                S.eventRate = counterRate(cur.nevents, P->second.nevents, dT);
+                S.dropRate = counterRate(cur.ndropped, P->second.ndropped, dT);
+                S.byteRate = counterRate(cur.nbytes, P->second.nbytes, dT);
+            }
+            nextprevs[key] = cur;
+
+            erate += S.eventRate;
+            drate += S.dropRate;
+            usrate += S.byteRate;
+            if(S.eventRate>0.0 || S.dropRate>0.0)
+                chans.push_back(S);
+        }
+
+        cl_subs.push_back(nsubs);
+        cl_erate.push_back(erate);
+        cl_drate.push_back(drate);
+        cl_usrate.push_back(usrate);
+        cl_dsrate.push_back(dsrate);
+    }
+
+    prevs.swap(nextprevs);
+    prevpeers.swap(nextpeers);
+
+    {
+        pvd::PVStructurePtr table(makeTable(clientCols, NELEM(clientCols)));
+        setColumn(*table, "client", cl_name);
+        setColumn(*table, "channels", cl_chans);
+        setColumn(*table, "subscriptions", cl_subs);
+        setColumn(*table, "cleanerRuns", cl_runs);
+        setColumn(*table, "cleanerDust", cl_dust);
+        setColumn(*table, "gets", cl_get);
+        setColumn(*table, "getsCached", cl_getcached);
+        setColumn(*table, "getsUpstream", cl_getupstream);
+        setColumn(*table, "eventRate", cl_erate);
+        setColumn(*table, "dropRate", cl_drate);
+        setColumn(*table, "upstreamByteRate", cl_usrate);
+        setColumn(*table, "downstreamByteRate", cl_dsrate);
+        post(*pv_clients, *table, now);
+    }
+
+    {
+        size_t N = std::min(topN, chans.size());
+        std::partial_sort(chans.begin(), chans.begin()+N, chans.end(), byEventRate);
+
+        std::vector<std::string> client, channel;
+        std::vector<double> rate, brate;
+        std::vector<pvd::uint64> count;
+        for(size_t i=0; i<N && chans[i].eventRate>0.0; i++) {
+            client.push_back(chans[i].client);
+            channel.push_back(chans[i].channel);
+            rate.push_back(chans[i].eventRate);
+            count.push_back(chans[i].nevents);
+            brate.push_back(chans[i].byteRate);
+        }
+
+        pvd::PVStructurePtr table(makeTable(eventCols, NELEM(eventCols)));
+        setColumn(*table, "client", client);
+        setColumn(*table, "channel", channel);
+        setColumn(*table, "eventRate", rate);
+        setColumn(*table, "events", count);
+        setColumn(*table, "byteRate", brate);
+        post(*pv_topevent, *table, now);
+    }
+
+    {
+        size_t N = std::min(topN, chans.size());
+        std::partial_sort(chans.begin(), chans.begin()+N, chans.end(), byDropRate);
+
+        std::vector<std::string> client, channel;
+        std::vector<double> rate;
+        std::vector<pvd::uint64> count;
+        for(size_t i=0; i<N && chans[i].dropRate>0.0; i++) {
+            client.push_back(chans[i].client);
+            channel.push_back(chans[i].channel);
+            rate.push_back(chans[i].dropRate);
+            count.push_back(chans[i].ndropped);
+        }
+
+        pvd::PVStructurePtr table(makeTable(dropCols, NELEM(dropCols)));
+        setColumn(*table, "client", client);
+        setColumn(*table, "channel", channel);
+        setColumn(*table, "dropRate", rate);
+        setColumn(*table, "dropped", count);
+        post(*pv_topdrop, *table, now);
+    }
+
+    {
+        std::sort(peerstats.begin(), peerstats.end(), byByteRate);
+
+        std::vector<std::string> client, address;
+        std::vector<double> urate, brate;
+        std::vector<pvd::uint64> count;
+        for(size_t i=0; i<peerstats.size(); i++) {
+            client.push_back(peerstats[i].client);
+            address.push_back(peerstats[i].address);
+            urate.push_back(peerstats[i].updateRate);
+            brate.push_back(peerstats[i].byteRate);
+            count.push_back(peerstats[i].nbytes);
+        }
+
+        pvd::PVStructurePtr table(makeTable(peerCols, NELEM(peerCols)));
+        setColumn(*table, "client", client);
+        setColumn(*table, "address", address);
+        setColumn(*table, "updateRate", urate);
+        setColumn(*table, "byteRate", brate);
+        setColumn(*table, "bytes", count);
+        post(*pv_peers, *table, now);
+    }
+
+    {
+        epics::RefSnapshot snap;
+        snap.update();
+
+        std::vector<std::string> name;
+        std::vector<pvd::uint64> count;
+        FOREACH(epics::RefSnapshot::const_iterator, it, end, snap) {
+            name.push_back(it->first);
+            count.push_back(it->second.current);
+        }
+
+        pvd::PVStructurePtr table(makeTable(refCols, NELEM(refCols)));
+        setColumn(*table, "name", name);
+        setColumn(*table, "count", count);
+        post(*pv_refs, *table, now);
+    }
+}
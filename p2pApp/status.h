@@ -0,0 +1,59 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <string>
+#include <map>
+
+#include <epicsTimer.h>
+#include <epicsTime.h>
+
+#include <pv/pvAccess.h>
+#include <pv/pvas.h>
+#include <pv/sharedstate.h>
+
+#include "server.h"
+
+/** PVs under a server's control_prefix publishing the counters of the
+ *  clients (ChannelCaches) which it serves.  Updated periodically.
+ *
+ *  - <prefix>clients       NTTable of per-client totals
+ *  - <prefix>topEventRate  NTTable of the channels with the highest upstream event rate
+ *  - <prefix>topDropRate   NTTable of the channels with the most events dropped downstream
+ *  - <prefix>peers         NTTable of downstream clients by monitor bandwidth
+ *  - <prefix>refs          NTTable of instance counts (as "refshow")
+ */
+struct GWStatus : public epicsTimerNotify
+{
+    POINTER_DEFINITIONS(GWStatus);
+
+    const std::string prefix;
+    const ServerConfig::clients_t clients; // served by our server
+    const double period; // seconds between updates
+    const size_t topN;   // max. rows of topEventRate and topDropRate
+
+    pvas::StaticProvider provider;
+    const pvas::SharedPV::shared_pointer pv_clients, pv_topevent, pv_topdrop, pv_peers, pv_refs;
+
+    // only accessed from timer callback
+    struct prev_t {
+        size_t nevents, ndropped, nbytes;
+    };
+    typedef std::map<std::pair<std::string, std::string>, prev_t> prevs_t;
+    prevs_t prevs; // counts at last update by client and channel name
+    prevs_t prevpeers; // counts at last update by client and downstream address
+    epicsTimeStamp lastupdate;
+
+    GWStatus(const std::string& server, const std::string& prefix, const ServerConfig::clients_t& clients);
+    virtual ~GWStatus();
+
+    //! recompute and post all PVs
+    void update();
+
+    virtual epicsTimerNotify::expireStatus expire(const epicsTime &currentTime);
+
+private:
+    epicsTimerQueueActive *timerQueue;
+    epicsTimer *timer;
+};
+
+#endif // STATUS_H
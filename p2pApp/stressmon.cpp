@@ -0,0 +1,295 @@
+/* Many threads subscribing through the gateway while upstream posts bursts of updates.
+ *
+ * Consumers repeatedly subscribe, consume some updates (quickly or slowly), and unsubscribe.
+ * Checks that each subscription sees increasing values, that any gap is
+ * marked in the overrun mask, and that all final subscriptions see the last value.
+ */
+
+#include <stdio.h>
+
+#include <epicsAtomic.h>
+#include <epicsGuard.h>
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include <pv/epicsException.h>
+#include <pv/monitor.h>
+
+#include "server.h"
+
+#include "utilities.h"
+
+namespace pvd = epics::pvData;
+namespace pva = epics::pvAccess;
+
+namespace {
+
+const size_t nchannels = 4;
+const size_t nconsumers = 8; // half fast, half slow
+const double runtime = 2.0;  // seconds of upstream updates
+
+pvd::PVStructurePtr makeRequest(size_t bsize)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("queueSize", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.queueSize")->putFrom<pvd::int32>(bsize);
+
+    return ret;
+}
+
+// per thread pseudo-random numbers
+struct Random {
+    epicsUInt32 state;
+    explicit Random(epicsUInt32 seed) :state(seed ? seed : 1u) {}
+    epicsUInt32 operator()(epicsUInt32 n)
+    {
+        state = state*1103515245u + 12345u;
+        return (state>>8)%n;
+    }
+};
+
+struct Waker : public pvd::MonitorRequester
+{
+    POINTER_DEFINITIONS(Waker);
+    DUMBREQUESTER(Waker)
+
+    epicsEvent wake;
+
+    virtual ~Waker() {}
+    virtual void monitorConnect(pvd::Status const & status,
+                                pvd::MonitorPtr const & monitor,
+                                pvd::StructureConstPtr const & structure) {}
+    virtual void monitorEvent(pvd::MonitorPtr const & monitor) { wake.signal(); }
+    virtual void unlisten(pvd::MonitorPtr const & monitor) { wake.signal(); }
+};
+
+struct Stress;
+
+struct Consumer : public epicsThreadRunable
+{
+    Stress& stress;
+    const bool slow;
+    Random rand;
+    epicsThread thread;
+
+    // results
+    size_t nsubscriptions, nupdates;
+    size_t nbackwards; // value not increasing
+    size_t nunmarked;  // gap without overrun
+    bool gotfinal;
+
+    Consumer(Stress& stress, size_t idx);
+    virtual ~Consumer() {}
+    virtual void run();
+
+    // consume until 'limit' updates, or until final value seen.  returns true if final value seen
+    bool consume(pvd::Monitor& mon, Waker& waker, epicsInt32& prev, size_t limit);
+};
+
+struct Stress : public epicsThreadRunable
+{
+    TestProvider::shared_pointer upstream;
+    std::vector<TestPV::shared_pointer> pvs;
+    GWServerChannelProvider::shared_pointer gateway;
+
+    epicsThread producer;
+    int done;            // set when producer has posted the final value
+    epicsInt32 lastValue; // last value posted
+    size_t nposted;
+
+    Stress()
+        :upstream(new TestProvider())
+        ,producer(*this, "producer", epicsThreadGetStackSize(epicsThreadStackSmall))
+        ,done(0)
+        ,lastValue(0)
+        ,nposted(0u)
+    {
+        pvd::StructureConstPtr type(pvd::getFieldCreate()->createFieldBuilder()
+                                    ->add("seq", pvd::pvInt)
+                                    ->add("value", pvd::pvDouble)
+                                    ->createStructure());
+        for(size_t i=0; i<nchannels; i++) {
+            char name[16];
+            sprintf(name, "stress%u", (unsigned)i);
+            pvs.push_back(upstream->addPV(name, type));
+        }
+        gateway.reset(new GWServerChannelProvider(upstream));
+    }
+
+    // all channels are posted together with the same 'seq'
+    virtual void run()
+    {
+        Random rand(42u);
+        const epicsUInt64 end = epicsMonotonicGet() + epicsUInt64(runtime*1e9);
+        epicsInt32 seq = 0;
+
+        while(epicsMonotonicGet()<end) {
+            // burst of 1 to 50 updates, then a pause
+            for(size_t n = 1u+rand(50u); n; n--) {
+                seq++;
+                for(size_t i=0; i<pvs.size(); i++) {
+                    pvs[i]->value->getSubFieldT<pvd::PVInt>("seq")->put(seq);
+                    pvs[i]->value->getSubFieldT<pvd::PVDouble>("value")->put(seq*0.5);
+                    pvs[i]->post();
+                }
+                nposted += pvs.size();
+            }
+            epicsThreadSleep(0.001);
+        }
+
+        lastValue = seq;
+        epicsAtomicSetIntT(&done, 1);
+    }
+};
+
+Consumer::Consumer(Stress& stress, size_t idx)
+    :stress(stress)
+    ,slow(idx&1u)
+    ,rand(idx+1u)
+    ,thread(*this, "consumer", epicsThreadGetStackSize(epicsThreadStackSmall))
+    ,nsubscriptions(0u)
+    ,nupdates(0u)
+    ,nbackwards(0u)
+    ,nunmarked(0u)
+    ,gotfinal(false)
+{}
+
+bool Consumer::consume(pvd::Monitor& mon, Waker& waker, epicsInt32& prev, size_t limit)
+{
+    for(size_t n=0; n<limit; ) {
+        bool finished = epicsAtomicGetIntT(&stress.done);
+
+        pva::MonitorElementPtr elem(mon.poll());
+        if(!elem) {
+            if(finished && prev==stress.lastValue)
+                return true;
+            if(!waker.wake.wait(finished ? 5.0 : 0.1) && finished)
+                return prev==stress.lastValue; // timeout
+            continue;
+        }
+
+        pvd::PVIntPtr seq(elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("seq"));
+        epicsInt32 cur = seq->get();
+
+        if(prev>=0) {
+            if(cur<=prev)
+                nbackwards++;
+            else if(cur>prev+1 && !elem->overrunBitSet->get(0) && !elem->overrunBitSet->get(seq->getFieldOffset()))
+                nunmarked++;
+        }
+        prev = cur;
+        nupdates++;
+        n++;
+
+        if(slow)
+            epicsThreadSleep(0.001);
+        mon.release(elem);
+    }
+    return false;
+}
+
+void Consumer::run()
+{
+    while(true) {
+        const TestPV::shared_pointer& pv = stress.pvs[rand(stress.pvs.size())];
+
+        TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+        pva::Channel::shared_pointer chan(stress.gateway->createChannel(pv->name, creq));
+        if(!chan) {
+            epicsThreadSleep(0.01); // not yet connected?
+            continue;
+        }
+
+        Waker::shared_pointer waker(new Waker);
+        pvd::Monitor::shared_pointer mon(chan->createMonitor(waker, makeRequest(2u+rand(3u))));
+        if(!mon || !mon->start().isSuccess()) {
+            chan->destroy();
+            continue;
+        }
+        nsubscriptions++;
+
+        epicsInt32 prev = -1;
+        // once upstream is done, a subscription is kept until the final value is seen, or timeout
+        const bool wasdone = epicsAtomicGetIntT(&stress.done);
+        bool last = consume(*mon, *waker, prev, wasdone ? size_t(-1) : 10u+rand(200u));
+
+        mon->destroy();
+        chan->destroy();
+
+        if(last || wasdone) {
+            gotfinal = last;
+            break;
+        }
+    }
+}
+
+} // namespace
+
+MAIN(stressmon)
+{
+    testPlan(5);
+    {
+        Stress stress;
+        std::vector<Consumer*> consumers;
+        for(size_t i=0; i<nconsumers; i++)
+            consumers.push_back(new Consumer(stress, i));
+
+        const epicsUInt64 start = epicsMonotonicGet();
+        stress.producer.start();
+        for(size_t i=0; i<consumers.size(); i++)
+            consumers[i]->thread.start();
+
+        stress.producer.exitWait();
+        for(size_t i=0; i<consumers.size(); i++)
+            consumers[i]->thread.exitWait();
+        const double elapsed = (epicsMonotonicGet()-start)*1e-9;
+
+        size_t nsubs = 0u, nupdates = 0u, nbackwards = 0u, nunmarked = 0u, nfinal = 0u;
+        for(size_t i=0; i<consumers.size(); i++) {
+            const Consumer& C = *consumers[i];
+            testDiag("Consumer %u (%s) %u subscriptions, %u updates, final value %s",
+                     (unsigned)i, C.slow ? "slow" : "fast",
+                     (unsigned)C.nsubscriptions, (unsigned)C.nupdates,
+                     C.gotfinal ? "seen" : "missing");
+            nsubs += C.nsubscriptions;
+            nupdates += C.nupdates;
+            nbackwards += C.nbackwards;
+            nunmarked += C.nunmarked;
+            nfinal += C.gotfinal;
+            delete consumers[i];
+        }
+
+        testDiag("Posted %u updates, %u subscriptions delivered %u updates in %.2f sec. (%.0f updates/sec.)",
+                 (unsigned)stress.nposted, (unsigned)nsubs, (unsigned)nupdates,
+                 elapsed, nupdates/elapsed);
+
+        testOk(nbackwards==0u, "values increase (%u not)", (unsigned)nbackwards);
+        testOk(nunmarked==0u, "gaps marked as overrun (%u not)", (unsigned)nunmarked);
+        testOk(nfinal==nconsumers, "%u of %u final subscriptions see last value %d",
+               (unsigned)nfinal, (unsigned)nconsumers, (int)stress.lastValue);
+
+        stress.gateway->destroy();
+    }
+    TestProvider::testCounts();
+    int ok = 1;
+    size_t temp;
+#define TESTC(name) temp=epicsAtomicGetSizeT(&name::num_instances); ok &= temp==0; testDiag("num. live "  #name " %u", (unsigned)temp)
+    TESTC(GWChannel);
+    TESTC(ChannelCacheEntry::CRequester);
+    TESTC(ChannelCacheEntry);
+    TESTC(MonitorCacheEntry);
+    TESTC(MonitorUser);
+#undef TESTC
+    testOk(ok, "All instances free'd");
+    return testDone();
+}
@@ -1,6 +1,10 @@
 
+#include <stdio.h>
+#include <algorithm>
+
 #include <epicsAtomic.h>
 #include <epicsGuard.h>
+#include <epicsThread.h>
 #include <epicsUnitTest.h>
 #include <testMain.h>
 
@@ -8,8 +12,10 @@
 #include <pv/monitor.h>
 #include <pv/thread.h>
 #include <pv/serverContext.h>
+#include <pv/createRequest.h>
 
 #include "server.h"
+#include "trace.h"
 
 #include "utilities.h"
 
@@ -36,6 +42,38 @@ pvd::PVStructurePtr makeRequest(size_t bsize)
     return ret;
 }
 
+pvd::PVStructurePtr makeProcessRequest()
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("process", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.process")->putFrom<std::string>("true");
+
+    return ret;
+}
+
+pvd::PVStructurePtr makeGetRequest(bool cache)
+{
+    pvd::StructureConstPtr dtype(pvd::getFieldCreate()->createFieldBuilder()
+                                 ->addNestedStructure("record")
+                                    ->addNestedStructure("_options")
+                                        ->add("cache", pvd::pvString)
+                                    ->endNested()
+                                 ->endNested()
+                                 ->createStructure());
+
+    pvd::PVStructurePtr ret(pvd::getPVDataCreate()->createPVStructure(dtype));
+    ret->getSubFieldT<pvd::PVScalar>("record._options.cache")->putFrom<std::string>(cache ? "true" : "false");
+
+    return ret;
+}
+
 struct TestMonitor {
     TestProvider::shared_pointer upstream;
     TestPV::shared_pointer test1;
@@ -338,18 +376,675 @@ struct TestMonitor {
 
         mon->destroy();
     }
+
+    void test_get_cached()
+    {
+        testDiag("Check that ChannelGet is answered from an active subscription");
+
+        TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+        pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, makeRequest(2)));
+        if(!mon) testAbort("Failed to create monitor");
+
+        testOk1(mon->start().isSuccess());
+        upstream->dispatch(); // trigger monitorEvent() from upstream to gateway
+
+        pva::MonitorElementPtr elem(mon->poll());
+        testOk1(!!elem.get());
+        if(elem) mon->release(elem);
+
+        TestChannelGetRequester::shared_pointer greq(new TestChannelGetRequester);
+        pva::ChannelGet::shared_pointer get(client->createChannelGet(greq, makeGetRequest(true)));
+
+        testOk1(greq->connected);
+        testOk1(greq->statusConnect.isSuccess());
+        testOk1(!greq->done);
+
+        if(get) get->get();
+        testOk1(greq->done);
+        testOk1(greq->statusDone.isSuccess());
+        testOk1(greq->value && greq->value->getSubFieldT<pvd::PVInt>("x")->get()==1);
+
+        testDiag("update while subscribed");
+        test1_x = 5;
+        pvd::BitSet changed;
+        changed.set(1);
+        test1->post(changed);
+
+        greq->done = false;
+        if(get) get->get();
+        testOk1(greq->done);
+        testOk1(greq->value && greq->value->getSubFieldT<pvd::PVInt>("x")->get()==5);
+        testEqual(epicsAtomicGetSizeT(&gateway->cache.entries["test1"]->ngetcached), 2u);
+
+        elem = mon->poll();
+        if(elem) mon->release(elem);
+
+        testDiag("process=true goes upstream");
+        TestChannelGetRequester::shared_pointer greq3(new TestChannelGetRequester);
+        pva::ChannelGet::shared_pointer get3(client->createChannelGet(greq3, makeProcessRequest()));
+        testOk1(greq3->connected);
+        testOk1(greq3->statusConnect.isSuccess());
+        if(get3) get3->get();
+        testOk1(greq3->done);
+        testEqual(test1->ngets, 1u);
+        testEqual(epicsAtomicGetSizeT(&gateway->cache.entries["test1"]->ngetcached), 2u);
+        if(get3) get3->destroy();
+
+        testDiag("opt-out goes upstream");
+        TestChannelGetRequester::shared_pointer greq2(new TestChannelGetRequester);
+        pva::ChannelGet::shared_pointer get2(client->createChannelGet(greq2, makeGetRequest(false)));
+        testOk1(greq2->connected);
+        testOk1(greq2->statusConnect.isSuccess());
+        if(get2) get2->get();
+        testOk1(greq2->done);
+        testOk1(greq2->value && greq2->value->getSubFieldT<pvd::PVInt>("x")->get()==5);
+        testEqual(test1->ngets, 2u);
+        testEqual(epicsAtomicGetSizeT(&gateway->cache.entries["test1"]->ngetcached), 2u);
+        if(get2) get2->destroy();
+
+        if(get) get->destroy();
+        mon->destroy();
+    }
+
+    void test_get_coalesce()
+    {
+        testDiag("Check that concurrent ChannelGet share one upstream get()");
+
+        test1->defer = true;
+
+        TestChannelGetRequester::shared_pointer greq1(new TestChannelGetRequester),
+                                                greq2(new TestChannelGetRequester);
+        pva::ChannelGet::shared_pointer get1(client->createChannelGet(greq1, makeGetRequest(true))),
+                                        get2(client->createChannelGet(greq2, makeGetRequest(true)));
+        testOk1(greq1->connected && greq1->statusConnect.isSuccess());
+        testOk1(greq2->connected && greq2->statusConnect.isSuccess());
+
+        if(get1) get1->get();
+        if(get2) get2->get();
+        testOk1(!greq1->done && !greq2->done);
+        testEqual(test1->ngets, 1u);
+
+        test1->complete();
+        testOk1(greq1->done && greq1->statusDone.isSuccess());
+        testOk1(greq2->done && greq2->statusDone.isSuccess());
+        testOk1(greq2->value && greq2->value->getSubFieldT<pvd::PVInt>("x")->get()==1);
+
+        {
+            ChannelCacheEntry::shared_pointer E(gateway->cache.entries["test1"]);
+            const size_t nget = epicsAtomicGetSizeT(&E->nget),
+                         ncached = epicsAtomicGetSizeT(&E->ngetcached),
+                         nupstream = epicsAtomicGetSizeT(&E->ngetupstream);
+            testEqual(nget, 2u);
+            testEqual(ncached, 0u);
+            testEqual(nupstream, 1u);
+            // as reported by gwstats
+            testOk(nupstream && double(nget-ncached)/nupstream==2.0, "coalesce ratio 2");
+        }
+
+        testDiag("process=true isn't coalesced");
+        TestChannelGetRequester::shared_pointer preq1(new TestChannelGetRequester),
+                                                preq2(new TestChannelGetRequester);
+        pva::ChannelGet::shared_pointer pget1(client->createChannelGet(preq1, makeProcessRequest())),
+                                        pget2(client->createChannelGet(preq2, makeProcessRequest()));
+
+        if(pget1) pget1->get();
+        if(pget2) pget2->get();
+        testEqual(test1->ngets, 3u);
+
+        test1->complete();
+        testOk1(preq1->done && preq1->statusDone.isSuccess());
+        testOk1(preq2->done && preq2->statusDone.isSuccess());
+        testEqual(epicsAtomicGetSizeT(&gateway->cache.entries["test1"]->ngetupstream), 3u);
+
+        if(get1) get1->destroy();
+        if(get2) get2->destroy();
+        if(pget1) pget1->destroy();
+        if(pget2) pget2->destroy();
+    }
+
+    void test_put_coalesce()
+    {
+        testDiag("Check that ChannelPut is merged while an upstream put() is in flight");
+
+        gateway->cache.coalescePut.push_back("test1");
+        test1->defer = true;
+
+        TestChannelPutRequester::shared_pointer preq1(new TestChannelPutRequester),
+                                                preq2(new TestChannelPutRequester),
+                                                preq3(new TestChannelPutRequester);
+        pva::ChannelPut::shared_pointer put1(client->createChannelPut(preq1, pvd::createRequest("field()"))),
+                                        put2(client->createChannelPut(preq2, pvd::createRequest("field()"))),
+                                        put3(client->createChannelPut(preq3, pvd::createRequest("field()")));
+        testOk1(preq1->connected && preq1->statusConnect.isSuccess());
+        testOk1(preq2->connected && preq2->statusConnect.isSuccess());
+        testOk1(preq3->connected && preq3->statusConnect.isSuccess());
+        if(!put1 || !put2 || !put3 || !preq1->fielddesc)
+            testAbort("Failed to create put");
+
+        pvd::PVStructurePtr val1(pvd::getPVDataCreate()->createPVStructure(preq1->fielddesc)),
+                            val2(pvd::getPVDataCreate()->createPVStructure(preq1->fielddesc)),
+                            val3(pvd::getPVDataCreate()->createPVStructure(preq1->fielddesc));
+        pvd::BitSet::shared_pointer chg1(new pvd::BitSet), chg2(new pvd::BitSet), chg3(new pvd::BitSet);
+        const size_t xoff = val1->getSubFieldT("x")->getFieldOffset(),
+                     yoff = val1->getSubFieldT("y")->getFieldOffset();
+
+        val1->getSubFieldT<pvd::PVInt>("x")->put(10);
+        chg1->set(xoff);
+        val2->getSubFieldT<pvd::PVInt>("x")->put(20);
+        val2->getSubFieldT<pvd::PVInt>("y")->put(21);
+        chg2->set(xoff).set(yoff);
+        val3->getSubFieldT<pvd::PVInt>("x")->put(30);
+        chg3->set(xoff);
+
+        put1->put(val1, chg1);
+        put2->put(val2, chg2);
+        put3->put(val3, chg3);
+        testEqual(test1->nputs, 1u);
+        testOk1(!preq1->donePut);
+
+        test1->complete();
+        testOk1(preq1->donePut && preq1->statusPut.isSuccess());
+        testOk1(!preq2->donePut && !preq3->donePut);
+        testEqual(test1->nputs, 2u); // merged
+
+        test1->complete();
+        testOk1(preq2->donePut && preq2->statusPut.isSuccess());
+        testOk1(preq3->donePut && preq3->statusPut.isSuccess());
+        testEqual(pvd::int32(test1_x), 30); // last writer wins
+        testEqual(pvd::int32(test1_y), 21);
+        {
+            ChannelCacheEntry::shared_pointer E(gateway->cache.entries["test1"]);
+            testEqual(epicsAtomicGetSizeT(&E->nput), 3u);
+            testEqual(epicsAtomicGetSizeT(&E->nputupstream), 2u);
+        }
+
+        testDiag("queued put and get take turns");
+        preq1->donePut = preq3->donePut = false;
+
+        val1->getSubFieldT<pvd::PVInt>("x")->put(40);
+        put1->put(val1, chg1);
+        put2->get();
+        val3->getSubFieldT<pvd::PVInt>("x")->put(50);
+        put3->put(val3, chg3);
+        testEqual(test1->nputs, 3u);
+        testEqual(test1->ngets, 0u);
+
+        test1->complete();
+        testOk1(preq1->donePut);
+        testEqual(test1->nputs, 3u);
+        testEqual(test1->ngets, 1u); // get() before the queued put()
+
+        test1->complete();
+        testOk1(preq2->doneGet && preq2->statusGet.isSuccess());
+        testOk1(preq2->value && preq2->value->getSubFieldT<pvd::PVInt>("x")->get()==40);
+        testEqual(test1->nputs, 4u);
+
+        test1->complete();
+        testOk1(preq3->donePut && preq3->statusPut.isSuccess());
+        testEqual(pvd::int32(test1_x), 50);
+
+        testDiag("upstream destroyed fails in flight and queued requests");
+        preq1->donePut = preq2->doneGet = preq3->donePut = false;
+
+        put1->put(val1, chg1);
+        put2->get();
+        put3->put(val3, chg3);
+
+        {
+            PutCacheEntry::shared_pointer pent;
+            {
+                ChannelCacheEntry::shared_pointer E(gateway->cache.entries["test1"]);
+                ChannelCacheEntry::put_entries_t::lock_vector_type ents(E->put_entries.lock_vector());
+                testEqual(ents.size(), 1u);
+                if(!ents.empty())
+                    pent = ents.front().second;
+            }
+            pva::ChannelPutRequester::shared_pointer ureq;
+            if(pent) {
+                Guard G(pent->mutex);
+                TestPVPut::shared_pointer U(std::tr1::dynamic_pointer_cast<TestPVPut>(pent->upstream));
+                if(U)
+                    ureq = U->requester.lock();
+            }
+            if(ureq)
+                ureq->channelDisconnect(true);
+            else
+                testFail("No upstream ChannelPutRequester");
+        }
+
+        testOk1(preq1->donePut && !preq1->statusPut.isSuccess());
+        testOk1(preq2->doneGet && !preq2->statusGet.isSuccess());
+        testOk1(preq3->donePut && !preq3->statusPut.isSuccess());
+
+        // late completion of the lost upstream put() is ignored
+        preq1->donePut = false;
+        test1->complete();
+        testOk1(!preq1->donePut);
+
+        put1->destroy();
+        put2->destroy();
+        put3->destroy();
+    }
+
+    void test_put_limited()
+    {
+        testDiag("Check that a put over the rate limit is rejected with an error");
+
+        gateway->cache.limits.push_back(RateLimit::shared_pointer(new RateLimit("test1", 1e-3, 1.0)));
+
+        TestChannelPutRequester::shared_pointer preq(new TestChannelPutRequester);
+        pva::ChannelPut::shared_pointer put(client->createChannelPut(preq, pvd::createRequest("field()")));
+        testOk1(preq->connected && preq->statusConnect.isSuccess());
+        if(!put || !preq->fielddesc)
+            testAbort("Failed to create put");
+        testOk1(!!std::tr1::dynamic_pointer_cast<LimitedPut>(put));
+
+        pvd::PVStructurePtr val(pvd::getPVDataCreate()->createPVStructure(preq->fielddesc));
+        pvd::BitSet::shared_pointer chg(new pvd::BitSet);
+        chg->set(val->getSubFieldT("x")->getFieldOffset());
+
+        val->getSubFieldT<pvd::PVInt>("x")->put(7);
+        put->put(val, chg);
+        testOk1(preq->donePut && preq->statusPut.isSuccess());
+        testEqual(test1->nputs, 1u);
+        testEqual(pvd::int32(test1_x), 7);
+
+        preq->donePut = false;
+        val->getSubFieldT<pvd::PVInt>("x")->put(8);
+        put->put(val, chg);
+        testOk1(preq->donePut);
+        testOk1(!preq->statusPut.isSuccess());
+        testDiag("put status: %s", preq->statusPut.getMessage().c_str());
+        testEqual(test1->nputs, 1u); // not sent upstream
+        testEqual(pvd::int32(test1_x), 7);
+
+        testDiag("get() is not limited");
+        put->get();
+        testOk1(preq->doneGet && preq->statusGet.isSuccess());
+
+        put->destroy();
+    }
+
+    void test_getfield()
+    {
+        testDiag("Check that getField() results are cached until disconnect");
+
+        ChannelCacheEntry::shared_pointer entry(std::tr1::static_pointer_cast<GWChannel>(client)->entry);
+
+        TestChannelFieldRequester::shared_pointer freq(new TestChannelFieldRequester);
+        client->getField(freq, "");
+        testOk1(freq->done && freq->status.isSuccess() && !!freq->fielddesc);
+
+        TestChannelFieldRequester::shared_pointer freq2(new TestChannelFieldRequester);
+        client->getField(freq2, "");
+        testOk1(freq2->done && freq2->status.isSuccess());
+        testOk1(freq2->fielddesc==freq->fielddesc);
+        testEqual(epicsAtomicGetSizeT(&entry->ngetfield), 2u);
+        testEqual(epicsAtomicGetSizeT(&entry->ngetfieldcached), 1u);
+
+        test1->disconnect();
+        {
+            Guard G(entry->mutex());
+            testOk1(entry->fields.empty());
+        }
+    }
 };
 
+void test_array_slice()
+{
+    testDiag("test_array_slice");
+
+    {
+        pvd::PVStructurePtr req(pvd::getPVDataCreate()->createPVStructure(pvd::getFieldCreate()->createFieldBuilder()
+                                                                          ->addNestedStructure("field")
+                                                                             ->addNestedStructure("a")
+                                                                                ->addNestedStructure("b")
+                                                                                ->endNested()
+                                                                             ->endNested()
+                                                                          ->endNested()
+                                                                          ->createStructure()));
+        testEqual(GWArray::arrayField(req), "a.b");
+        testEqual(GWArray::arrayField(makeGetRequest(true)), "value");
+    }
+
+    {
+        // field selections which differ only in _options
+        pvd::PVStructurePtr A(pvd::createRequest("field(value[array=0:10])")),
+                            B(pvd::createRequest("field(value[array=5:20])")),
+                            C(pvd::createRequest("field(value)"));
+        testOk1(MonitorCacheEntry::fieldKey(A)!=MonitorCacheEntry::fieldKey(B));
+        testOk1(MonitorCacheEntry::fieldKey(A)==MonitorCacheEntry::fieldKey(pvd::createRequest("field(value[array=0:10])")));
+        testOk1(MonitorCacheEntry::fieldOptions(A));
+        testOk1(!MonitorCacheEntry::fieldOptions(C));
+        testOk1(!MonitorCacheEntry::fieldOptions(makeGetRequest(true)));
+    }
+
+    pvd::PVScalarArray::shared_pointer arr(pvd::getPVDataCreate()->createPVScalarArray(pvd::pvInt));
+    {
+        pvd::shared_vector<pvd::int32> val(10);
+        for(size_t i=0; i<val.size(); i++)
+            val[i] = i;
+        arr->putFrom<pvd::int32>(pvd::freeze(val));
+    }
+
+    pvd::shared_vector<const pvd::int32> out;
+
+    GWArray::slice(*arr, 0, 0, 1)->getAs<pvd::int32>(out);
+    testEqual(out.size(), 10u);
+
+    GWArray::slice(*arr, 2, 3, 1)->getAs<pvd::int32>(out);
+    testOk(out.size()==3 && out[0]==2 && out[2]==4, "slice [2,5) -> %u elements", (unsigned)out.size());
+
+    GWArray::slice(*arr, 1, 0, 3)->getAs<pvd::int32>(out);
+    testOk(out.size()==3 && out[0]==1 && out[1]==4 && out[2]==7, "stride 3 from 1 -> %u elements", (unsigned)out.size());
+
+    GWArray::slice(*arr, 8, 5, 1)->getAs<pvd::int32>(out);
+    testOk(out.size()==2 && out[1]==9, "count truncated -> %u elements", (unsigned)out.size());
+
+    GWArray::slice(*arr, 20, 0, 1)->getAs<pvd::int32>(out);
+    testEqual(out.size(), 0u);
+}
+
+void test_array_filtered()
+{
+    testDiag("ChannelArray isn't answered from a subscription with _options");
+
+    TestProvider::shared_pointer upstream(new TestProvider());
+    TestPV::shared_pointer arr(upstream->addPV("arr", pvd::getFieldCreate()->createFieldBuilder()
+                                               ->addArray("value", pvd::pvInt)
+                                               ->createStructure()));
+    {
+        pvd::shared_vector<pvd::int32> val(10);
+        for(size_t i=0; i<val.size(); i++)
+            val[i] = i;
+        arr->value->getSubFieldT<pvd::PVIntArray>("value")->replace(pvd::freeze(val));
+    }
+
+    GWServerChannelProvider::shared_pointer gateway(new GWServerChannelProvider(upstream));
+    TestChannelRequester::shared_pointer client_req(new TestChannelRequester);
+    pva::Channel::shared_pointer client(gateway->createChannel("arr", client_req));
+    if(!client)
+        testAbort("channel \"arr\" not connected");
+
+    // TestProvider doesn't apply the slice, but a real upstream server would
+    TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+    pvd::Monitor::shared_pointer mon(client->createMonitor(mreq, pvd::createRequest("field(value[array=2:4])")));
+    if(!mon)
+        testAbort("Failed to create monitor");
+    testOk1(mon->start().isSuccess());
+    upstream->dispatch();
+    {
+        pva::MonitorElementPtr elem(mon->poll());
+        testOk1(!!elem);
+        if(elem) mon->release(elem);
+    }
+
+    TestChannelArrayRequester::shared_pointer areq(new TestChannelArrayRequester);
+    pva::ChannelArray::shared_pointer carr(client->createChannelArray(areq, pvd::createRequest("field(value)")));
+    testOk1(areq->connected && areq->statusConnect.isSuccess());
+    if(!carr)
+        testAbort("Failed to create ChannelArray");
+
+    ChannelCacheEntry::shared_pointer E(gateway->cache.entries["arr"]);
+
+    carr->getArray(0, 0, 1);
+    testOk1(areq->doneGet && areq->statusGet.isSuccess());
+    testOk1(areq->value && areq->value->getLength()==10u);
+    testEqual(arr->ngetarrays, 1u);
+    testEqual(epicsAtomicGetSizeT(&E->ngetarraycached), 0u);
+
+    carr->getLength();
+    testOk1(areq->doneLength && areq->length==10u);
+    testEqual(arr->ngetlengths, 1u);
+
+    testDiag("while an unfiltered subscription is answered from cache");
+    TestChannelMonitorRequester::shared_pointer mreq2(new TestChannelMonitorRequester);
+    pvd::Monitor::shared_pointer mon2(client->createMonitor(mreq2, pvd::createRequest("field(value)")));
+    if(!mon2)
+        testAbort("Failed to create monitor");
+    testOk1(mon2->start().isSuccess());
+    upstream->dispatch();
+    {
+        pva::MonitorElementPtr elem(mon2->poll());
+        testOk1(!!elem);
+        if(elem) mon2->release(elem);
+    }
+
+    areq->doneGet = areq->doneLength = false;
+    carr->getArray(2, 3, 1);
+    testOk1(areq->doneGet && areq->value && areq->value->getLength()==3u);
+    testEqual(arr->ngetarrays, 1u);
+    testEqual(epicsAtomicGetSizeT(&E->ngetarraycached), 1u);
+
+    carr->getLength();
+    testOk1(areq->doneLength && areq->length==10u);
+    testEqual(arr->ngetlengths, 1u);
+
+    carr->destroy();
+    mon->destroy();
+    mon2->destroy();
+    client->destroy();
+    gateway->destroy();
+}
+
+void test_token_bucket()
+{
+    testDiag("TokenBucket burst and refill");
+
+    TokenBucket B(1e-3, 3.0);
+    testOk1(B.take());
+    testOk1(B.take());
+    testOk1(B.take());
+    testOk1(!B.take()); // burst used up
+    {
+        Guard G(B.mutex);
+        testEqual(B.naccepted, 3u);
+        testEqual(B.nrejected, 1u);
+        // pretend that much time has passed
+        epicsTimeAddSeconds(&B.last, -1e4);
+    }
+    testOk1(B.take());
+    {
+        Guard G(B.mutex);
+        // refill is limited to 'burst'
+        testOk(B.tokens>1.9 && B.tokens<2.1, "tokens %f", B.tokens);
+    }
+
+    testDiag("RateLimit expires idle buckets");
+
+    RateLimit L("*", 1e-3, 2.0);
+    TokenBucket::shared_pointer A(L.bucket("1.2.3.4:5075"));
+    testOk1(A==L.bucket("1.2.3.4:5076")); // by host
+    testOk1(A->take());
+    testEqual(L.expire(), 0u); // in use
+    A.reset();
+    testEqual(L.expire(), 0u); // not refilled
+    {
+        TokenBucket::shared_pointer A2(L.bucket("1.2.3.4:5075"));
+        Guard G(A2->mutex);
+        epicsTimeAddSeconds(&A2->last, -1e4);
+    }
+    testEqual(L.expire(), 1u);
+
+    size_t nhosts, naccepted, nrejected;
+    L.stats(nhosts, naccepted, nrejected);
+    testEqual(nhosts, 0u);
+    testEqual(naccepted, 1u); // totals kept
+}
+
+void test_latency_hist()
+{
+    testDiag("test_latency_hist");
+
+    LatencyHist H;
+    H.add(500u);     // 0.5 us
+    H.add(3000u);    // 3 us
+    H.add(1000000u); // 1 ms
+    H.add(epicsUInt64(1000000000u)*1000u); // 1000 sec.
+
+    testOk(H.buckets[0]==1 && H.buckets[1]==1, "<2us %u, <4us %u", (unsigned)H.buckets[0], (unsigned)H.buckets[1]);
+    testEqual(H.buckets[9], 1u); // [512, 1024) us
+    testEqual(H.buckets[LatencyHist::NBuckets-1], 1u);
+}
+
+void test_trace()
+{
+    testDiag("test_trace");
+
+    for(size_t i=0; i<2000u; i++)
+        traceRecord(TraceFanout, i, 1u);
+
+    std::vector<TraceRecord> all, mine;
+    traceSnapshot(all);
+    const std::string self(epicsThreadGetNameSelf());
+    for(size_t i=0; i<all.size(); i++) {
+        if(self==all[i].thread)
+            mine.push_back(all[i]);
+    }
+
+    // ring has wrapped, only the newest are kept
+    testEqual(mine.size(), 1024u);
+    testOk(!mine.empty() && mine.front().chan==2000u-1024u && mine.back().chan==1999u,
+           "oldest #%u newest #%u",
+           mine.empty() ? 0u : (unsigned)mine.front().chan,
+           mine.empty() ? 0u : (unsigned)mine.back().chan);
+    testEqual(std::string(mine.empty() ? "" : traceEventName(mine.back().event)), "fanout");
+}
+
+void test_record_replay()
+{
+    testDiag("test_record_replay");
+    const char *fname = "testmon.p2prec";
+
+    pvd::StructureConstPtr type(pvd::getFieldCreate()->createFieldBuilder()
+                                ->add("x", pvd::pvInt)
+                                ->add("y", pvd::pvInt)
+                                ->createStructure());
+    pvd::PVStructurePtr value(pvd::getPVDataCreate()->createPVStructure(type));
+    pvd::PVIntPtr x(value->getSubFieldT<pvd::PVInt>("x")),
+                  y(value->getSubFieldT<pvd::PVInt>("y"));
+    {
+        pvd::BitSet changed, overrun;
+        changed.set(x->getFieldOffset());
+
+        Recorder R;
+        R.open(fname);
+        x->put(5);
+        y->put(7);
+        R.update(1u, "rec1", type, *value, changed, overrun); // first is recorded complete
+        x->put(6);
+        R.update(1u, "rec1", type, *value, changed, overrun);
+        R.close();
+    }
+
+    ReplayProvider::shared_pointer replay(new ReplayProvider(fname, 1.0, false));
+
+    TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+    pva::Channel::shared_pointer chan(replay->createChannel("rec1", creq));
+    testOk1(!!chan);
+    if(!chan) {
+        testSkip(3, "No replay channel");
+        return;
+    }
+
+    TestChannelMonitorRequester::shared_pointer mreq(new TestChannelMonitorRequester);
+    pvd::Monitor::shared_pointer mon(chan->createMonitor(mreq, makeRequest(2)));
+    testOk1(mon->start().isSuccess());
+
+    // before replay starts, value is the first update
+    pva::MonitorElementPtr elem(mon->poll());
+    testOk(elem && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get()==5
+                && elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("y")->get()==7,
+           "initial value");
+    if(elem) mon->release(elem);
+
+    replay->start();
+    replay->join();
+
+    pvd::int32 last = 0;
+    while((elem=mon->poll())) {
+        last = elem->pvStructurePtr->getSubFieldT<pvd::PVInt>("x")->get();
+        mon->release(elem);
+    }
+    testEqual(last, 6);
+
+    mon->destroy();
+    chan->destroy();
+    remove(fname);
+}
+
+void test_partition()
+{
+    testDiag("test_partition");
+
+    const size_t N = 1000u;
+    std::vector<Partition> four;
+    for(unsigned i=0; i<4u; i++)
+        four.push_back(Partition(i, 4u));
+    Partition five(0u, 5u);
+
+    size_t nbad = 0u, nmoved = 0u, counts[4] = {0u, 0u, 0u, 0u};
+    for(size_t n=0; n<N; n++) {
+        char name[32];
+        sprintf(name, "part:%u:VAL", (unsigned)n);
+
+        unsigned nowners = 0u;
+        for(unsigned i=0; i<4u; i++)
+            nowners += four[i].owns(name);
+        nbad += nowners!=1u;
+
+        unsigned owner = four[0].owner(name);
+        counts[owner]++;
+        nmoved += owner!=five.owner(name);
+    }
+
+    testOk(nbad==0u, "each name has one owner (%u not)", (unsigned)nbad);
+    testOk(*std::min_element(counts, counts+4)>N/8u, "split %u %u %u %u",
+           (unsigned)counts[0], (unsigned)counts[1], (unsigned)counts[2], (unsigned)counts[3]);
+    // ideally N/5
+    testOk(nmoved<N*2u/5u, "adding a worker moves %u of %u names", (unsigned)nmoved, (unsigned)N);
+    testOk1(Partition().owns("anything"));
+
+    // a worker does not connect upstream for names it does not own
+    TestProvider::shared_pointer upstream(new TestProvider());
+    upstream->addPV("part:0:VAL", pvd::getFieldCreate()->createFieldBuilder()
+                                      ->add("value", pvd::pvInt)
+                                      ->createStructure());
+    GWServerChannelProvider::shared_pointer gateway(new GWServerChannelProvider(upstream));
+    gateway->cache.partition = Partition((four[0].owner("part:0:VAL")+1u)%4u, 4u);
+
+    TestChannelRequester::shared_pointer creq(new TestChannelRequester);
+    pva::Channel::shared_pointer chan(gateway->createChannel("part:0:VAL", creq));
+    testOk(!chan, "Not found in other partition");
+    {
+        Guard G(gateway->cache.cacheLock);
+        testOk1(gateway->cache.entries.empty());
+    }
+    gateway->destroy();
+}
+
 } // namespace
 
 MAIN(testmon)
 {
-    testPlan(79);
+    testPlan(220);
     TEST_METHOD(TestMonitor, test_event);
     TEST_METHOD(TestMonitor, test_share);
     TEST_METHOD(TestMonitor, test_ds_no_start);
     TEST_METHOD(TestMonitor, test_overflow_upstream);
     TEST_METHOD(TestMonitor, test_overflow_downstream);
+    TEST_METHOD(TestMonitor, test_get_cached);
+    TEST_METHOD(TestMonitor, test_get_coalesce);
+    TEST_METHOD(TestMonitor, test_put_coalesce);
+    TEST_METHOD(TestMonitor, test_put_limited);
+    TEST_METHOD(TestMonitor, test_getfield);
+    test_array_slice();
+    test_array_filtered();
+    test_token_bucket();
+    test_latency_hist();
+    test_trace();
+    test_record_replay();
+    test_partition();
     TestProvider::testCounts();
     int ok = 1;
     size_t temp;
@@ -359,6 +1054,22 @@ MAIN(testmon)
     TESTC(ChannelCacheEntry);
     TESTC(MonitorCacheEntry);
     TESTC(MonitorUser);
+    TESTC(GWGet);
+    TESTC(GetCacheEntry);
+    TESTC(GetCacheEntry::URequester);
+    TESTC(GWPut);
+    TESTC(PutCacheEntry);
+    TESTC(PutCacheEntry::URequester);
+    TESTC(LimitedPut);
+    TESTC(LimitedPut::URequester);
+    TESTC(LimitedProcess);
+    TESTC(LimitedProcess::URequester);
+    TESTC(LimitedRPC);
+    TESTC(LimitedRPC::URequester);
+    TESTC(GWArray);
+    TESTC(ArrayCacheEntry);
+    TESTC(ReplayChannel);
+    TESTC(ReplayMonitor);
 #undef TESTC
     testOk(ok, "All instances free'd");
     return testDone();
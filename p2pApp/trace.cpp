@@ -0,0 +1,181 @@
+
+#include <algorithm>
+#include <string>
+#include <stdio.h>
+
+#include <dbDefs.h>
+#include <epicsAtomic.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#define epicsExportSharedSymbols
+#include "helper.h"
+#include "pva2pva.h"
+#include "trace.h"
+
+int p2pTrace = 1;
+
+namespace {
+
+struct TraceRing {
+    enum {Size = 1024};
+    // only written by the owning thread
+    TraceRecord records[Size];
+    // total # of records written.  records[head%Size] is the next to be written
+    size_t head;
+    const std::string thread;
+
+    TraceRing() :head(0), thread(epicsThreadGetNameSelf()) {}
+};
+
+// Rings are never free'd so that traceSnapshot() needs no coordination with threads
+// which exit.  Instead, the number of rings is limited.
+const size_t maxRings = 256;
+
+epicsThreadOnceId traceOnce = EPICS_THREAD_ONCE_INIT;
+epicsThreadPrivateId traceKey;
+epicsMutex *ringsLock;
+std::vector<TraceRing*> *rings;
+size_t nuntraced; // events from threads without a ring
+
+void traceInit(void *)
+{
+    traceKey = epicsThreadPrivateCreate();
+    ringsLock = new epicsMutex;
+    rings = new std::vector<TraceRing*>;
+}
+
+char noRing; // marks a thread which could not have a ring
+
+TraceRing* getRing()
+{
+    epicsThreadOnce(&traceOnce, &traceInit, 0);
+
+    void *ring = epicsThreadPrivateGet(traceKey);
+    if(!ring) {
+        // first event from this thread
+        Guard G(*ringsLock);
+        if(rings->size()<maxRings) {
+            TraceRing *R = new TraceRing;
+            rings->push_back(R);
+            ring = R;
+        } else {
+            ring = &noRing;
+        }
+        epicsThreadPrivateSet(traceKey, ring);
+    }
+    return ring==&noRing ? 0 : static_cast<TraceRing*>(ring);
+}
+
+bool byTime(const TraceRecord& lhs, const TraceRecord& rhs) { return lhs.time<rhs.time; }
+
+const char *eventNames[] = {
+    "search",
+    "lookupHit",
+    "lookupWait",
+    "lookupMiss",
+    "createMonitor",
+    "upstreamEvent",
+    "fanout",
+    "overflow",
+    "release",
+};
+
+} // namespace
+
+void traceRecord(TraceEvent evt, size_t chan, size_t arg)
+{
+    TraceRing *ring = getRing();
+    if(!ring) {
+        epicsAtomicIncrSizeT(&nuntraced);
+        return;
+    }
+
+    size_t head = ring->head;
+    TraceRecord& rec = ring->records[head%TraceRing::Size];
+    rec.time = epicsMonotonicGet();
+    rec.chan = chan;
+    rec.event = evt;
+    rec.arg = epicsUInt32(arg);
+    // publish after record is complete
+    epicsAtomicSetSizeT(&ring->head, head+1);
+}
+
+const char* traceEventName(unsigned evt)
+{
+    return evt<NELEMENTS(eventNames) ? eventNames[evt] : "???";
+}
+
+void traceSnapshot(std::vector<TraceRecord>& out)
+{
+    epicsThreadOnce(&traceOnce, &traceInit, 0);
+
+    std::vector<TraceRing*> R;
+    {
+        Guard G(*ringsLock);
+        R = *rings;
+    }
+
+    FOREACH(std::vector<TraceRing*>::const_iterator, it, end, R) {
+        const TraceRing& ring = **it;
+
+        size_t first = epicsAtomicGetSizeT(&ring.head);
+        size_t last = first;
+        first = first>TraceRing::Size ? first-TraceRing::Size : 0u;
+
+        size_t start = out.size();
+        for(size_t i=first; i<last; i++) {
+            out.push_back(ring.records[i%TraceRing::Size]);
+            out.back().thread = ring.thread.c_str();
+        }
+
+        // the owner may have overwritten some records while we copied.
+        // record N is being overwritten once head reaches N+Size
+        size_t after = epicsAtomicGetSizeT(&ring.head);
+        if(after>=first+TraceRing::Size) {
+            size_t valid = after-TraceRing::Size+1u;
+            out.erase(out.begin()+start, out.begin()+start+std::min(valid-first, last-first));
+        }
+    }
+
+    std::stable_sort(out.begin(), out.end(), byTime);
+}
+
+void traceShow(std::ostream& strm, size_t count, const char *thread)
+{
+    std::vector<TraceRecord> recs;
+    traceSnapshot(recs);
+
+    if(thread && thread[0]!='\0') {
+        std::vector<TraceRecord> match;
+        FOREACH(std::vector<TraceRecord>::const_iterator, it, end, recs) {
+            if(epicsStrGlobMatch(it->thread, thread))
+                match.push_back(*it);
+        }
+        recs.swap(match);
+    }
+
+    if(count==0)
+        count = 100;
+    size_t first = recs.size()>count ? recs.size()-count : 0u;
+
+    const epicsUInt64 now = epicsMonotonicGet();
+    strm<<"Trace "<<(p2pTrace?"enabled":"disabled")<<", "
+        <<(recs.size()-first)<<" events";
+    if(size_t N = epicsAtomicGetSizeT(&nuntraced))
+        strm<<", "<<N<<" from untraced threads";
+    strm<<"\n";
+
+    for(size_t i=first; i<recs.size(); i++) {
+        const TraceRecord& rec = recs[i];
+        char buf[32];
+        // time before now in seconds
+        epicsSnprintf(buf, sizeof(buf), "-%.6f", (now-rec.time)*1e-9);
+        strm<<buf<<" "<<rec.thread<<" "<<traceEventName(rec.event)
+            <<" #"<<rec.chan<<" "<<rec.arg<<"\n";
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <ostream>
+#include <vector>
+
+#include <epicsTypes.h>
+
+/** Event trace for the gateway hot path.
+ *
+ * Each thread records into its own fixed size ring, so recording takes no lock,
+ * and costs a thread private lookup and a clock read.
+ * Older events are overwritten.  Rings are read on demand with traceSnapshot(),
+ * or by the "gwtrace" iocsh command, while threads continue to record.
+ *
+ * Recording is enabled while the p2pTrace iocsh variable is non-zero.
+ */
+
+extern int p2pTrace;
+
+enum TraceEvent {
+    TraceSearch,        // arg is 1 if found
+    TraceLookupHit,     // client channel connected
+    TraceLookupWait,    // client channel not yet connected
+    TraceLookupMiss,    // new client channel
+    TraceCreateMonitor, // arg is 1 if a new upstream subscription
+    TraceUpstreamEvent, // arg is estimated bytes
+    TraceFanout,        // arg is # of downstream subscriptions woken
+    TraceOverflow,      // a downstream queue is full
+    TraceRelease,       // arg is 1 if leaving overflow
+    TraceNEvents
+};
+
+struct TraceRecord {
+    epicsUInt64 time;   // epicsMonotonicGet()
+    size_t chan;        // ChannelCacheEntry::chanid, or 0
+    epicsUInt32 event;  // TraceEvent
+    epicsUInt32 arg;
+    const char *thread; // only set by traceSnapshot()
+};
+
+void traceRecord(TraceEvent evt, size_t chan, size_t arg);
+
+inline void trace(TraceEvent evt, size_t chan, size_t arg=0)
+{
+    if(p2pTrace)
+        traceRecord(evt, chan, arg);
+}
+
+const char* traceEventName(unsigned evt);
+
+//! Copy the contents of all rings, oldest first
+void traceSnapshot(std::vector<TraceRecord>& out);
+
+//! print the last 'count' events, optionally only from threads named 'thread'
+void traceShow(std::ostream& strm, size_t count, const char *thread);
+
+#endif // TRACE_H
@@ -0,0 +1,8 @@
+// as utilitiesx.cpp, but without testDiag() output which would dominate benchmark timing
+#include <epicsUnitTest.h>
+
+static int quietDiag(const char *, ...) { return 0; }
+
+#define testDiag quietDiag
+#include "utilities.cpp"
+#undef testDiag
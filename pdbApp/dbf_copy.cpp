@@ -100,18 +100,19 @@ long copyPVD2DBF(const pvd::PVField::const_shared_pointer& inraw,
         arr.slice(0, nreq*elemsize);
         nreq = arr.size()/elemsize;
 
-        if(outdbf == DBF_STRING) {
-            char *outsbuf = (char*)outbuf;
-
-            // allocate a temp buffer of string[], ick...
-            pvd::shared_vector<std::string> strs(nreq); // alloc
+        if(outdbf == DBF_STRING && arr.original_type()==pvd::pvString) {
+            // std::string[] to char[][]
+            copyPVDString2DBR(static_cast<const std::string*>(arr.data()), nreq, (char*)outbuf);
 
-            pvd::castUnsafeV(nreq, pvd::pvString, strs.data(), arr.original_type(), arr.data());
+        } else if(outdbf == DBF_STRING) {
+            // non-string[] to char[][], formatting one element at a time
+            char *outsbuf = (char*)outbuf;
+            const char *inp = static_cast<const char*>(arr.data());
+            std::string temp;
 
-            for(long i =0; i<nreq; i++, outsbuf += MAX_STRING_SIZE) {
-                size_t slen = std::min(strs[i].size(), size_t(MAX_STRING_SIZE-1));
-                memcpy(outsbuf, strs[i].c_str(), slen);
-                outsbuf[slen] = '\0';
+            for(long i =0; i<nreq; i++, outsbuf += MAX_STRING_SIZE, inp += elemsize) {
+                pvd::castUnsafeV(1, pvd::pvString, &temp, arr.original_type(), inp);
+                copyPVDString2DBR(&temp, 1, outsbuf);
             }
 
         } else {
@@ -1,6 +1,9 @@
 
 #include <vector>
 #include <utility>
+#include <algorithm>
+
+#include <string.h>
 
 #include <errlog.h>
 #include <epicsString.h>
@@ -32,9 +35,15 @@ namespace pvd = epics::pvData;
 namespace pva = epics::pvAccess;
 
 int PDBProviderDebug;
+int qsrvCoalesceEvents;
+int qsrvFanoutThreads;
+int qsrvEventThreads = 1;
 
 namespace {
 
+// beyond this, updates waiting for a fanout worker are merged
+const size_t maxFanoutPending = 4u;
+
 struct Splitter {
     const char sep, *cur, *end;
     Splitter(const char *s, char sep)
@@ -544,12 +553,31 @@ PDBProvider::PDBProvider(const epics::pvAccess::Configuration::const_shared_poin
     }
 #endif // USE_MULTILOCK
 
-    event_context = db_init_events();
-    if(!event_context)
-        throw std::runtime_error("Failed to create dbEvent context");
-    int ret = db_start_events(event_context, "PDB-event", NULL, NULL, epicsThreadPriorityCAServerLow-1);
-    if(ret!=DB_EVENT_OK)
-        throw std::runtime_error("Failed to stsart dbEvent context");
+    if(qsrvFanoutThreads>0) {
+        fanout_queue.reset(new WorkQueue("PDB-fanout"));
+        fanout_queue->start(qsrvFanoutThreads, epicsThreadPriorityCAServerLow-1);
+    }
+
+    const unsigned nevents = std::max(1, qsrvEventThreads);
+    for(unsigned i=0; i<nevents; i++) {
+        PDBEventContext::shared_pointer ectx(new PDBEventContext);
+        event_contexts.push_back(ectx);
+
+        char name[32];
+        if(nevents==1)
+            strcpy(name, "PDB-event");
+        else
+            epicsSnprintf(name, sizeof(name), "PDB-event%u", i);
+
+        ectx->ctx = db_init_events();
+        if(!ectx->ctx)
+            throw std::runtime_error("Failed to create dbEvent context");
+        if(db_add_extra_labor_event(ectx->ctx, &pdb_single_flush, ectx.get())!=DB_EVENT_OK)
+            throw std::runtime_error("Failed to setup dbEvent flush");
+        int ret = db_start_events(ectx->ctx, name, NULL, NULL, epicsThreadPriorityCAServerLow-1);
+        if(ret!=DB_EVENT_OK)
+            throw std::runtime_error("Failed to stsart dbEvent context");
+    }
 
     // setup group monitors
 #ifdef USE_MULTILOCK
@@ -566,6 +594,10 @@ PDBProvider::PDBProvider(const epics::pvAccess::Configuration::const_shared_poin
 
             // prepare for monitor
 
+            pv->fanout_queue = fanout_queue.get();
+            // all members on one thread, so their events are not concurrent
+            dbEventCtx ctxt = eventContext(pv->name.c_str())->ctx;
+
             size_t i=0;
             FOREACH(PDBGroupPV::members_t::iterator, it2, end2, pv->members)
             {
@@ -578,10 +610,10 @@ PDBProvider::PDBProvider(const epics::pvAccess::Configuration::const_shared_poin
 
                 // TODO: don't need evt_PROPERTY for PVIF plain
                 dbChannel *pchan = info.chan2.chan ? info.chan2.chan : info.chan.chan;
-                info.evt_PROPERTY.create(event_context, pchan, &pdb_group_event, DBE_PROPERTY);
+                info.evt_PROPERTY.create(ctxt, pchan, &pdb_group_event, DBE_PROPERTY);
 
                 if(!info.triggers.empty()) {
-                    info.evt_VALUE.create(event_context, info.chan, &pdb_group_event, DBE_VALUE|DBE_ALARM);
+                    info.evt_VALUE.create(ctxt, info.chan, &pdb_group_event, DBE_VALUE|DBE_ALARM);
                 }
             }
         }catch(std::exception& e){
@@ -590,9 +622,62 @@ PDBProvider::PDBProvider(const epics::pvAccess::Configuration::const_shared_poin
         }
     }
 #endif // USE_MULTILOCK
+
+    buildChannelNames();
+
     epics::atomic::increment(num_instances);
 }
 
+void PDBProvider::buildChannelNames()
+{
+    std::vector<std::string> names;
+    for(pdbRecordIterator rec; !rec.done(); rec.next())
+        names.push_back(rec.name());
+    for(persist_pv_map_t::const_iterator it=persist_pv_map.begin(), end=persist_pv_map.end();
+        it != end; ++it)
+    {
+        names.push_back(it->first);
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    pvd::shared_vector<std::string> temp(names.size());
+    for(size_t i=0; i<names.size(); i++)
+        temp[i].swap(names[i]);
+    channel_names = pvd::freeze(temp);
+}
+
+namespace {
+// compare only the first 'n' characters of each name
+struct PrefixBefore {
+    size_t n;
+    explicit PrefixBefore(size_t n) :n(n) {}
+    bool operator()(const std::string& name, const std::string& prefix) const {
+        return name.compare(0, n, prefix)<0;
+    }
+};
+struct PrefixAfter {
+    size_t n;
+    explicit PrefixAfter(size_t n) :n(n) {}
+    bool operator()(const std::string& prefix, const std::string& name) const {
+        return name.compare(0, n, prefix)>0;
+    }
+};
+} // namespace
+
+pvd::shared_vector<const std::string>
+PDBProvider::channelNames(const std::string& prefix) const
+{
+    const std::string *begin = channel_names.data(),
+                      *end   = begin + channel_names.size(),
+                      *first = std::lower_bound(begin, end, prefix, PrefixBefore(prefix.size())),
+                      *last  = std::upper_bound(first, end, prefix, PrefixAfter(prefix.size()));
+
+    pvd::shared_vector<const std::string> ret(channel_names);
+    ret.slice(first-begin, last-first);
+    return ret;
+}
+
 PDBProvider::~PDBProvider()
 {
     epics::atomic::decrement(num_instances);
@@ -602,16 +687,26 @@ PDBProvider::~PDBProvider()
 
 void PDBProvider::destroy()
 {
-    dbEventCtx ctxt = NULL;
+    event_contexts_t ctxts;
 
     persist_pv_map_t ppv;
     {
         epicsGuard<epicsMutex> G(transient_pv_map.mutex());
         persist_pv_map.swap(ppv);
-        std::swap(ctxt, event_context);
+        ctxts.swap(event_contexts);
     }
     ppv.clear(); // indirectly calls all db_cancel_events()
-    if(ctxt) db_close_events(ctxt);
+    for(size_t i=0; i<ctxts.size(); i++)
+        ctxts[i]->close();
+    if(fanout_queue) fanout_queue->close();
+}
+
+const PDBEventContext::shared_pointer&
+PDBProvider::eventContext(const char *name) const
+{
+    if(event_contexts.empty())
+        throw std::logic_error("QSRV provider destroyed");
+    return event_contexts[epicsStrHash(name, 0u) % event_contexts.size()];
 }
 
 std::string PDBProvider::getProviderName() { return "QSRV"; }
@@ -633,13 +728,12 @@ PDBProvider::channelFind(const std::string &channelName, const pva::ChannelFindR
 {
     pva::ChannelFind::shared_pointer ret(new ChannelFindRequesterNOOP(shared_from_this()));
 
-    bool found = false;
-    {
-        epicsGuard<epicsMutex> G(transient_pv_map.mutex());
-        if(persist_pv_map.find(channelName)!=persist_pv_map.end()
-                || transient_pv_map.find(channelName)
-                || dbChannelTest(channelName.c_str())==0)
-            found = true;
+    // record or group name.  channel_names is immutable, so no lock
+    bool found = std::binary_search(channel_names.begin(), channel_names.end(), channelName);
+
+    if(!found && channelName.find_first_of(".{[$")!=std::string::npos) {
+        // maybe record with field, and/or filters
+        found = dbChannelTest(channelName.c_str())==0;
     }
     requester->channelFindResult(pvd::Status(), ret, found);
     return ret;
@@ -649,24 +743,10 @@ pva::ChannelFind::shared_pointer
 PDBProvider::channelList(pva::ChannelListRequester::shared_pointer const & requester)
 {
     pva::ChannelFind::shared_pointer ret;
-    pvd::PVStringArray::svector names;
-    for(pdbRecordIterator rec; !rec.done(); rec.next())
-    {
-        names.push_back(rec.name());
-    }
-    {
-        epicsGuard<epicsMutex> G(transient_pv_map.mutex());
-
-        for(persist_pv_map_t::const_iterator it=persist_pv_map.begin(), end=persist_pv_map.end();
-            it != end; ++it)
-        {
-            names.push_back(it->first);
-        }
-    }
-    // check for duplicates?
+    // shared, not copied
     requester->channelListResult(pvd::Status::Ok,
                                  shared_from_this(),
-                                 pvd::freeze(names), false);
+                                 channel_names, false);
     return ret;
 }
 
@@ -798,6 +878,36 @@ FieldName::lookup(const epics::pvData::PVStructurePtr& S, epics::pvData::PVField
     return ret;
 }
 
+void PDBFanout::push(const pvd::PVStructurePtr& snapshot,
+                     const pvd::BitSet& changed,
+                     const pvd::BitSet& overrun)
+{
+    if(pending.size() >= maxFanoutPending) {
+        // subscribers will see the latest value, with fields changed more than once marked as overrun
+        Update& last = pending.back();
+        last.overrun |= overrun;
+        last.overrun.or_and(changed, last.changed);
+        last.changed |= changed;
+        last.snapshot = snapshot;
+
+    } else {
+        pending.push_back(Update());
+        Update& next = pending.back();
+        next.snapshot = snapshot;
+        next.changed = changed;
+        next.overrun = overrun;
+    }
+}
+
+void PDBFanout::done(const epicsTime& start)
+{
+    double elapsed = epicsTime::getCurrent() - start;
+    stats.count++;
+    stats.total += elapsed;
+    if(stats.max < elapsed)
+        stats.max = elapsed;
+}
+
 void FieldName::show() const
 {
     if(parts.empty()) {
@@ -822,4 +932,7 @@ void FieldName::show() const
 
 extern "C" {
 epicsExportAddress(int, PDBProviderDebug);
+epicsExportAddress(int, qsrvCoalesceEvents);
+epicsExportAddress(int, qsrvFanoutThreads);
+epicsExportAddress(int, qsrvEventThreads);
 }
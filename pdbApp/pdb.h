@@ -1,17 +1,86 @@
 #ifndef PDB_H
 #define PDB_H
 
+#include <vector>
+#include <deque>
+
 #include <dbEvent.h>
 #include <asLib.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
 
 #include <pv/configuration.h>
 #include <pv/pvAccess.h>
 
+#include "helper.h"
 #include "weakmap.h"
+#include "tpool.h"
 
 #include <pv/qsrv.h>
 
 struct PDBProvider;
+struct PDBSinglePV;
+
+extern QSRV_API int qsrvFanoutThreads;
+extern QSRV_API int qsrvEventThreads;
+
+//! One dbEvent context, and so one thread, shared by some PVs
+struct QSRV_API PDBEventContext
+{
+    POINTER_DEFINITIONS(PDBEventContext);
+
+    dbEventCtx ctx;
+
+    // with qsrvCoalesceEvents, PVs with events not yet posted.
+    // flushed once the dbEvent queue is empty
+    epicsMutex coalesce_lock;
+    typedef std::vector<std::tr1::weak_ptr<PDBSinglePV> > coalesced_t;
+    coalesced_t coalesced;
+
+    PDBEventContext() :ctx(NULL) {}
+    ~PDBEventContext() { close(); }
+
+    void close() {
+        if(ctx) db_close_events(ctx);
+        ctx = NULL;
+    }
+private:
+    PDBEventContext(const PDBEventContext&);
+    PDBEventContext& operator=(const PDBEventContext&);
+};
+
+/** Delivery of the monitor updates of one PV to its subscribers.
+ *  Guarded by the lock of the PV.
+ */
+struct QSRV_API PDBFanout
+{
+    struct Update {
+        epics::pvData::PVStructurePtr snapshot;
+        epics::pvData::BitSet changed, overrun;
+    };
+
+    // with qsrvFanoutThreads, updates waiting for PDBProvider::fanout_queue.  oldest first
+    typedef std::deque<Update> pending_t;
+    pending_t pending;
+    bool queued; // PV in fanout_queue, or being run()
+
+    // time spent post()ing to subscribers
+    struct Stats {
+        size_t count;
+        double total, max; // seconds
+        Stats() :count(0u), total(0.0), max(0.0) {}
+    } stats;
+
+    PDBFanout() :queued(false) {}
+
+    //! append an update.  Merged into the last when too many are pending.
+    void push(const epics::pvData::PVStructurePtr& snapshot,
+              const epics::pvData::BitSet& changed,
+              const epics::pvData::BitSet& overrun);
+
+    //! account for one delivery which began at 'start'
+    void done(const epicsTime& start);
+};
 
 struct PDBPV
 {
@@ -29,6 +98,9 @@ struct PDBPV
 
     // print info to stdout (with iocsh redirection)
     virtual void show(int lvl) {}
+
+    // copy of PDBFanout::stats.  false if this PV has none
+    virtual bool fanoutStats(PDBFanout::Stats& stats) { return false; }
 };
 
 struct QSRV_API PDBProvider : public epics::pvAccess::ChannelProvider,
@@ -63,7 +135,25 @@ struct QSRV_API PDBProvider : public epics::pvAccess::ChannelProvider,
     typedef weak_value_map<std::string, PDBPV> transient_pv_map_t;
     transient_pv_map_t transient_pv_map;
 
-    dbEventCtx event_context;
+    // Sorted record (and alias) names, and group names, for channelList() and channelFind().
+    // Built by the ctor once groups are loaded, and not changed afterwards,
+    // so searched without locking.
+    epics::pvData::shared_vector<const std::string> channel_names;
+    void buildChannelNames();
+
+    //! Those channel_names beginning with 'prefix'.  A slice of channel_names, not a copy.
+    epics::pvData::shared_vector<const std::string> channelNames(const std::string& prefix) const;
+
+    // qsrvEventThreads contexts.  empty after destroy()
+    typedef std::vector<PDBEventContext::shared_pointer> event_contexts_t;
+    event_contexts_t event_contexts;
+
+    //! Event context for the PVs of a record or group.
+    //! All events of one PV are handled by one thread, and so in order.
+    const PDBEventContext::shared_pointer& eventContext(const char *name) const;
+
+    // with qsrvFanoutThreads, runs PVs which have PDBFanout::pending updates.  otherwise NULL
+    p2p::auto_ptr<WorkQueue> fanout_queue;
 
     typedef std::list<std::string> group_files_t;
     static group_files_t group_files;
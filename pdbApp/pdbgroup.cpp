@@ -27,6 +27,46 @@ size_t PDBGroupPut::num_instances;
 size_t PDBGroupMonitor::num_instances;
 
 typedef epicsGuard<epicsMutex> Guard;
+typedef epicsGuardRelease<epicsMutex> UnGuard;
+
+namespace {
+// one update into all monitor queues.  'G' locks self.lock
+void pdb_group_fanout(PDBGroupPV& self, Guard& G,
+                      const pvd::BitSet& changed, const pvd::BitSet& overrun,
+                      const pvd::PVStructurePtr& snapshot,
+                      PDBGroupPV::interested_remove_t& temp)
+{
+    const epicsTime start(epicsTime::getCurrent());
+
+    self.interested_iterating = true;
+
+    FOREACH(PDBGroupPV::interested_t::const_iterator, it, end, self.interested) {
+        PDBGroupMonitor& mon = **it;
+        mon.post(G, changed, overrun, snapshot); // G unlocked
+    }
+
+    assert(self.interested_iterating);
+
+    while(!self.interested_add.empty()) {
+        PDBGroupPV::interested_t::iterator first(self.interested_add.begin());
+        self.interested.insert(*first);
+        self.interested_add.erase(first);
+    }
+
+    temp.swap(self.interested_remove);
+    for(PDBGroupPV::interested_remove_t::iterator it(temp.begin()),
+        end(temp.end()); it != end; ++it)
+    {
+        self.interested.erase(static_cast<PDBGroupMonitor*>(it->get()));
+    }
+
+    self.interested_iterating = false;
+
+    self.finalizeMonitor();
+
+    self.fanout.done(start);
+}
+} // namespace
 
 void pdb_group_event(void *user_arg, struct dbChannel *chan,
                      int eventsRemaining, struct db_field_log *pfl)
@@ -42,22 +82,33 @@ void pdb_group_event(void *user_arg, struct dbChannel *chan,
 
             Guard G(self->lock);
 
+            // record(s) are locked only to capture() raw values.
+            // conversion into self->complete is done after unlocking.
             self->scratch.clear();
             if(evt->dbe_mask&DBE_PROPERTY || !self->monatomic)
             {
-                DBScanLocker L(dbChannelRecord(info.chan));
-                self->members[idx].pvif->put(self->scratch, evt->dbe_mask, pfl);
+                {
+                    DBScanLocker L(dbChannelRecord(info.chan));
+                    self->members[idx].pvif->capture(evt->dbe_mask, pfl);
+                }
+                self->members[idx].pvif->apply(self->scratch, evt->dbe_mask);
 
             } else {
                 // we ignore 'pfl' (and the dbEvent queue) when collecting an atomic snapshot
 
-                DBManyLocker L(info.locker); // lock only those records in the triggers list
+                {
+                    DBManyLocker L(info.locker); // lock only those records in the triggers list
+                    FOREACH(PDBGroupPV::Info::triggers_t::const_iterator, it, end, info.triggers)
+                    {
+                        size_t i = *it;
+                        // go get a consistent snapshot we must ignore the db_field_log which came through the dbEvent buffer
+                        LocalFL FL(NULL, self->members[i].chan); // create a read fl if needed
+                        self->members[i].pvif->capture(evt->dbe_mask, FL.pfl);
+                    }
+                }
                 FOREACH(PDBGroupPV::Info::triggers_t::const_iterator, it, end, info.triggers)
                 {
-                    size_t i = *it;
-                    // go get a consistent snapshot we must ignore the db_field_log which came through the dbEvent buffer
-                    LocalFL FL(NULL, self->members[i].chan); // create a read fl if needed
-                    self->members[i].pvif->put(self->scratch, evt->dbe_mask, FL.pfl);
+                    self->members[*it].pvif->apply(self->scratch, evt->dbe_mask);
                 }
             }
 
@@ -75,35 +126,23 @@ void pdb_group_event(void *user_arg, struct dbChannel *chan,
                 }
             }
 
-            if(self->initial_waits==0) {
-                self->interested_iterating = true;
+            if(self->initial_waits>0) {
+                // wait for initial updates of all members
 
-                FOREACH(PDBGroupPV::interested_t::const_iterator, it, end, self->interested) {
-                    PDBGroupMonitor& mon = **it;
-                    mon.post(G, self->scratch); // G unlocked
-                }
-
-                {
-                    Guard G(self->lock);
+            } else if(!self->fanout_queue) {
+                // one copy of self->complete, referenced by all monitor queues
+                if(!self->interested.empty())
+                    BaseMonitor::makeSnapshot(self->snapshot, *self->complete);
 
-                    assert(self->interested_iterating);
+                pdb_group_fanout(*self, G, self->scratch, pvd::BitSet(), self->snapshot, temp);
 
-                    while(!self->interested_add.empty()) {
-                        PDBGroupPV::interested_t::iterator first(self->interested_add.begin());
-                        self->interested.insert(*first);
-                        self->interested_add.erase(first);
-                    }
-
-                    temp.swap(self->interested_remove);
-                    for(PDBGroupPV::interested_remove_t::iterator it(temp.begin()),
-                        end(temp.end()); it != end; ++it)
-                    {
-                        self->interested.erase(static_cast<PDBGroupMonitor*>(it->get()));
-                    }
+            } else if(!self->interested.empty() || !self->interested_add.empty()) {
+                BaseMonitor::makeSnapshot(self->snapshot, *self->complete);
+                self->fanout.push(self->snapshot, self->scratch, pvd::BitSet());
 
-                    self->interested_iterating = false;
-
-                    self->finalizeMonitor();
+                if(!self->fanout.queued) {
+                    self->fanout.queued = true;
+                    self->fanout_queue->add(self);
                 }
             }
         }
@@ -123,6 +162,7 @@ void pdb_group_event(void *user_arg, struct dbChannel *chan,
 PDBGroupPV::PDBGroupPV()
     :pgatomic(false)
     ,monatomic(false)
+    ,fanout_queue(NULL)
     ,interested_iterating(false)
     ,initial_waits(0)
 {
@@ -179,10 +219,10 @@ void PDBGroupPV::addMonitor(PDBGroupMonitor *mon)
         }
         initial_waits = ievts;
 
-    } else if(initial_waits==0) {
+    } else if(initial_waits==0 && fanout.pending.empty()) {
         // new subscriber and already had initial update
         mon->post(G);
-    } // else new subscriber, but no initial update.  so just wait
+    } // else new subscriber, but no initial update, or one pending.  so just wait
 
     if(interested_iterating)
         interested_add.insert(mon);
@@ -227,6 +267,40 @@ void PDBGroupPV::finalizeMonitor()
     }
 }
 
+void PDBGroupPV::run()
+{
+    interested_remove_t temp;
+    Guard G(lock);
+
+    try {
+        // in order.  we stay 'queued' until done, so another worker won't run() concurrently
+        while(!fanout.pending.empty()) {
+            PDBFanout::Update update(fanout.pending.front());
+            fanout.pending.pop_front();
+
+            pdb_group_fanout(*this, G, update.changed, update.overrun, update.snapshot, temp);
+
+            if(!temp.empty()) {
+                UnGuard U(G);
+                temp.clear(); // monitors removed while iterating
+            }
+        }
+    }catch(std::exception& e){
+        std::cerr<<"Unhandled exception in PDBGroupPV::run(): "<<e.what()<<"\n"
+                 <<SHOW_EXCEPTION(e)<<"\n";
+        fanout.pending.clear();
+    }
+
+    fanout.queued = false;
+}
+
+bool PDBGroupPV::fanoutStats(PDBFanout::Stats& stats)
+{
+    Guard G(lock);
+    stats = fanout.stats;
+    return true;
+}
+
 void PDBGroupPV::show(int lvl)
 {
     // no locking as we only print things which are const after initialization
@@ -407,20 +481,27 @@ void PDBGroupPut::get()
 
     changed->clear();
     if(atomic) {
-        DBManyLocker L(channel->pv->locker);
-        for(size_t i=0; i<npvs; i++) {
-            LocalFL FL(NULL, channel->pv->members[i].chan);
-            pvif[i]->put(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
+        {
+            DBManyLocker L(channel->pv->locker);
+            for(size_t i=0; i<npvs; i++) {
+                LocalFL FL(NULL, channel->pv->members[i].chan);
+                pvif[i]->capture(DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
+            }
         }
+        for(size_t i=0; i<npvs; i++)
+            pvif[i]->apply(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY);
     } else {
 
         for(size_t i=0; i<npvs; i++)
         {
             PDBGroupPV::Info& info = channel->pv->members[i];
 
-            DBScanLocker L(dbChannelRecord(info.chan));
-            LocalFL FL(NULL, info.chan);
-            pvif[i]->put(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
+            {
+                DBScanLocker L(dbChannelRecord(info.chan));
+                LocalFL FL(NULL, info.chan);
+                pvif[i]->capture(DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
+            }
+            pvif[i]->apply(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY);
         }
     }
     //TODO: report unused fields as changed?
@@ -470,5 +551,8 @@ void PDBGroupMonitor::onStop()
 void PDBGroupMonitor::requestUpdate()
 {
     Guard G(pv->lock);
-    post(G);
+    // with older updates pending for the fanout worker, .complete is ahead of them.
+    // leave the overflow to be ended by run(), which delivers in order
+    if(pv->fanout.pending.empty())
+        post(G);
 }
@@ -68,7 +68,7 @@ struct PDBGroupMonitor;
 void pdb_group_event(void *user_arg, struct dbChannel *chan,
                      int eventsRemaining, struct db_field_log *pfl);
 
-struct QSRV_API PDBGroupPV : public PDBPV
+struct QSRV_API PDBGroupPV : public PDBPV, public epicsThreadRunable
 {
     POINTER_DEFINITIONS(PDBGroupPV);
     weak_pointer weakself;
@@ -106,6 +106,9 @@ struct QSRV_API PDBGroupPV : public PDBPV
     DBManyLock locker; // all member channels
 
     epics::pvData::PVStructurePtr complete; // complete copy from subscription
+    epics::pvData::PVStructurePtr snapshot; // last copy of complete shared with monitor queues
+    PDBFanout fanout;
+    WorkQueue *fanout_queue; // PDBProvider::fanout_queue
 
     typedef std::set<PDBGroupMonitor*> interested_t;
     bool interested_iterating;
@@ -130,7 +133,11 @@ struct QSRV_API PDBGroupPV : public PDBPV
     void removeMonitor(PDBGroupMonitor*);
     void finalizeMonitor();
 
+    // deliver fanout.pending.  from PDBProvider::fanout_queue
+    virtual void run() OVERRIDE FINAL;
+
     virtual void show(int lvl) OVERRIDE;
+    virtual bool fanoutStats(PDBFanout::Stats& stats) OVERRIDE FINAL;
 };
 
 struct QSRV_API PDBGroupChannel : public BaseChannel,
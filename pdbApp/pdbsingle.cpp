@@ -29,6 +29,96 @@ size_t PDBSinglePut::num_instances;
 size_t PDBSingleMonitor::num_instances;
 
 typedef epicsGuard<epicsMutex> Guard;
+typedef epicsGuardRelease<epicsMutex> UnGuard;
+
+namespace {
+// one update into all monitor queues.  'G' locks self.lock
+void pdb_single_fanout(PDBSinglePV& self, Guard& G,
+                       const pvd::BitSet& changed, const pvd::BitSet& overrun,
+                       const pvd::PVStructurePtr& snapshot,
+                       PDBSinglePV::interested_remove_t& temp)
+{
+    const epicsTime start(epicsTime::getCurrent());
+
+    self.interested_iterating = true;
+
+    FOREACH(PDBSinglePV::interested_t::const_iterator, it, end, self.interested) {
+        PDBSingleMonitor& mon = **it;
+        mon.post(G, changed, overrun, snapshot); // G unlocked during call
+    }
+
+    while(!self.interested_add.empty()) {
+        PDBSinglePV::interested_t::iterator first(self.interested_add.begin());
+        self.interested.insert(*first);
+        self.interested_add.erase(first);
+    }
+
+    temp.swap(self.interested_remove);
+    for(PDBSinglePV::interested_remove_t::iterator it(temp.begin()),
+        end(temp.end()); it != end; ++it)
+    {
+        self.interested.erase(static_cast<PDBSingleMonitor*>(it->get()));
+    }
+
+    self.interested_iterating = false;
+
+    self.finalizeMonitor();
+
+    self.fanout.done(start);
+}
+
+// from self->scratch into all monitor queues, or to the fanout worker.  'G' locks self->lock
+void pdb_single_post(PDBSinglePV& self, Guard& G, PDBSinglePV::interested_remove_t& temp)
+{
+    self.pending_post = false;
+
+    WorkQueue *queue = self.provider->fanout_queue.get();
+
+    if(!queue) {
+        // one copy of self->complete, referenced by all monitor queues
+        if(!self.interested.empty())
+            BaseMonitor::makeSnapshot(self.snapshot, *self.complete);
+
+        pdb_single_fanout(self, G, self.scratch, self.overrun, self.snapshot, temp);
+
+    } else if(!self.interested.empty() || !self.interested_add.empty()) {
+        BaseMonitor::makeSnapshot(self.snapshot, *self.complete);
+        self.fanout.push(self.snapshot, self.scratch, self.overrun);
+
+        if(!self.fanout.queued) {
+            self.fanout.queued = true;
+            queue->add(self.weakself);
+        }
+    }
+
+    self.scratch.clear();
+    self.overrun.clear();
+}
+
+// Does the pvRequest select any field other than value, alarm, or timeStamp?
+// Enum choices are sub-fields of value.
+bool requestsProperty(const pvd::PVStructure::shared_pointer& pvReq,
+                      const pvd::StructureConstPtr& type)
+{
+    pvd::PVStructurePtr fields(pvReq ? pvReq->getSubField<pvd::PVStructure>("field") : pvd::PVStructurePtr());
+    if(!fields || fields->getPVFields().empty())
+        return true; // all fields
+
+    pvd::FieldConstPtr value(type->getField("value"));
+    const bool isenum = value && value->getType()==pvd::structure;
+
+    const pvd::StringArray& names = fields->getStructure()->getFieldNames();
+    for(size_t i=0, N=names.size(); i<N; i++) {
+        if(names[i]=="value") {
+            if(isenum)
+                return true;
+        } else if(names[i]!="alarm" && names[i]!="timeStamp") {
+            return true;
+        }
+    }
+    return false;
+}
+} // namespace
 
 static
 void pdb_single_event(void *user_arg, struct dbChannel *chan,
@@ -41,12 +131,22 @@ void pdb_single_event(void *user_arg, struct dbChannel *chan,
         {
             Guard G(self->lock);
 
-            // we have exclusive use of self->scratch
-            self->scratch.clear();
+            // we have exclusive use of self->scratch,
+            // which accumulates changes until posted.
             {
                 DBScanLocker L(dbChannelRecord(self->chan));
-                // dbGet() into self->complete
-                self->pvif->put(self->scratch, evt->dbe_mask, pfl);
+                // dbGet() into buffer
+                self->pvif->capture(evt->dbe_mask, pfl);
+            }
+            // convert into self->complete without the record lock
+            if(!self->pending_post) {
+                self->pvif->apply(self->scratch, evt->dbe_mask);
+            } else {
+                // merging with a previous event.  fields changed again are overrun
+                self->evtchanged.clear();
+                self->pvif->apply(self->evtchanged, evt->dbe_mask);
+                self->overrun.or_and(self->evtchanged, self->scratch);
+                self->scratch |= self->evtchanged;
             }
 
             if(evt->dbe_mask&DBE_PROPERTY)
@@ -54,31 +154,20 @@ void pdb_single_event(void *user_arg, struct dbChannel *chan,
             else
                 self->hadevent_VALUE = true;
 
-            if(self->hadevent_VALUE && self->hadevent_PROPERTY) {
-                self->interested_iterating = true;
-
-                FOREACH(PDBSinglePV::interested_t::const_iterator, it, end, self->interested) {
-                    PDBSingleMonitor& mon = **it;
-                    // from self->complete into monitor queue element
-                    mon.post(G, self->scratch); // G unlocked during call
-                }
-
-                while(!self->interested_add.empty()) {
-                    PDBSinglePV::interested_t::iterator first(self->interested_add.begin());
-                    self->interested.insert(*first);
-                    self->interested_add.erase(first);
-                }
-
-                temp.swap(self->interested_remove);
-                for(PDBSinglePV::interested_remove_t::iterator it(temp.begin()),
-                    end(temp.end()); it != end; ++it)
-                {
-                    self->interested.erase(static_cast<PDBSingleMonitor*>(it->get()));
+            if(self->hadevents()) {
+                if(eventsRemaining && qsrvCoalesceEvents) {
+                    // more events queued, which may be for this PV.  post once the queue is empty
+                    if(!self->pending_post) {
+                        self->pending_post = true;
+                        {
+                            Guard P(self->evctx->coalesce_lock);
+                            self->evctx->coalesced.push_back(self);
+                        }
+                        db_post_extra_labor(self->evctx->ctx);
+                    }
+                } else {
+                    pdb_single_post(*self, G, temp);
                 }
-
-                self->interested_iterating = false;
-
-                self->finalizeMonitor();
             }
         }
 
@@ -94,20 +183,49 @@ void pdb_single_event(void *user_arg, struct dbChannel *chan,
     }
 }
 
+// called from the dbEvent thread, after the event queue has been emptied
+void pdb_single_flush(void *user_arg)
+{
+    PDBEventContext *ectx = (PDBEventContext*)user_arg;
+
+    PDBEventContext::coalesced_t todo;
+    {
+        Guard G(ectx->coalesce_lock);
+        todo.swap(ectx->coalesced);
+    }
+
+    FOREACH(PDBEventContext::coalesced_t::const_iterator, it, end, todo) {
+        PDBSinglePV::shared_pointer self(it->lock());
+        if(!self)
+            continue;
+        try {
+            PDBSinglePV::interested_remove_t temp;
+            {
+                Guard G(self->lock);
+                if(self->pending_post) // not already posted by a later event
+                    pdb_single_post(*self, G, temp);
+            }
+        }catch(std::exception& e){
+            std::cerr<<"Unhandled exception in pdb_single_flush(): "<<e.what()<<"\n"
+                     <<SHOW_EXCEPTION(e)<<"\n";
+        }
+    }
+}
+
 PDBSinglePV::PDBSinglePV(DBCH& chan,
             const PDBProvider::shared_pointer& prov)
     :provider(prov)
+    ,evctx(prov->eventContext(dbChannelRecord(chan.chan)->name))
     ,builder(new ScalarBuilder(chan.chan))
     ,interested_iterating(false)
     ,evt_VALUE(this)
     ,evt_PROPERTY(this)
     ,hadevent_VALUE(false)
     ,hadevent_PROPERTY(false)
+    ,enabled_PROPERTY(false)
+    ,nproperty(0u)
+    ,pending_post(false)
 {
-    if(ellCount(&chan.chan->pre_chain) || ellCount(&chan.chan->post_chain)) {
-        DBCH temp(dbChannelName(chan.chan));
-        this->chan2.swap(temp);
-    }
     this->chan.swap(chan);
     fielddesc = std::tr1::static_pointer_cast<const pvd::Structure>(builder->dtype());
 
@@ -125,9 +243,26 @@ PDBSinglePV::~PDBSinglePV()
 
 void PDBSinglePV::activate()
 {
-    dbChannel *pchan = this->chan2.chan ? this->chan2.chan : this->chan.chan;
-    evt_VALUE.create(provider->event_context, this->chan, &pdb_single_event, DBE_VALUE|DBE_ALARM);
-    evt_PROPERTY.create(provider->event_context, pchan, &pdb_single_event, DBE_PROPERTY);
+    evt_VALUE.create(evctx->ctx, this->chan, &pdb_single_event, DBE_VALUE|DBE_ALARM);
+    // evt_PROPERTY created by enableProperty()
+}
+
+void PDBSinglePV::enableProperty()
+{
+    if(!evt_PROPERTY) {
+        if(ellCount(&chan.chan->pre_chain) || ellCount(&chan.chan->post_chain)) {
+            DBCH temp(dbChannelName(chan.chan));
+            this->chan2.swap(temp);
+        }
+        dbChannel *pchan = this->chan2.chan ? this->chan2.chan : this->chan.chan;
+        evt_PROPERTY.create(evctx->ctx, pchan, &pdb_single_event, DBE_PROPERTY);
+    }
+
+    // meta-data in 'complete' may be stale.  wait for it to be refreshed
+    hadevent_PROPERTY = false;
+    enabled_PROPERTY = true;
+    db_event_enable(evt_PROPERTY.subscript);
+    db_post_single_event(evt_PROPERTY.subscript);
 }
 
 pva::Channel::shared_pointer
@@ -146,21 +281,24 @@ PDBSinglePV::connect(const std::tr1::shared_ptr<PDBProvider>& prov,
 void PDBSinglePV::addMonitor(PDBSingleMonitor* mon)
 {
     Guard G(lock);
-    if(interested.empty() && interested_add.empty()) {
+    const bool first = interested.empty() && interested_add.empty();
+    if(first) {
         // first monitor
         // start subscription
 
         hadevent_VALUE = false;
-        hadevent_PROPERTY = false;
         db_event_enable(evt_VALUE.subscript);
-        db_event_enable(evt_PROPERTY.subscript);
         db_post_single_event(evt_VALUE.subscript);
-        db_post_single_event(evt_PROPERTY.subscript);
+    }
+
+    if(mon->wantProperty && nproperty++==0u) {
+        // first monitor wanting meta-data.  no update until it is (re)read
+        enableProperty();
 
-    } else if(hadevent_VALUE && hadevent_PROPERTY) {
+    } else if(!first && hadevents() && fanout.pending.empty()) {
         // new subscriber and already had initial update
         mon->post(G);
-    } // else new subscriber, but no initial update.  so just wait
+    } // else new subscriber, but no initial update, or one pending.  so just wait
 
     if(interested_iterating) {
         interested_add.insert(mon);
@@ -173,6 +311,11 @@ void PDBSinglePV::removeMonitor(PDBSingleMonitor* mon)
 {
     Guard G(lock);
 
+    if(mon->wantProperty && (interested_add.count(mon) || interested.count(mon))) {
+        assert(nproperty>0u);
+        nproperty--;
+    }
+
     if(interested_add.erase(mon)) {
         // and+remove while iterating.  no-op
 
@@ -192,10 +335,48 @@ void PDBSinglePV::finalizeMonitor()
 
     if(interested.empty()) {
         db_event_disable(evt_VALUE.subscript);
+    }
+    if(enabled_PROPERTY && (interested.empty() || nproperty==0u)) {
+        // no one wants meta-data.  it will be refreshed by enableProperty()
         db_event_disable(evt_PROPERTY.subscript);
+        enabled_PROPERTY = false;
     }
 }
 
+void PDBSinglePV::run()
+{
+    interested_remove_t temp;
+    Guard G(lock);
+
+    try {
+        // in order.  we stay 'queued' until done, so another worker won't run() concurrently
+        while(!fanout.pending.empty()) {
+            PDBFanout::Update update(fanout.pending.front());
+            fanout.pending.pop_front();
+
+            pdb_single_fanout(*this, G, update.changed, update.overrun, update.snapshot, temp);
+
+            if(!temp.empty()) {
+                UnGuard U(G);
+                temp.clear(); // monitors removed while iterating
+            }
+        }
+    }catch(std::exception& e){
+        std::cerr<<"Unhandled exception in PDBSinglePV::run(): "<<e.what()<<"\n"
+                 <<SHOW_EXCEPTION(e)<<"\n";
+        fanout.pending.clear();
+    }
+
+    fanout.queued = false;
+}
+
+bool PDBSinglePV::fanoutStats(PDBFanout::Stats& stats)
+{
+    Guard G(lock);
+    stats = fanout.stats;
+    return true;
+}
+
 PDBSingleChannel::PDBSingleChannel(const PDBSinglePV::shared_pointer& pv,
                                    const pva::ChannelRequester::shared_pointer& req)
     :BaseChannel(dbChannelName(pv->chan), pv->provider, req, pv->fielddesc)
@@ -439,8 +620,9 @@ void PDBSinglePut::get()
     {
         DBScanLocker L(pvif->chan);
         LocalFL FL(NULL, pvif->chan);
-        pvif->put(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
+        pvif->capture(DBE_VALUE|DBE_ALARM|DBE_PROPERTY, FL.pfl);
     }
+    pvif->apply(*changed, DBE_VALUE|DBE_ALARM|DBE_PROPERTY);
     //TODO: report unused fields as changed?
     changed->clear();
     changed->set(0);
@@ -455,6 +637,7 @@ PDBSingleMonitor::PDBSingleMonitor(const PDBSinglePV::shared_pointer& pv,
                  const pvd::PVStructure::shared_pointer& pvReq)
     :BaseMonitor(pv->lock, requester, pvReq)
     ,pv(pv)
+    ,wantProperty(requestsProperty(pvReq, pv->fielddesc))
 {
     epics::atomic::increment(num_instances);
 }
@@ -485,5 +668,8 @@ void PDBSingleMonitor::onStop()
 void PDBSingleMonitor::requestUpdate()
 {
     guard_t G(pv->lock);
-    post(G);
+    // with older updates pending for the fanout worker, .complete is ahead of them.
+    // leave the overflow to be ended by run(), which delivers in order
+    if(pv->fanout.pending.empty())
+        post(G);
 }
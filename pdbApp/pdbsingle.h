@@ -18,7 +18,12 @@
 
 struct PDBSingleMonitor;
 
-struct QSRV_API PDBSinglePV : public PDBPV
+extern int qsrvCoalesceEvents;
+
+// dbEvent extra labor.  posts events merged under qsrvCoalesceEvents.  'user_arg' is a PDBEventContext
+void pdb_single_flush(void *user_arg);
+
+struct QSRV_API PDBSinglePV : public PDBPV, public epicsThreadRunable
 {
     POINTER_DEFINITIONS(PDBSinglePV);
     weak_pointer weakself;
@@ -30,13 +35,18 @@ struct QSRV_API PDBSinglePV : public PDBPV
      * is locked.
      */
     DBCH chan;
-    // used for DBE_PROPERTY subscription when chan has filters
+    // used for DBE_PROPERTY subscription when chan has filters.
+    // opened with evt_PROPERTY
     DBCH chan2;
     PDBProvider::shared_pointer provider;
+    // handles events of all PVs of this record
+    PDBEventContext::shared_pointer evctx;
 
     // only for use in pdb_single_event()
     // which is not concurrent for VALUE/PROPERTY.
-    epics::pvData::BitSet scratch;
+    epics::pvData::BitSet scratch,
+                          overrun,     // fields changed more than once while pending_post
+                          evtchanged;  // changes of the current event, while pending_post
 
     epicsMutex lock;
 
@@ -44,6 +54,8 @@ struct QSRV_API PDBSinglePV : public PDBPV
     p2p::auto_ptr<PVIF> pvif;
 
     epics::pvData::PVStructurePtr complete; // complete copy from subscription
+    epics::pvData::PVStructurePtr snapshot; // last copy of complete shared with monitor queues
+    PDBFanout fanout;
 
     typedef std::set<PDBSingleMonitor*> interested_t;
     bool interested_iterating;
@@ -54,6 +66,13 @@ struct QSRV_API PDBSinglePV : public PDBPV
 
     DBEvent evt_VALUE, evt_PROPERTY;
     bool hadevent_VALUE, hadevent_PROPERTY;
+    // evt_PROPERTY is created on first use, and only enabled while
+    // some monitor requests meta-data fields (nproperty>0)
+    bool enabled_PROPERTY;
+    size_t nproperty;
+    // scratch holds changes not yet posted, to be merged with the next event
+    // or posted by pdb_single_flush()
+    bool pending_post;
 
     static size_t num_instances;
 
@@ -63,6 +82,13 @@ struct QSRV_API PDBSinglePV : public PDBPV
 
     void activate();
 
+    // have the events needed for a complete update
+    inline bool hadevents() const {
+        return hadevent_VALUE && (hadevent_PROPERTY || !enabled_PROPERTY);
+    }
+    // (re)start DBE_PROPERTY subscription.  caller must lock
+    void enableProperty();
+
     virtual
     epics::pvAccess::Channel::shared_pointer
         connect(const std::tr1::shared_ptr<PDBProvider>& prov,
@@ -71,6 +97,11 @@ struct QSRV_API PDBSinglePV : public PDBPV
     void addMonitor(PDBSingleMonitor*);
     void removeMonitor(PDBSingleMonitor*);
     void finalizeMonitor();
+
+    // deliver fanout.pending.  from PDBProvider::fanout_queue
+    virtual void run() OVERRIDE FINAL;
+
+    virtual bool fanoutStats(PDBFanout::Stats& stats) OVERRIDE FINAL;
 };
 
 struct PDBSingleChannel : public BaseChannel,
@@ -140,6 +171,8 @@ struct PDBSingleMonitor : public BaseMonitor
     POINTER_DEFINITIONS(PDBSingleMonitor);
 
     const PDBSinglePV::shared_pointer pv;
+    // pvRequest selects fields updated by DBE_PROPERTY
+    const bool wantProperty;
 
     static size_t num_instances;
 
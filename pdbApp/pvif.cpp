@@ -1,5 +1,13 @@
 
 
+#include <vector>
+#include <new>
+#include <stdexcept>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+
 #include <pv/pvIntrospect.h> /* for pvdVersion.h */
 #include <pv/standardField.h>
 
@@ -13,6 +21,9 @@
 #include <epicsVersion.h>
 #include <errlog.h>
 #include <osiSock.h>
+#include <epicsMutex.h>
+#include <epicsGuard.h>
+#include <epicsThread.h>
 
 #include <pv/status.h>
 #include <pv/bitSet.h>
@@ -168,6 +179,137 @@ PVIF::PVIF(dbChannel *ch)
     :chan(ch)
 {}
 
+void PVIF::put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl)
+{
+    capture(dbe, pfl);
+    apply(mask, dbe);
+}
+
+namespace {
+
+// Free array buffers, by power of 2 size class
+struct ArrayPool {
+    enum {
+        minShift = 6,  // 64 bytes
+        maxShift = 22, // 4MB.  larger buffers are not pooled
+        nclasses = maxShift-minShift+1,
+        maxFree = 16,  // per class
+        maxFreeBytes = 1u<<25, // 32MB in all classes.  beyond this buffers are free()'d
+    };
+
+    epicsMutex lock;
+    std::vector<void*> freelist[nclasses];
+    size_t freebytes; // total size of buffers in all freelist
+
+    ArrayPool() :freebytes(0u) {}
+
+    static size_t classBytes(unsigned cls) { return size_t(1u)<<(cls+minShift); }
+
+    // returns nclasses if too large
+    static unsigned sizeClass(size_t nbytes)
+    {
+        unsigned shift = minShift;
+        while(shift<=maxShift && (size_t(1u)<<shift) < nbytes)
+            shift++;
+        return shift-minShift;
+    }
+};
+
+// never free'd, as buffers may be released during process exit
+ArrayPool *arrayPool;
+epicsThreadOnceId arrayPoolOnce = EPICS_THREAD_ONCE_INIT;
+
+void arrayPoolInit(void *)
+{
+    arrayPool = new ArrayPool;
+}
+
+struct ArrayPoolFree {
+    unsigned cls;
+    explicit ArrayPoolFree(unsigned cls) :cls(cls) {}
+    void operator()(void *buf) const
+    {
+        {
+            epicsGuard<epicsMutex> G(arrayPool->lock);
+            std::vector<void*>& freelist = arrayPool->freelist[cls];
+            const size_t nbytes = ArrayPool::classBytes(cls);
+            if(freelist.size() < ArrayPool::maxFree
+                    && arrayPool->freebytes + nbytes <= ArrayPool::maxFreeBytes) {
+                freelist.push_back(buf);
+                arrayPool->freebytes += nbytes;
+                return;
+            }
+        }
+        free(buf);
+    }
+};
+
+} // namespace
+
+pvd::shared_vector<void> allocPooledArray(pvd::ScalarType etype, size_t count)
+{
+    if(etype==pvd::pvString)
+        throw std::logic_error("allocPooledArray() can't hold strings");
+
+    const size_t nbytes = count*pvd::ScalarTypeFunc::elementSize(etype);
+    const unsigned cls = ArrayPool::sizeClass(nbytes);
+
+    if(count==0u || cls>=ArrayPool::nclasses)
+        return pvd::ScalarTypeFunc::allocArray(etype, count);
+
+    epicsThreadOnce(&arrayPoolOnce, &arrayPoolInit, 0);
+
+    void *buf = 0;
+    {
+        epicsGuard<epicsMutex> G(arrayPool->lock);
+        std::vector<void*>& freelist = arrayPool->freelist[cls];
+        if(!freelist.empty()) {
+            buf = freelist.back();
+            freelist.pop_back();
+            arrayPool->freebytes -= ArrayPool::classBytes(cls);
+        }
+    }
+    if(!buf) {
+        buf = malloc(ArrayPool::classBytes(cls));
+        if(!buf)
+            throw std::bad_alloc();
+    }
+
+    pvd::shared_vector<void> ret(buf, ArrayPoolFree(cls), 0, nbytes);
+    ret.set_original_type(etype);
+    return ret;
+}
+
+void copyDBRString2PVD(const char *in, size_t width, size_t count, pvd::PVStringArray& out)
+{
+    pvd::PVStringArray::const_svector prev;
+    out.swap(prev);
+
+    // a new array while the previous value is referenced, eg. by a monitor snapshot
+    pvd::PVStringArray::svector next;
+    if(prev.unique())
+        next = pvd::thaw(prev); // no copy.  assign() below re-uses the storage of each std::string
+    next.resize(count);
+
+    for(size_t i=0; i<count; i++, in += width) {
+        size_t len = 0;
+        while(len < width-1u && in[len])
+            len++;
+        next[i].assign(in, len);
+    }
+
+    out.replace(pvd::freeze(next));
+}
+
+void copyPVDString2DBR(const std::string *in, size_t count, char *out)
+{
+    for(size_t i=0; i<count; i++, out += MAX_STRING_SIZE) {
+        size_t len = std::min(in[i].size(), size_t(MAX_STRING_SIZE-1));
+        memcpy(out, in[i].c_str(), len);
+        out[len] = '\0';
+    }
+}
+
 namespace {
 
 struct pvTimeAlarm {
@@ -414,15 +556,18 @@ void putMetaImpl(const pvTimeAlarm& pv, const META& meta)
     pv.nsec->put(nsec);    pv.sec->put(meta.time.secPastEpoch+POSIX_TIME_AT_EPICS_EPOCH);
 }
 
-void putTime(const pvTimeAlarm& pv, unsigned dbe, db_field_log *pfl)
+// caller must lock record
+void captureTime(const pvTimeAlarm& pv, metaTIME& meta, db_field_log *pfl)
 {
-    metaTIME meta;
     long options = (int)metaTIME::mask, nReq = 0;
 
     long status = dbChannelGet(pv.chan, dbChannelFinalFieldType(pv.chan), &meta, &options, &nReq, pfl);
     if(status)
         throw std::runtime_error("dbGet for meta fails");
+}
 
+void applyTime(const pvTimeAlarm& pv, unsigned dbe, const metaTIME& meta)
+{
     putMetaImpl(pv, meta);
     if(dbe&DBE_ALARM) {
         mapStatus(meta, pv.status.get(), pv.message.get());
@@ -430,19 +575,41 @@ void putTime(const pvTimeAlarm& pv, unsigned dbe, db_field_log *pfl)
     }
 }
 
-void putValue(dbChannel *chan, pvd::PVScalar* value, db_field_log *pfl)
-{
+// raw value of a scalar field, from captureValue() to applyValue()
+struct rawScalar {
     dbrbuf buf;
+};
+
+// raw value of an array field
+struct rawArray {
+    // from captureValue() until applyValue().  pooled, and sized for dbChannelFinalElements()
+    pvd::shared_vector<void> buf;
+    long nReq;
+    rawArray() :nReq(0) {}
+};
+
+template<class PVD> struct rawValue;
+template<> struct rawValue<pvd::PVScalar> { typedef rawScalar type; };
+template<> struct rawValue<pvd::PVScalarArray> { typedef rawArray type; };
+
+// caller must lock record
+void captureValue(dbChannel *chan, rawScalar& raw, pvd::PVScalar* value, db_field_log *pfl)
+{
     long nReq = 1;
 
-    long status = dbChannelGet(chan, dbChannelFinalFieldType(chan), &buf, NULL, &nReq, pfl);
+    long status = dbChannelGet(chan, dbChannelFinalFieldType(chan), &raw.buf, NULL, &nReq, pfl);
     if(status)
         throw std::runtime_error("dbGet for meta fails");
 
     if(nReq==0) {
         // this was an actual max length 1 array, which has zero elements now.
-        memset(&buf, 0, sizeof(buf));
+        memset(&raw.buf, 0, sizeof(raw.buf));
     }
+}
+
+void applyValue(dbChannel *chan, rawScalar& raw, pvd::PVScalar* value)
+{
+    dbrbuf& buf = raw.buf;
 
     switch(dbChannelFinalFieldType(chan)) {
 #define CASE(BASETYPE, PVATYPE, DBFTYPE, PVACODE) case DBR_##DBFTYPE: value->putFrom<PVATYPE>(buf.dbf_##DBFTYPE); break;
@@ -457,11 +624,11 @@ void putValue(dbChannel *chan, pvd::PVScalar* value, db_field_log *pfl)
         value->putFrom<std::string>(buf.dbf_STRING);
         break;
     default:
-        throw std::runtime_error("putValue unsupported DBR code");
+        throw std::runtime_error("applyValue unsupported DBR code");
     }
 }
 
-void getValue(dbChannel *chan, pvd::PVScalar* value)
+void getValue(dbChannel *chan, rawScalar&, pvd::PVScalar* value)
 {
     dbrbuf buf;
 
@@ -489,7 +656,7 @@ void getValue(dbChannel *chan, pvd::PVScalar* value)
         throw std::runtime_error("dbPut for meta fails");
 }
 
-void getValue(dbChannel *chan, pvd::PVScalarArray* value)
+void getValue(dbChannel *chan, rawArray& raw, pvd::PVScalarArray* value)
 {
     short dbr = dbChannelFinalFieldType(chan);
 
@@ -508,66 +675,87 @@ void getValue(dbChannel *chan, pvd::PVScalarArray* value)
 
         value->getAs(buf);
 
-        std::vector<char> temp(buf.size()*MAX_STRING_SIZE);
-
-        for(size_t i=0, N=buf.size(); i<N; i++)
-        {
-            strncpy(&temp[i*MAX_STRING_SIZE], buf[i].c_str(), MAX_STRING_SIZE-1);
-            temp[i*MAX_STRING_SIZE + MAX_STRING_SIZE-1] = '\0';
-        }
+        pvd::shared_vector<void> strs(allocPooledArray(pvd::pvByte, std::max(size_t(1u), buf.size())*MAX_STRING_SIZE));
+        copyPVDString2DBR(buf.data(), buf.size(), (char*)strs.data());
 
-        long status = dbChannelPut(chan, dbr, &temp[0], buf.size());
+        long status = dbChannelPut(chan, dbr, strs.data(), buf.size());
         if(status)
             throw std::runtime_error("dbChannelPut fails");
     }
 }
 
-void putValue(dbChannel *chan, pvd::PVScalarArray* value, db_field_log *pfl)
+// caller must lock record
+void captureValue(dbChannel *chan, rawArray& raw, pvd::PVScalarArray* value, db_field_log *pfl)
 {
     const short dbr = dbChannelFinalFieldType(chan);
 
-    long nReq = dbChannelFinalElements(chan);
+    raw.nReq = dbChannelFinalElements(chan);
     const pvd::ScalarType etype = value->getScalarArray()->getElementType();
 
-    if(dbr!=DBR_STRING) {
-
-        pvd::shared_vector<void> buf(pvd::ScalarTypeFunc::allocArray(etype, nReq)); // TODO: pool?
+    // read directly into storage which applyValue() hands over, or releases
+    if(dbr!=DBR_STRING)
+        raw.buf = allocPooledArray(etype, raw.nReq);
+    else
+        raw.buf = allocPooledArray(pvd::pvByte, raw.nReq*MAX_STRING_SIZE);
 
-        long status = dbChannelGet(chan, dbr, buf.data(), NULL, &nReq, pfl);
-        if(status)
-            throw std::runtime_error("dbChannelGet for value fails");
+    long status = dbChannelGet(chan, dbr, raw.buf.data(), NULL, &raw.nReq, pfl);
+    if(status)
+        throw std::runtime_error("dbChannelGet for value fails");
+}
 
-        buf.slice(0, nReq*pvd::ScalarTypeFunc::elementSize(etype));
+void applyValue(dbChannel *chan, rawArray& raw, pvd::PVScalarArray* value)
+{
+    const short dbr = dbChannelFinalFieldType(chan);
+    const pvd::ScalarType etype = value->getScalarArray()->getElementType();
 
-        value->putFrom(pvd::freeze(buf));
+    // nothing is kept between updates
+    pvd::shared_vector<void> buf;
+    buf.swap(raw.buf);
 
-    } else {
-        std::vector<char> temp(nReq*MAX_STRING_SIZE);
+    if(dbr!=DBR_STRING) {
+        // hand over the storage read into, trimmed to the elements read.  no copy
+        buf.slice(0, raw.nReq*pvd::ScalarTypeFunc::elementSize(etype));
 
-        long status = dbChannelGet(chan, dbr, &temp[0], NULL, &nReq, pfl);
-        if(status)
-            throw std::runtime_error("dbChannelGet for value fails");
+        value->putFrom(pvd::freeze(buf));
 
-        pvd::shared_vector<std::string> buf(nReq);
-        for(long i=0; i<nReq; i++) {
-            temp[i*MAX_STRING_SIZE + MAX_STRING_SIZE-1] = '\0';
-            buf[i] = std::string(&temp[i*MAX_STRING_SIZE]);
-        }
+    } else if(etype==pvd::pvString) {
+        copyDBRString2PVD((const char*)buf.data(), MAX_STRING_SIZE, raw.nReq,
+                          *static_cast<pvd::PVStringArray*>(value));
 
-        value->putFrom(pvd::freeze(buf));
+    } else {
+        throw std::logic_error("applyValue DBR_STRING into non-string array");
     }
 }
+
+// raw meta-data, from captureMeta() to applyMeta()
 template<typename META>
-void putMeta(const pvCommon& pv, unsigned dbe, db_field_log *pfl)
-{
+struct rawMeta {
     META meta;
+    char desc[sizeof(((dbCommon*)0)->desc)];
+};
+
+// caller must lock record
+template<typename META>
+void captureMeta(const pvCommon& pv, unsigned dbe, rawMeta<META>& raw, db_field_log *pfl)
+{
     long options = (int)META::mask, nReq = 0;
     dbCommon *prec = dbChannelRecord(pv.chan);
 
-    long status = dbChannelGet(pv.chan, dbChannelFinalFieldType(pv.chan), &meta, &options, &nReq, pfl);
+    long status = dbChannelGet(pv.chan, dbChannelFinalFieldType(pv.chan), &raw.meta, &options, &nReq, pfl);
     if(status)
         throw std::runtime_error("dbGet for meta fails");
 
+    if(dbe&DBE_PROPERTY && pv.desc) {
+        strncpy(raw.desc, prec->desc, sizeof(raw.desc));
+        raw.desc[sizeof(raw.desc)-1] = '\0';
+    }
+}
+
+template<typename META>
+void applyMeta(const pvCommon& pv, unsigned dbe, rawMeta<META>& raw)
+{
+    META& meta = raw.meta;
+
     putMetaImpl(pv, meta);
 #define FMAP(MNAME, FNAME) pv.MNAME->put(meta.FNAME)
     if(dbe&DBE_ALARM) {
@@ -576,7 +764,7 @@ void putMeta(const pvCommon& pv, unsigned dbe, db_field_log *pfl)
     }
     if(dbe&DBE_PROPERTY) {
 #undef FMAP
-        if(pv.desc) pv.desc->put(prec->desc);
+        if(pv.desc) pv.desc->put(raw.desc);
 #define FMAP(MASK, MNAME, FNAME) if(META::mask&(MASK) && pv.MNAME) pv.MNAME->put(meta.FNAME)
         FMAP(DBR_GR_DOUBLE, displayHigh, upper_disp_limit);
         FMAP(DBR_GR_DOUBLE, displayLow, lower_disp_limit);
@@ -596,27 +784,42 @@ void putMeta(const pvCommon& pv, unsigned dbe, db_field_log *pfl)
         FMAP(DBR_AL_DOUBLE, alarmLow,  lower_alarm_limit);
 #undef FMAP
         if(pv.enumopts) {
-            pvd::shared_vector<std::string> strs(meta.no_str);
-            for(size_t i=0; i<strs.size(); i++)
-            {
-                meta.strs[i][sizeof(meta.strs[i])-1] = '\0';
-                strs[i] = meta.strs[i];
-            }
-            pv.enumopts->replace(pvd::freeze(strs));
+            copyDBRString2PVD(meta.strs[0], sizeof(meta.strs[0]), meta.no_str, *pv.enumopts);
         }
     }
 }
 
 template<typename PVC, typename META>
-void putAll(const PVC &pv, unsigned dbe, db_field_log *pfl)
+struct rawAll {
+    typename rawValue<typename PVC::pvd_type>::type value;
+    metaTIME time;
+    rawMeta<META> meta;
+};
+
+// caller must lock record
+template<typename PVC, typename META>
+void captureAll(const PVC &pv, unsigned dbe, rawAll<PVC, META>& raw, db_field_log *pfl)
+{
+    if(dbe&(DBE_VALUE|DBE_ARCHIVE)) {
+        captureValue(pv.chan, raw.value, pv.value.get(), pfl);
+    }
+    if(!(dbe&DBE_PROPERTY)) {
+        captureTime(pv, raw.time, pfl);
+    } else {
+        captureMeta<META>(pv, dbe, raw.meta, pfl);
+    }
+}
+
+template<typename PVC, typename META>
+void applyAll(const PVC &pv, unsigned dbe, rawAll<PVC, META>& raw)
 {
     if(dbe&(DBE_VALUE|DBE_ARCHIVE)) {
-        putValue(pv.chan, pv.value.get(), pfl);
+        applyValue(pv.chan, raw.value, pv.value.get());
     }
     if(!(dbe&DBE_PROPERTY)) {
-        putTime(pv, dbe, pfl);
+        applyTime(pv, dbe, raw.time);
     } else {
-        putMeta<META>(pv, dbe, pfl);
+        applyMeta<META>(pv, dbe, raw.meta);
     }
 }
 
@@ -680,6 +883,7 @@ struct PVIFScalarNumeric : public PVIF
 {
     PVX pvmeta;
     const epics::pvData::PVStructurePtr pvalue;
+    rawAll<PVX, META> raw;
 
     PVIFScalarNumeric(dbChannel *ch, const epics::pvData::PVFieldPtr& p, pvd::PVField *enclosing)
         :PVIF(ch)
@@ -711,10 +915,20 @@ struct PVIFScalarNumeric : public PVIF
     }
     virtual ~PVIFScalarNumeric() {}
 
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    virtual void capture(unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
     {
         try{
-            putAll<PVX, META>(pvmeta, dbe, pfl);
+            captureAll<PVX, META>(pvmeta, dbe, raw, pfl);
+        }catch(...){
+            pvmeta.severity->put(3);
+            throw;
+        }
+    }
+
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) OVERRIDE FINAL
+    {
+        try{
+            applyAll<PVX, META>(pvmeta, dbe, raw);
             mask |= pvmeta.maskALWAYS;
             if(dbe&(DBE_VALUE|DBE_ARCHIVE))
                 mask |= pvmeta.maskVALUE;
@@ -738,7 +952,7 @@ struct PVIFScalarNumeric : public PVIF
         bool newval = mask.logical_and(pvmeta.maskVALUEPut);
         if(newval) {
             if(permit)
-                getValue(pvmeta.chan, pvmeta.value.get());
+                getValue(pvmeta.chan, raw.value, pvmeta.value.get());
             else
                 ret = pvd::Status::error("Put not permitted");
         }
@@ -929,6 +1143,7 @@ struct PVIFPlain : public PVIF
     const typename PVD::shared_pointer field;
     size_t fieldOffset;
     dbChannel * const channel;
+    typename rawValue<PVD>::type raw;
 
     PVIFPlain(dbChannel *channel, const epics::pvData::PVFieldPtr& fld, epics::pvData::PVField* enclosing=0)
         :PVIF(channel)
@@ -945,10 +1160,16 @@ struct PVIFPlain : public PVIF
 
     virtual ~PVIFPlain() {}
 
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    virtual void capture(unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    {
+        if(dbe&DBE_VALUE)
+            captureValue(channel, raw, field.get(), pfl);
+    }
+
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) OVERRIDE FINAL
     {
         if(dbe&DBE_VALUE) {
-            putValue(channel, field.get(), pfl);
+            applyValue(channel, raw, field.get());
             mask.set(fieldOffset);
         }
     }
@@ -962,7 +1183,7 @@ struct PVIFPlain : public PVIF
         bool newval = mask.get(fieldOffset);
         if(newval) {
             if(permit)
-                getValue(channel, field.get());
+                getValue(channel, raw, field.get());
             else
                 ret = pvd::Status::error("Put not permitted");
         }
@@ -1080,6 +1301,7 @@ struct AnyScalarBuilder : public PVIFBuilder
 struct PVIFMeta : public PVIF
 {
     pvTimeAlarm meta;
+    metaTIME raw;
 
     PVIFMeta(dbChannel *channel, const epics::pvData::PVFieldPtr& fld, epics::pvData::PVField* enclosing=0)
         :PVIF(channel)
@@ -1102,13 +1324,18 @@ struct PVIFMeta : public PVIF
 
     virtual ~PVIFMeta() {}
 
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    virtual void capture(unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    {
+        captureTime(meta, raw, pfl);
+    }
+
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) OVERRIDE FINAL
     {
         mask |= meta.maskALWAYS;
         if(dbe&DBE_ALARM)
             mask |= meta.maskALARM;
 
-        putTime(meta, dbe, pfl);
+        applyTime(meta, dbe, raw);
     }
 
     virtual pvd::Status get(const epics::pvData::BitSet& mask, proc_t proc, bool permit) OVERRIDE FINAL
@@ -1173,11 +1400,14 @@ struct PVIFProc : public PVIF
 {
     PVIFProc(dbChannel *channel) :PVIF(channel) {}
 
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    virtual void capture(unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
     {
         // nothing to get
     }
 
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) OVERRIDE FINAL
+    {}
+
     virtual pvd::Status get(const epics::pvData::BitSet& mask, proc_t proc, bool permit) OVERRIDE FINAL
     {
         // always process (if permitted)
@@ -1220,7 +1450,10 @@ struct PVIFNoOp : public PVIF
 {
     PVIFNoOp(dbChannel *channel) :PVIF(channel) {}
 
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    virtual void capture(unsigned dbe, db_field_log *pfl) OVERRIDE FINAL
+    {}
+
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) OVERRIDE FINAL
     {}
 
     virtual pvd::Status get(const epics::pvData::BitSet& mask, proc_t proc, bool permit) OVERRIDE FINAL
@@ -58,6 +58,24 @@ long copyDBF2PVD(const epics::pvData::shared_vector<const void>& buf,
                  epics::pvData::BitSet &changed,
                  const epics::pvData::PVStringArray::const_svector& choices);
 
+/** Copy 'count' NIL terminated strings, each in a fixed width entry (eg. MAX_STRING_SIZE), into 'out'.
+ *  Re-uses the storage of the current value of 'out' when it is not shared,
+ *  otherwise each string is copied into a new array.
+ */
+QSRV_API
+void copyDBRString2PVD(const char *in, size_t width, size_t count,
+                       epics::pvData::PVStringArray& out);
+//! Copy 'count' strings into MAX_STRING_SIZE entries, truncating if necessary
+QSRV_API
+void copyPVDString2DBR(const std::string *in, size_t count, char *out);
+
+/** Allocate an array of 'count' elements, which may not be pvString.
+ *  Storage is taken from, and returned to, a pool of buffers in power of 2 sizes.
+ *  Only buffers up to 4MB are pooled, and at most 32MB in total are kept free.
+ */
+QSRV_API
+epics::pvData::shared_vector<void> allocPooledArray(epics::pvData::ScalarType etype, size_t count);
+
 union dbrbuf {
         epicsInt8		dbf_CHAR;
         epicsUInt8		dbf_UCHAR;
@@ -375,8 +393,14 @@ struct QSRV_API PVIF {
     };
 
     //! Copy from PDB record to pvalue (call dbChannelGet())
+    //! caller must lock record.  Same as capture() then apply()
+    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl);
+    //! Copy from PDB record to an internal buffer (call dbChannelGet())
     //! caller must lock record
-    virtual void put(epics::pvData::BitSet& mask, unsigned dbe, db_field_log *pfl) =0;
+    virtual void capture(unsigned dbe, db_field_log *pfl) =0;
+    //! Copy from internal buffer to pvalue, with the same 'dbe' as the preceding capture().
+    //! record need not be locked
+    virtual void apply(epics::pvData::BitSet& mask, unsigned dbe) =0;
     //! May copy from pvalue to PDB record (call dbChannelPut())
     //! caller must lock record
     virtual epics::pvData::Status get(const epics::pvData::BitSet& mask, proc_t proc=ProcInhibit, bool permit=true) =0;
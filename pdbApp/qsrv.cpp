@@ -1,4 +1,8 @@
 
+#include <algorithm>
+#include <vector>
+#include <string>
+
 #include <initHooks.h>
 #include <epicsExit.h>
 #include <epicsThread.h>
@@ -124,12 +128,91 @@ void dbgl(int lvl, const char *pattern)
     }
 }
 
+struct FanoutEntry {
+    std::string name;
+    PDBFanout::Stats stats;
+    bool operator<(const FanoutEntry& o) const { return stats.total > o.stats.total; }
+};
+
+void qsrvFanoutReport(int count, const char *pattern)
+{
+    if(!pattern)
+        pattern = "";
+
+    try {
+        PDBProvider::shared_pointer prov(
+                    std::tr1::dynamic_pointer_cast<PDBProvider>(
+                        pva::ChannelProviderRegistry::servers()->getProvider("QSRV")));
+        if(!prov)
+            throw std::runtime_error("No Provider (PVA server not running?)");
+
+        PDBProvider::persist_pv_map_t pvs;
+        PDBProvider::transient_pv_map_t::lock_vector_type transient(prov->transient_pv_map.lock_vector());
+        {
+            epicsGuard<epicsMutex> G(prov->transient_pv_map.mutex());
+            pvs = prov->persist_pv_map; // copy map
+        }
+        for(size_t i=0; i<transient.size(); i++)
+            pvs[transient[i].first] = transient[i].second;
+
+        std::vector<FanoutEntry> entries;
+        entries.reserve(pvs.size());
+
+        for(PDBProvider::persist_pv_map_t::const_iterator it(pvs.begin()), end(pvs.end());
+            it != end; ++it)
+        {
+            if(pattern[0] && epicsStrGlobMatch(it->first.c_str(), pattern)==0)
+                continue;
+
+            FanoutEntry ent;
+            ent.name = it->first;
+            if(it->second->fanoutStats(ent.stats) && ent.stats.count)
+                entries.push_back(ent);
+        }
+
+        // busiest first
+        std::sort(entries.begin(), entries.end());
+        if(count>0 && entries.size()>size_t(count))
+            entries.resize(count);
+
+        printf("%-40s %10s %10s %10s %10s\n", "PV", "updates", "total(s)", "avg(us)", "max(us)");
+        for(size_t i=0; i<entries.size(); i++) {
+            const PDBFanout::Stats& S = entries[i].stats;
+            printf("%-40s %10zu %10.3f %10.1f %10.1f\n", entries[i].name.c_str(),
+                   S.count, S.total, S.total/S.count*1e6, S.max*1e6);
+        }
+
+    }catch(std::exception& e){
+        fprintf(stderr, "Error: %s\n", e.what());
+    }
+}
+
+void qsrvList(const char *prefix)
+{
+    try {
+        PDBProvider::shared_pointer prov(
+                    std::tr1::dynamic_pointer_cast<PDBProvider>(
+                        pva::ChannelProviderRegistry::servers()->getProvider("QSRV")));
+        if(!prov)
+            throw std::runtime_error("No Provider (PVA server not running?)");
+
+        epics::pvData::shared_vector<const std::string> names(prov->channelNames(prefix ? prefix : ""));
+        for(size_t i=0; i<names.size(); i++)
+            printf("%s\n", names[i].c_str());
+
+    }catch(std::exception& e){
+        fprintf(stderr, "Error: %s\n", e.what());
+    }
+}
+
 void QSRVRegistrar()
 {
     QSRVRegistrar_counters();
     pva::ChannelProviderRegistry::servers()->addSingleton<PDBProvider>("QSRV");
     epics::iocshRegister<int, const char*, &dbgl>("dbgl", "level", "pattern");
     epics::iocshRegister<const char*, &dbLoadGroupWrap>("dbLoadGroup", "jsonfile");
+    epics::iocshRegister<int, const char*, &qsrvFanoutReport>("qsrvFanoutReport", "count", "pattern");
+    epics::iocshRegister<const char*, &qsrvList>("qsrvList", "prefix");
 }
 
 } // namespace
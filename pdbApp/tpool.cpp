@@ -110,6 +110,12 @@ void WorkQueue::run()
 
         bool last = queue.empty();
 
+        if(!last) {
+            // add() only signals when the queue was empty.
+            // pass along to another idle worker, which would otherwise wait behind this work
+            wakeup.signal();
+        }
+
         {
             UnGuard U(G);
 
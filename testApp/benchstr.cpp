@@ -0,0 +1,242 @@
+/* Cost of converting between DBR_STRING buffers and PVData strings.
+ *
+ * Covers string waveforms in both directions, and the enum-as-string
+ * and number-as-string cases of a link put to a DBF_STRING field.
+ * The string waveform cases are also run with a per-element
+ * allocation of the conversion ("naive") for reference.
+ * The dbr->pvd cases keep a reference to the previous array,
+ * as a monitor snapshot does.
+ *
+ * Usage: benchstr [seconds per case]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+
+#include <dbDefs.h>
+#include <dbStaticLib.h>
+#include <epicsTime.h>
+#include <epicsStdlib.h>
+
+#include <pv/epicsException.h>
+#include <pv/valueBuilder.h>
+#include <pv/pvData.h>
+
+#include "pvif.h"
+#include "countalloc.h"
+
+namespace pvd = epics::pvData;
+
+namespace {
+
+struct Case {
+    const char *name;
+    size_t nelem;  // elements converted per iteration
+    size_t slen;   // length of each string
+
+    Case(const char *name, size_t nelem, size_t slen) :name(name), nelem(nelem), slen(slen) {}
+    virtual ~Case() {}
+    virtual void once() =0;
+};
+
+// DBR_STRING waveform -> PVStringArray
+struct DBR2PVD : public Case {
+    const bool naive;
+    std::vector<char> dbr;
+    pvd::PVStringArrayPtr value;
+    pvd::PVStringArray::const_svector snapshot; // previous value, as held by monitor queues
+
+    DBR2PVD(size_t nelem, size_t slen, bool naive)
+        :Case(naive ? "dbr->pvd naive" : "dbr->pvd", nelem, slen)
+        ,naive(naive)
+        ,dbr(nelem*MAX_STRING_SIZE)
+        ,value(pvd::getPVDataCreate()->createPVScalarArray<pvd::PVStringArray>())
+    {
+        for(size_t i=0; i<nelem; i++)
+            memset(&dbr[i*MAX_STRING_SIZE], char('a'+(i%26u)), slen);
+    }
+    virtual ~DBR2PVD() {}
+
+    virtual void once()
+    {
+        if(naive) {
+            pvd::shared_vector<std::string> buf(nelem);
+            for(size_t i=0; i<nelem; i++)
+                buf[i] = std::string(&dbr[i*MAX_STRING_SIZE]);
+            value->replace(pvd::freeze(buf));
+        } else {
+            copyDBRString2PVD(&dbr[0], MAX_STRING_SIZE, nelem, *value);
+        }
+        snapshot = value->view();
+    }
+};
+
+// PVStringArray -> DBR_STRING waveform
+struct PVD2DBR : public Case {
+    const bool naive;
+    pvd::PVStringArray::const_svector value;
+    std::vector<char> dbr;
+
+    PVD2DBR(size_t nelem, size_t slen, bool naive)
+        :Case(naive ? "pvd->dbr naive" : "pvd->dbr", nelem, slen)
+        ,naive(naive)
+        ,dbr(nelem*MAX_STRING_SIZE)
+    {
+        pvd::PVStringArray::svector buf(nelem);
+        for(size_t i=0; i<nelem; i++)
+            buf[i] = std::string(slen, char('a'+(i%26u)));
+        value = pvd::freeze(buf);
+    }
+    virtual ~PVD2DBR() {}
+
+    virtual void once()
+    {
+        if(naive) {
+            std::vector<char> temp(nelem*MAX_STRING_SIZE);
+            for(size_t i=0; i<nelem; i++) {
+                strncpy(&temp[i*MAX_STRING_SIZE], value[i].c_str(), MAX_STRING_SIZE-1);
+                temp[i*MAX_STRING_SIZE + MAX_STRING_SIZE-1] = '\0';
+            }
+            memcpy(&dbr[0], &temp[0], temp.size());
+        } else {
+            copyPVDString2DBR(value.data(), nelem, &dbr[0]);
+        }
+    }
+};
+
+// NTEnum -> DBF_STRING, as by a link put
+struct Enum2DBF : public Case {
+    pvd::PVStructurePtr top;
+    pvd::PVFieldPtr value;
+    char dbr[MAX_STRING_SIZE];
+
+    explicit Enum2DBF(size_t slen)
+        :Case("enum->str", 1u, slen)
+    {
+        pvd::shared_vector<std::string> choices(16);
+        for(size_t i=0; i<choices.size(); i++)
+            choices[i] = std::string(slen, char('a'+i));
+        top = pvd::ValueBuilder()
+                .addNested("value")
+                    .add<pvd::pvInt>("index", 5)
+                    .add("choices", pvd::static_shared_vector_cast<const void>(pvd::freeze(choices)))
+                .endNested()
+                .buildPVStructure();
+        value = top->getSubFieldT("value");
+    }
+    virtual ~Enum2DBF() {}
+
+    virtual void once()
+    {
+        copyPVD2DBF(value, dbr, DBF_STRING, NULL);
+    }
+};
+
+// double[] -> DBF_STRING[], as by a link put
+struct Num2DBF : public Case {
+    pvd::PVStructurePtr top;
+    pvd::PVFieldPtr value;
+    std::vector<char> dbr;
+
+    explicit Num2DBF(size_t nelem)
+        :Case("num[]->str", nelem, 0u)
+        ,dbr(nelem*MAX_STRING_SIZE)
+    {
+        pvd::shared_vector<double> arr(nelem);
+        for(size_t i=0; i<nelem; i++)
+            arr[i] = i*0.25;
+        top = pvd::ValueBuilder()
+                .add("value", pvd::static_shared_vector_cast<const void>(pvd::freeze(arr)))
+                .buildPVStructure();
+        value = top->getSubFieldT("value");
+    }
+    virtual ~Num2DBF() {}
+
+    virtual void once()
+    {
+        long nreq = nelem;
+        copyPVD2DBF(value, &dbr[0], DBF_STRING, &nreq);
+    }
+};
+
+void run(Case& C, double seconds)
+{
+    C.once(); // warm up, and first allocation of re-used storage (eg. DBR buffers)
+
+    const size_t allocs0 = countAllocs();
+    const epicsUInt64 start = epicsMonotonicGet(),
+                      end = start + epicsUInt64(seconds*1e9);
+    epicsUInt64 now;
+    size_t niter = 0u;
+
+    do {
+        for(size_t i=0; i<100u; i++)
+            C.once();
+        niter += 100u;
+        now = epicsMonotonicGet();
+    } while(now<end);
+
+    const double elapsed = (now-start)*1e-9;
+    const size_t nallocated = countAllocs()-allocs0;
+
+    printf("%-15s %6u %5u %12.0f %10.1f %10.2f\n",
+           C.name, (unsigned)C.nelem, (unsigned)C.slen,
+           niter/elapsed,
+           elapsed*1e9/(niter*C.nelem),
+           double(nallocated)/niter);
+    fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    try {
+        double seconds = 1.0;
+        if(argc>1 && (epicsParseDouble(argv[1], &seconds, 0) || seconds<=0.0)) {
+            fprintf(stderr, "Usage: %s [seconds per case]\n", argv[0]);
+            return 1;
+        }
+
+        static const size_t nelems[] = {1, 1000};
+        static const size_t slens[] = {8, 30}; // within, and beyond, small string optimization
+
+        printf("%-15s %6s %5s %12s %10s %10s\n",
+               "case", "elems", "len", "iter/s", "ns/elem", "allocs/it");
+
+        for(size_t a=0; a<NELEMENTS(nelems); a++)
+        for(size_t b=0; b<NELEMENTS(slens); b++)
+        for(int naive=1; naive>=0; naive--)
+        {
+            {
+                DBR2PVD C(nelems[a], slens[b], naive);
+                run(C, seconds);
+            }
+            {
+                PVD2DBR C(nelems[a], slens[b], naive);
+                run(C, seconds);
+            }
+        }
+
+        for(size_t b=0; b<NELEMENTS(slens); b++)
+        {
+            Enum2DBF C(slens[b]);
+            run(C, seconds);
+        }
+
+        for(size_t a=0; a<NELEMENTS(nelems); a++)
+        {
+            Num2DBF C(nelems[a]);
+            run(C, seconds);
+        }
+
+        return 0;
+    }catch(std::exception&e){
+        PRINT_EXCEPTION(e);
+        std::cerr<<"Error: "<<e.what()<<"\n";
+        return 1;
+    }
+}
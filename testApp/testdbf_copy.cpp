@@ -119,6 +119,59 @@ void testPVD2DBR_array()
     }
 }
 
+void testPVD2DBR_strings()
+{
+    testDiag("testPVD2DBR_strings()");
+
+    pvd::shared_vector<std::string> strs(3);
+    strs[0] = "one";
+    strs[1] = std::string(MAX_STRING_SIZE+5, 'x'); // truncated
+    strs[2] = "";
+
+    pvd::PVStructure::shared_pointer top(pvd::ValueBuilder()
+                                         .add("value", pvd::static_shared_vector_cast<const void>(pvd::freeze(strs)))
+                                         .buildPVStructure());
+
+    char sarr[MAX_STRING_SIZE*5];
+
+    {
+        long nreq = 5;
+        copyPVD2DBF(top->getSubFieldT("value"), sarr, DBF_STRING, &nreq);
+        testEqual(nreq, 3);
+    }
+
+    testEqual(std::string(&sarr[0*MAX_STRING_SIZE]), "one");
+    testEqual(std::string(&sarr[1*MAX_STRING_SIZE]), std::string(MAX_STRING_SIZE-1, 'x'));
+    testEqual(std::string(&sarr[2*MAX_STRING_SIZE]), "");
+
+    // and back.  Storage of the previous value is re-used as it isn't shared
+    pvd::PVStringArrayPtr value(top->getSubFieldT<pvd::PVStringArray>("value"));
+    const std::string *prev = value->view().data();
+
+    copyDBRString2PVD(sarr, MAX_STRING_SIZE, 2, *value);
+    {
+        pvd::PVStringArray::const_svector out(value->view());
+        testEqual(out.size(), 2u);
+        testEqual(out[0], "one");
+        testEqual(out[1], std::string(MAX_STRING_SIZE-1, 'x'));
+        testOk1(out.data()==prev);
+    }
+
+    // entries which fill their width are truncated.
+    // a new array as the previous value is shared, as by a monitor snapshot
+    pvd::PVStringArray::const_svector held(value->view());
+    const char fixed[2][4] = {{'a', 'b', 'c', 'd'}, {'x', '\0', 'y', 'z'}};
+    copyDBRString2PVD(fixed[0], sizeof(fixed[0]), 2, *value);
+    {
+        pvd::PVStringArray::const_svector out(value->view());
+        testEqual(out.size(), 2u);
+        testEqual(out[0], "abc");
+        testEqual(out[1], "x");
+        testOk1(out.data()!=held.data());
+        testEqual(held[0], "one");
+    }
+}
+
 template<typename input_t, typename output_t>
 void testDBR2PVD_scalar(const input_t& input,
                         const output_t& expect)
@@ -230,7 +283,7 @@ void testDBR2PVD_array()
 
 MAIN(testdbf_copy)
 {
-    testPlan(53);
+    testPlan(66);
     try{
         testPVD2DBR_scalar<pvd::pvDouble, double>(DBF_DOUBLE, 42.2, 42.2);
         testPVD2DBR_scalar<pvd::pvDouble, pvd::uint16>(DBF_USHORT, 42.2, 42u);
@@ -252,6 +305,7 @@ MAIN(testdbf_copy)
         testPVD2DBR_enum();
 
         testPVD2DBR_array();
+        testPVD2DBR_strings();
 
         testDBR2PVD_scalar<double, double>(42.2, 42.2);
         testDBR2PVD_scalar<pvd::uint16, double>(42u, 42.0);
@@ -1,13 +1,18 @@
 
+#include <vector>
+
 #include <testMain.h>
 
 #include <iocsh.h>
 #include <epicsAtomic.h>
 #include <dbAccess.h>
+#include <dbCommon.h>
+#include <epicsThread.h>
 #include <pva/client.h>
 
 #include <pv/reftrack.h>
 #include <pv/epicsException.h>
+#include <pv/createRequest.h>
 
 #include "utilities.h"
 #include "pvif.h"
@@ -179,6 +184,308 @@ void testSingleMonitor(pvac::ClientProvider& client)
     testOk1(!mon.poll());
 }
 
+void testSingleMonitorShared(pvac::ClientProvider& client)
+{
+    testDiag("test single monitor w/ two subscribers");
+
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 2.0);
+
+    pvac::MonitorSync monA(client.connect("rec1").monitor());
+    pvac::MonitorSync monB(client.connect("rec1").monitor());
+
+    testOk1(monA.wait(3.0) && monA.poll());
+    testOk1(monB.wait(3.0) && monB.poll());
+    testFieldEqual<pvd::PVDouble>(monA.root, "value", 2.0);
+    testFieldEqual<pvd::PVDouble>(monB.root, "value", 2.0);
+
+    testDiag("queue two updates for each subscriber");
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 3.0);
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 4.0);
+
+    testOk1(monA.wait(3.0) && monA.poll());
+    testFieldEqual<pvd::PVDouble>(monA.root, "value", 3.0);
+    testOk1(monA.poll());
+    testFieldEqual<pvd::PVDouble>(monA.root, "value", 4.0);
+
+    testOk1(monB.wait(3.0) && monB.poll());
+    testFieldEqual<pvd::PVDouble>(monB.root, "value", 3.0);
+    testOk1(monB.poll());
+    testFieldEqual<pvd::PVDouble>(monB.root, "value", 4.0);
+
+    testOk1(!monA.poll());
+    testOk1(!monB.poll());
+}
+
+void testSingleMonitorCoalesce(pvac::ClientProvider& client)
+{
+    testDiag("test single monitor w/ qsrvCoalesceEvents");
+
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 2.0);
+
+    pvac::MonitorSync mon(client.connect("rec2").monitor());
+
+    testOk1(mon.wait(3.0) && mon.poll());
+    testFieldEqual<pvd::PVDouble>(mon.root, "value", 2.0);
+    testOk1(!mon.poll());
+
+    qsrvCoalesceEvents = 1;
+
+    testDiag("queue three events while the dbEvent thread waits for the record lock");
+    dbCommon *prec = testdbRecordPtr("rec2");
+    dbScanLock(prec);
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 3.0);
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 4.0);
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 5.0);
+    dbScanUnlock(prec);
+
+    // the first event may be posted alone, if seen before the others were queued.
+    // the rest are merged into one update
+    size_t nupdates = 0u;
+    double value = 0.0;
+    while(value!=5.0 && mon.wait(3.0)) {
+        while(mon.poll()) {
+            nupdates++;
+            value = mon.root->getSubFieldT<pvd::PVDouble>("value")->get();
+        }
+    }
+
+    qsrvCoalesceEvents = 0;
+
+    testEqual(value, 5.0);
+    testOk(nupdates<3u, "%u updates for 3 events", unsigned(nupdates));
+    const size_t valoff = mon.root->getSubFieldT("value")->getFieldOffset();
+    testOk1(mon.changed.get(valoff));
+    testOk1(mon.overrun.get(valoff));
+
+    testOk1(!mon.poll());
+}
+
+void testSingleMonitorLazy(pvac::ClientProvider& client, const PDBProvider::shared_pointer& prov)
+{
+    testDiag("test single monitor w/o DBE_PROPERTY until requested");
+
+    testdbPutFieldOk("rec3", DBR_DOUBLE, 3.0);
+
+    pvac::MonitorSync monV(client.connect("rec3").monitor(pvd::createRequest("field(value)")));
+
+    testOk1(monV.wait(3.0) && monV.poll());
+    testFieldEqual<pvd::PVDouble>(monV.root, "value", 3.0);
+
+    PDBSinglePV::shared_pointer pv(std::tr1::static_pointer_cast<PDBSinglePV>(prov->transient_pv_map.find("rec3")));
+    if(!pv)
+        testAbort("rec3 not open");
+    {
+        epicsGuard<epicsMutex> G(pv->lock);
+        testOk(!pv->evt_PROPERTY, "No DBE_PROPERTY subscription");
+    }
+
+    testDiag("change meta-data while not subscribed");
+    testdbPutFieldOk("rec3.HOPR", DBR_DOUBLE, 150.0);
+
+    pvac::MonitorSync monA(client.connect("rec3").monitor());
+
+    testOk1(monA.wait(3.0) && monA.poll());
+    testFieldEqual<pvd::PVDouble>(monA.root, "value", 3.0);
+    testFieldEqual<pvd::PVDouble>(monA.root, "display.limitHigh", 150.0);
+    {
+        epicsGuard<epicsMutex> G(pv->lock);
+        testOk(!!pv->evt_PROPERTY && pv->enabled_PROPERTY, "DBE_PROPERTY subscription");
+    }
+
+    testdbPutFieldOk("rec3", DBR_DOUBLE, 4.0);
+
+    // monV may also see the meta-data refresh, with no selected fields changed
+    bool seen = false;
+    while(!seen && monV.wait(3.0)) {
+        while(monV.poll())
+            seen |= monV.root->getSubFieldT<pvd::PVDouble>("value")->get()==4.0;
+    }
+    testOk(seen, "value only subscriber sees update");
+
+    testOk1(monA.wait(3.0) && monA.poll());
+    testFieldEqual<pvd::PVDouble>(monA.root, "value", 4.0);
+
+    testdbPutFieldOk("rec3.HOPR", DBR_DOUBLE, 200.0);
+}
+
+// blocks the delivering thread in monitorEvent() while 'block' is set
+struct SlowMonitor : public pvac::ClientChannel::MonitorCallback
+{
+    epicsEvent entered, release;
+    int block;
+    SlowMonitor() :block(0) {}
+    virtual ~SlowMonitor() {}
+    virtual void monitorEvent(const pvac::MonitorEvent& evt) OVERRIDE FINAL
+    {
+        if(evt.event!=pvac::MonitorEvent::Data)
+            return;
+        entered.signal();
+        if(epics::atomic::get(block))
+            release.wait();
+    }
+};
+
+void testFanoutSlow(pvac::ClientProvider& client)
+{
+    testDiag("test delivery of one PV while another PV is slow to deliver");
+
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 1.0);
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 2.0);
+
+    SlowMonitor slow;
+    pvac::Monitor monA(client.connect("rec1").monitor(&slow));
+    pvac::MonitorSync monB(client.connect("rec2").monitor());
+
+    testOk1(slow.entered.wait(3.0));
+    while(monA.poll()) {}
+    testOk1(monB.wait(3.0) && monB.poll());
+
+    epics::atomic::set(slow.block, 1);
+
+    testDiag("queue updates of both PVs together, while a worker is blocked by rec1");
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 11.0);
+    testdbPutFieldOk("rec2", DBR_DOUBLE, 12.0);
+
+    testOk1(slow.entered.wait(3.0));
+    testOk1(monB.wait(3.0) && monB.poll());
+    testFieldEqual<pvd::PVDouble>(monB.root, "value", 12.0);
+
+    epics::atomic::set(slow.block, 0);
+    slow.release.signal();
+    monA.cancel();
+}
+
+// wait until 'pv' has converted 'value', and either has updates pending for the fanout worker,
+// or all have been delivered.
+bool waitFanout(const PDBSinglePV::shared_pointer& pv, double value, bool pending)
+{
+    for(unsigned i=0; i<300u; i++) {
+        {
+            epicsGuard<epicsMutex> G(pv->lock);
+            if(pv->complete->getSubFieldT<pvd::PVDouble>("value")->get()==value
+                    && (pending ? !pv->fanout.pending.empty()
+                                : pv->fanout.pending.empty() && !pv->fanout.queued))
+                return true;
+        }
+        epicsThreadSleep(0.01);
+    }
+    return false;
+}
+
+void testFanoutOverflow(pvac::ClientProvider& client, const PDBProvider::shared_pointer& prov)
+{
+    testDiag("test subscriber leaving overflow while older updates are pending for the fanout worker");
+
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 1.0);
+
+    SlowMonitor slow;
+    pvac::Monitor monA(client.connect("rec1").monitor(&slow));
+    pvac::MonitorSync monB(client.connect("rec1").monitor());
+
+    PDBSinglePV::shared_pointer pv(std::tr1::dynamic_pointer_cast<PDBSinglePV>(prov->transient_pv_map.find("rec1")));
+    if(!pv)
+        testAbort("rec1 not a single PV");
+
+    testOk1(slow.entered.wait(3.0));
+    while(monA.poll()) {}
+    testOk1(monB.wait(3.0) && monB.poll());
+
+    testDiag("overflow monB, which is not polled");
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 2.0);
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 3.0);
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 4.0);
+    testOk1(waitFanout(pv, 4.0, false));
+
+    while(monA.poll()) {}
+    while(slow.entered.tryWait()) {}
+    epics::atomic::set(slow.block, 1);
+
+    testDiag("block the fanout worker of rec1, and queue updates behind it");
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 5.0);
+    testOk1(slow.entered.wait(3.0));
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 6.0);
+    testdbPutFieldOk("rec1", DBR_DOUBLE, 7.0);
+    testOk1(waitFanout(pv, 7.0, true));
+
+    std::vector<double> values;
+
+    testDiag("monB leaves overflow.  Must not see 7 before 5 and 6");
+    while(monB.poll())
+        values.push_back(monB.root->getSubFieldT<pvd::PVDouble>("value")->get());
+
+    epics::atomic::set(slow.block, 0);
+    slow.release.signal();
+    testOk1(waitFanout(pv, 7.0, false));
+
+    while(monB.poll())
+        values.push_back(monB.root->getSubFieldT<pvd::PVDouble>("value")->get());
+
+    bool ordered = true;
+    for(size_t i=1; i<values.size(); i++) {
+        testDiag("monB value %g", values[i]);
+        ordered &= values[i-1] <= values[i];
+    }
+    testOk(ordered, "monB values in order");
+    testEqual(values.empty() ? 0.0 : values.back(), 7.0);
+
+    monA.cancel();
+}
+
+struct FindResult : public pva::ChannelFindRequester
+{
+    POINTER_DEFINITIONS(FindResult);
+    bool found;
+    FindResult() :found(false) {}
+    virtual ~FindResult() {}
+    virtual void channelFindResult(const pvd::Status& status,
+                                   const pva::ChannelFind::shared_pointer& channelFind,
+                                   bool wasFound) OVERRIDE FINAL
+    {
+        found = wasFound;
+    }
+};
+
+bool findPV(const PDBProvider::shared_pointer& prov, const char *name)
+{
+    FindResult::shared_pointer req(new FindResult);
+    prov->channelFind(name, req);
+    return req->found;
+}
+
+void testFind(const PDBProvider::shared_pointer& prov)
+{
+    testDiag("test channelFind()");
+
+    testOk1(findPV(prov, "rec1"));
+    testOk1(findPV(prov, "rec1.HOPR"));
+    testOk1(findPV(prov, "TEST.{\"arr\":{\"i\":2}}"));
+    testOk1(!findPV(prov, "nonexistent"));
+    testOk1(!findPV(prov, "rec1.NONEXISTENT"));
+#ifdef USE_MULTILOCK
+    testOk1(findPV(prov, "grp1"));
+#else
+    testSkip(1, "No multilock");
+#endif
+}
+
+void testList(const PDBProvider::shared_pointer& prov)
+{
+    testDiag("test channelNames()");
+
+    pvd::shared_vector<const std::string> names(prov->channelNames("rec"));
+    testEqual(names.size(), 6u);
+    if(names.size()==6u) {
+        testEqual(names[0], "rec1");
+        testEqual(names[5], "rec6");
+    } else {
+        testSkip(2, "wrong size");
+    }
+    testOk(names.dataPtr()==prov->channel_names.dataPtr(), "not copied");
+
+    testEqual(prov->channelNames("nonexistent").size(), 0u);
+    testEqual(prov->channelNames("").size(), prov->channel_names.size());
+}
+
 void testGroupMonitor(pvac::ClientProvider& client)
 {
     testDiag("test group monitor");
@@ -358,7 +665,7 @@ void p2pTestIoc_registerRecordDeviceDriver(struct dbBase *);
 
 MAIN(testpdb)
 {
-    testPlan(99);
+    testPlan(196);
     try{
         QSRVRegistrar_counters();
         epics::RefSnapshot ref_before;
@@ -384,6 +691,8 @@ MAIN(testpdb)
         PDBProvider::shared_pointer prov(new PDBProvider());
         {
             pvac::ClientProvider client(prov);
+            testFind(prov);
+            testList(prov);
             testSingleGet(client);
             testGroupGet(client);
 
@@ -391,6 +700,9 @@ MAIN(testpdb)
             testGroupPut(client);
 
             testSingleMonitor(client);
+            testSingleMonitorShared(client);
+            testSingleMonitorCoalesce(client);
+            testSingleMonitorLazy(client, prov);
             testGroupMonitor(client);
             testGroupMonitorTriggers(client);
             testFilters(client);
@@ -398,6 +710,23 @@ MAIN(testpdb)
             testEqual(epics::atomic::get(PDBProvider::num_instances), 1u);
         }
 
+        {
+            testDiag("with fanout worker threads, and several dbEvent threads");
+            qsrvFanoutThreads = 2;
+            qsrvEventThreads = 3;
+            PDBProvider::shared_pointer prov2(new PDBProvider());
+            qsrvFanoutThreads = 0;
+            qsrvEventThreads = 1;
+            testEqual(prov2->event_contexts.size(), 3u);
+            {
+                pvac::ClientProvider client(prov2);
+                testSingleMonitorShared(client);
+                testFanoutSlow(client);
+                testFanoutOverflow(client, prov2);
+            }
+            prov2->destroy();
+        }
+
 #ifndef USE_MULTILOCK
         // test w/ 3.15 leaves ref pvac::Monitor::Impl.  Probably transient.
         testTodoBegin("buggy test?");
@@ -638,11 +638,33 @@ void testFilters()
 #endif // >= 7.0
 }
 
+void testPool()
+{
+    testDiag("testPool");
+
+    const void *first;
+    {
+        pvd::shared_vector<void> A(allocPooledArray(pvd::pvDouble, 10));
+        testEqual(A.size(), 80u);
+        testOk1(A.original_type()==pvd::pvDouble);
+        first = A.data();
+    }
+    {
+        // same size class
+        pvd::shared_vector<void> B(allocPooledArray(pvd::pvInt, 30));
+        testEqual(B.size(), 120u);
+        testOk(B.data()==first, "buffer re-used");
+
+        pvd::shared_vector<void> C(allocPooledArray(pvd::pvInt, 30));
+        testOk(C.data()!=first, "buffer in use not re-used");
+    }
+}
+
 } // namespace
 
 MAIN(testpvif)
 {
-    testPlan(98);
+    testPlan(103);
 #ifdef USE_INT64
     testDiag("Testing of 64-bit field access");
 #else
@@ -651,5 +673,6 @@ MAIN(testpvif)
     testScalar();
     testPlain();
     testFilters();
+    testPool();
     return testDone();
 }